@@ -4,26 +4,54 @@
 //===========================================================================================================
 // Example of how to use the undo system
 //===========================================================================================================
+
+// Define XUNDO_EXAMPLE_COUNT_ALLOCATIONS so AllocationBenchmark can count the heap allocations. It replaces the
+// global operator new, like the rest of this file it belongs in a single translation unit.
+#ifdef XUNDO_EXAMPLE_COUNT_ALLOCATIONS
+namespace xundo::example
+{
+    inline std::atomic<std::size_t> g_Allocations = 0;
+}
+
+void* operator new(std::size_t Size)
+{
+    ++xundo::example::g_Allocations;
+    if (auto p = std::malloc(Size ? Size : 1)) return p;
+    throw std::bad_alloc{};
+}
+
+void operator delete(void* p) noexcept
+{
+    std::free(p);
+}
+
+void operator delete(void* p, std::size_t) noexcept
+{
+    std::free(p);
+}
+#endif
+
 namespace xundo::example
 {
     struct fake_dbase
     {
         int m_X = 0, m_Y = 0;
+
+        bool operator==(const fake_dbase&) const = default;     // For xundo::shadow
     };
 
-    // This is a command that moves the cursor
-    struct MoveCursor final : command_base
+    // This is a command that moves the cursor, the backup and undo of the cursor come from command
+    struct MoveCursor final : command<MoveCursor, fake_dbase>
     {
-        MoveCursor(system& System, void* pDataBase) noexcept : command_base(System, "Move", pDataBase)
+        constexpr static std::string_view name_v = "Move";     // For xundo::static_system
+
+        MoveCursor(system& System, void* pDataBase) noexcept : command(System, name_v.data(), pDataBase)
         {
             RegisterArguments();
         }
 
         // relevant data to backup
-        struct data
-        {
-            int X, Y;
-        };
+        constexpr static auto backup_fields_v = std::tuple{ &fake_dbase::m_X, &fake_dbase::m_Y };
 
         // general description of the command
         const char* getCommandHelp() const noexcept override
@@ -44,10 +72,30 @@ namespace xundo::example
             return m_System.Execute(*this, std::format("{} -T {} {}", m_pCommandName, X, Y), UserID);
         }
 
+        // The usual "Move -T x y" is read without the parser, so executing it does not allocate
+        bool ParseInPlace(std::string_view cmd_str) noexcept override
+        {
+            constexpr std::string_view Prefix = "Move -T ";
+            if (cmd_str.starts_with(Prefix) == false) return false;
+
+            const char* pEnd        = cmd_str.data() + cmd_str.size();
+            auto        [pY, ErrX]  = std::from_chars(cmd_str.data() + Prefix.size(), pEnd, m_ToX);
+            if (ErrX != std::errc{} || pY == pEnd || *pY != ' ') return false;
+
+            auto        [pLast, ErrY] = std::from_chars(pY + 1, pEnd, m_ToY);
+            return ErrY == std::errc{} && pLast == pEnd;
+        }
+
         // This is the redo function, as required by the sytem
         std::string Redo() noexcept override
         {
-            if (m_Parser.hasOption(m_hToPos))
+            if (m_bParsedInPlace)
+            {
+                auto& DB = getState();
+                DB.m_X = m_ToX;
+                DB.m_Y = m_ToY;
+            }
+            else if (m_Parser.hasOption(m_hToPos))
             {
                 auto x = m_Parser.getOptionArgAs<int64_t>(m_hToPos, 0);
                 auto y = m_Parser.getOptionArgAs<int64_t>(m_hToPos, 1);
@@ -58,7 +106,7 @@ namespace xundo::example
                 if (std::holds_alternative<xcmdline::parser::error>(y)) 
                     return std::format("Failed to get parameter Y, {}", std::get<xcmdline::parser::error>(y).c_str());
 
-                auto& DB = get<fake_dbase>();
+                auto& DB = getState();
                 DB.m_X = static_cast<int>(std::get<int64_t>(x));
                 DB.m_Y = static_cast<int>(std::get<int64_t>(y));
             }
@@ -67,28 +115,130 @@ namespace xundo::example
             return {};
         }
 
-        // This is the undo function, as required by the system
-        void Undo(undo_file& File) noexcept override
+        // Every move writes the cursor, so moves of different users conflict for selective undo
+        bool getWriteKeys(std::vector<std::uint64_t>& Keys) noexcept override
         {
-            data UndoData{ 0,0 };
-            File.Read(UndoData);
-            auto& DB = get<fake_dbase>();
-
-            printf("Undo: X=%d, Y=%d -> Setting X=%d, Y=%d\n", DB.m_X, DB.m_Y, UndoData.X, UndoData.Y);
-            DB.m_X = UndoData.X;
-            DB.m_Y = UndoData.Y;
+            Keys.push_back(0);
+            return true;
         }
 
-        // This is the backup function, as required by the system
-        void BackupCurrenState(undo_file& File) noexcept override
+        // A move does not depend on anything, only the order of the moves matters
+        bool getReadKeys(std::vector<std::uint64_t>& /*Keys*/) noexcept override
         {
-            auto& DB = get<fake_dbase>();
-            data UndoData{ DB.m_X, DB.m_Y };
-            File.Write(UndoData);
+            return true;
         }
 
         // This is the handle to the position
         xcmdline::parser::handle m_hToPos;
+
+        // The position read by ParseInPlace
+        int m_ToX = 0, m_ToY = 0;
+    };
+
+    // A grid of cells, each cell is a key for RedoBatch
+    struct fake_grid
+    {
+        std::array<int, 64> m_Cells = {};
+
+        bool operator==(const fake_grid&) const = default;
+    };
+
+    // "Set -C cell value" writes one cell. It is copyable, so RedoBatch runs its steps on copies of it
+    struct SetCell final : command<SetCell, fake_grid>
+    {
+        SetCell(system& System, void* pDataBase) noexcept : command(System, "Set", pDataBase)
+        {
+            RegisterArguments();
+        }
+
+        constexpr static auto backup_fields_v = std::tuple{ &fake_grid::m_Cells };
+
+        const char* getCommandHelp() const noexcept override
+        {
+            return "Sets the value of a cell";
+        }
+
+        void RegisterArguments() noexcept override
+        {
+            m_hCell = m_Parser.addOption("C", "Cell and value", true, 2);
+        }
+
+        std::string Redo() noexcept override
+        {
+            auto Cell  = m_Parser.getOptionArgAs<int64_t>(m_hCell, 0);
+            auto Value = m_Parser.getOptionArgAs<int64_t>(m_hCell, 1);
+            if (std::holds_alternative<xcmdline::parser::error>(Cell) || std::holds_alternative<xcmdline::parser::error>(Value)) return "Expecting -C cell value";
+
+            getState().m_Cells[std::get<int64_t>(Cell) % 64] = static_cast<int>(std::get<int64_t>(Value));
+            return {};
+        }
+
+        bool getWriteKeys(std::vector<std::uint64_t>& Keys) noexcept override
+        {
+            auto Cell = m_Parser.getOptionArgAs<int64_t>(m_hCell, 0);
+            if (std::holds_alternative<xcmdline::parser::error>(Cell)) return false;
+            Keys.push_back(std::get<int64_t>(Cell) % 64);
+            return true;
+        }
+
+        bool getReadKeys(std::vector<std::uint64_t>& /*Keys*/) noexcept override
+        {
+            return true;
+        }
+
+        xcmdline::parser::handle m_hCell;
+    };
+
+    // "Add -C from to" adds a cell to another one, so it reads a cell as well
+    struct AddCell final : command<AddCell, fake_grid>
+    {
+        AddCell(system& System, void* pDataBase) noexcept : command(System, "Add", pDataBase)
+        {
+            RegisterArguments();
+        }
+
+        constexpr static auto backup_fields_v = std::tuple{ &fake_grid::m_Cells };
+
+        const char* getCommandHelp() const noexcept override
+        {
+            return "Adds a cell to another one";
+        }
+
+        void RegisterArguments() noexcept override
+        {
+            m_hCells = m_Parser.addOption("C", "From and to cells", true, 2);
+        }
+
+        std::string Redo() noexcept override
+        {
+            auto From = m_Parser.getOptionArgAs<int64_t>(m_hCells, 0);
+            auto To   = m_Parser.getOptionArgAs<int64_t>(m_hCells, 1);
+            if (std::holds_alternative<xcmdline::parser::error>(From) || std::holds_alternative<xcmdline::parser::error>(To)) return "Expecting -C from to";
+
+            auto& Cells = getState().m_Cells;
+            Cells[std::get<int64_t>(To) % 64] += Cells[std::get<int64_t>(From) % 64];
+            return {};
+        }
+
+        bool getWriteKeys(std::vector<std::uint64_t>& Keys) noexcept override
+        {
+            auto To = m_Parser.getOptionArgAs<int64_t>(m_hCells, 1);
+            if (std::holds_alternative<xcmdline::parser::error>(To)) return false;
+            Keys.push_back(std::get<int64_t>(To) % 64);
+            return true;
+        }
+
+        bool getReadKeys(std::vector<std::uint64_t>& Keys) noexcept override
+        {
+            auto From = m_Parser.getOptionArgAs<int64_t>(m_hCells, 0);
+            auto To   = m_Parser.getOptionArgAs<int64_t>(m_hCells, 1);
+            if (std::holds_alternative<xcmdline::parser::error>(From) || std::holds_alternative<xcmdline::parser::error>(To)) return false;
+            Keys.push_back(std::get<int64_t>(From) % 64);
+            Keys.push_back(std::get<int64_t>(To) % 64);
+            return true;
+        }
+
+        xcmdline::parser::handle m_hCells;
     };
 
     // This is used to test the system
@@ -117,6 +267,32 @@ namespace xundo::example
         return 0;
     }
 
+    // Prints the error a step of a test returned, false when there was one
+    bool Check(const std::string& Err) noexcept
+    {
+        if (Err.empty()) return true;
+        printf("%s\n", Err.c_str());
+        assert(false);
+        return false;
+    }
+
+    // Runs the sessions of a test on an undo directory that starts empty, each one with a new system. The session
+    // registers its commands and calls Init itself, it returns false when the test failed.
+    template< typename T_SESSION >
+    int RunSessions(const std::string& Path, int Count, T_SESSION&& Session)
+    {
+        std::error_code Ec;
+        std::filesystem::remove_all(Path, Ec);
+        std::filesystem::create_directories(Path, Ec);
+
+        for (int i = 0; i < Count; ++i)
+        {
+            system System;
+            if (Session(System, i) == false) return 1;
+        }
+        return 0;
+    }
+
     // Stress test with save/destroy/load cycle, mid-stack, and post-undo/redo commands
     int StressTest()
     {
@@ -181,10 +357,17 @@ namespace xundo::example
                 return 1;
             }
 
-            // Verify loaded history
+            // Verify loaded history, the 100 undone steps are still there to be redone
             std::cout << "After init with prior history:\n";
             System.displayHistory();
-            assert(System.m_History.size() == 400 && System.m_UndoIndex == 400);
+            assert(System.m_History.size() == 500 && System.m_UndoIndex == 400);
+            assert(DataBase.m_X == 399 && DataBase.m_Y == 399);
+
+            // Redo one of the steps from the previous session and go back
+            System.Redo();
+            assert(System.m_UndoIndex == 401);
+            assert(DataBase.m_X == 400 && DataBase.m_Y == 400);
+            System.Undo();
             assert(DataBase.m_X == 399 && DataBase.m_Y == 399);
 
             // Add 50 new commands
@@ -219,5 +402,1286 @@ namespace xundo::example
         }
         return 0;
     }
+
+    // Reopens a journal a few times with a byte cap on the history. The history and the cursor come back as they
+    // were and the journal is compacted as it goes, so the file stays within a sixteenth of the cap however much
+    // was written to it.
+    int JournalTest()
+    {
+        const std::string       Path = "x64/UndoJournal";
+        constexpr std::uint64_t Cap  = 64 * 1024;
+
+        fake_dbase  DataBase;
+        std::size_t Size   = 0;
+        int         Cursor = 0;
+        if (RunSessions(Path, 5, [&](system& System, int Session)
+        {
+            MoveCursor MoveCommand(System, &DataBase);
+            if (Check(System.Init(std::make_unique<storage::journal>(Path))) == false) return false;
+            assert(System.m_History.size() == Size && System.m_UndoIndex == Cursor);
+            System.setRetentionPolicy({ .m_MaxBytes = Cap });
+
+            // The step undone at the end of the last session can be redone
+            if (Session)
+            {
+                System.Redo();
+                assert(DataBase.m_X == 3999 && DataBase.m_Y == Session - 1);
+            }
+
+            for (int i = 0; i < 4000; ++i)
+            {
+                if (Check(MoveCommand.Move(i, Session)) == false) return false;
+            }
+            System.Undo();
+            assert(DataBase.m_X == 3998 && DataBase.m_Y == Session);
+
+            // Let the saves still running be counted so the cap holds when the session ends
+            for (std::size_t Steps = 0; Steps != System.m_History.size(); )
+            {
+                System.SynJobQueue();
+                Steps = System.m_History.size();
+                System.EnforceRetention();
+            }
+
+            Size   = System.m_History.size();
+            Cursor = System.m_UndoIndex;
+            return true;
+        })) return 1;
+
+        std::error_code Ec;
+        const auto      FileSize = std::filesystem::file_size(Path + "/UndoJournal.bin", Ec);
+        printf("Journal: %zu bytes after 5 sessions of 4000 steps with a cap of %zu\n", static_cast<std::size_t>(FileSize), static_cast<std::size_t>(Cap));
+        assert(!Ec && FileSize <= Cap + Cap / 16);
+        return FileSize <= Cap + Cap / 16 ? 0 : 1;
+    }
+
+    // Reloads a history much longer than the resident pages with a byte cap on the storage. Right after loading
+    // the bytes accounted must be what the undo directory takes (records, pages and index), without faulting
+    // the evicted pages in, and the cap must hold as the session goes on. The last session reloads the history
+    // after its front was dropped, its pages must be found under the numbers they were saved with.
+    int PagingTest()
+    {
+        const std::string Path = "x64/UndoPaging";
+        auto              DiskBytes = [&]
+        {
+            std::error_code Ec;
+            std::uint64_t   Bytes = 0;
+            for (auto& File : std::filesystem::directory_iterator(Path, Ec)) Bytes += File.file_size();
+            return Bytes;
+        };
+
+        fake_dbase    DataBase;
+        std::uint64_t Bytes = 0;
+        return RunSessions(Path, 3, [&](system& System, int Session)
+        {
+            MoveCursor MoveCommand(System, &DataBase);
+            if (Check(System.Init(Path)) == false) return false;
+            System.SynJobQueue();
+            assert(System.getStorageBytes() == DiskBytes());
+            assert(System.m_History.getResidentPageCount() <= System.m_ResidentPageRadius * 2 + 2);
+
+            if (Session == 2)
+            {
+                assert(System.m_History.getBase() > 0 && System.m_History.getFirstPage() == System.m_History.getBase() / paged_history::page_size_v);
+                System.Undo();
+                assert(DataBase.m_X == 397 && DataBase.m_Y == 1);
+                return System.getStorageBytes() == DiskBytes();
+            }
+
+            if (Session == 0)
+            {
+                for (int i = 0; i < 4000; ++i) (void)MoveCommand.Move(i, 0);
+                System.SynJobQueue();
+                Bytes = System.getStorageBytes();
+                return true;
+            }
+
+            // Keep half of it, a few steps at a time as the work goes on
+            assert(System.m_History.size() == 4000);
+            System.setRetentionPolicy({ .m_MaxBytes = Bytes / 2 });
+            for (int i = 0; i < 400; ++i) (void)MoveCommand.Move(i, 1);
+
+            // Saves still running were not counted by the last steps, the drops go on until they are
+            for (std::size_t Size = 0; Size != System.m_History.size(); )
+            {
+                System.SynJobQueue();
+                Size = System.m_History.size();
+                System.EnforceRetention();
+            }
+            System.SynJobQueue();
+
+            printf("Paging: %llu bytes on disk, %llu after a reload with a cap of %llu\n", static_cast<unsigned long long>(Bytes)
+                , static_cast<unsigned long long>(DiskBytes()), static_cast<unsigned long long>(Bytes / 2));
+            assert(System.getStorageBytes() == DiskBytes() && DiskBytes() <= Bytes / 2);
+
+            System.Undo();
+            assert(DataBase.m_X == 398 && DataBase.m_Y == 1);
+            return System.getStorageBytes() <= Bytes / 2;
+        });
+    }
+
+    // Seeks around a state history that was just reloaded, so it has no keyframes yet. The first Seek rebuilds the
+    // ones on its way, the next ones start from them, and no more than the maximum are ever kept.
+    int StateHistoryTest()
+    {
+        constexpr std::size_t Interval = 8, MaxKeyframes = 4;
+        fake_dbase            DataBase;
+        return RunSessions("x64/UndoState", 2, [&](system& System, int Session)
+        {
+            MoveCursor MoveCommand(System, &DataBase);
+            System.setStateHistory(&DataBase, sizeof(DataBase), Interval, MaxKeyframes);
+            if (Check(System.Init("x64/UndoState")) == false) return false;
+
+            if (Session == 0)
+            {
+                for (int i = 0; i < 1000; ++i) (void)MoveCommand.Move(i, i * 2);
+                return true;
+            }
+
+            // Position P is the state after the move P - 1
+            assert(System.m_State.m_Keyframes.empty());
+            for (const int Position : { 100, 990, 0, 97, 500, 1000 })
+            {
+                if (Check(System.Seek(Position)) == false) return false;
+
+                const fake_dbase Expected = Position ? fake_dbase{ Position - 1, (Position - 1) * 2 } : fake_dbase{};
+                assert(DataBase == Expected);
+                assert(System.m_State.m_Keyframes.size() <= MaxKeyframes);
+                assert(System.m_State.m_Keyframes.contains(Position / Interval * Interval) || Position % Interval);
+                if (DataBase != Expected) return false;
+            }
+            return true;
+        });
+    }
+
+    // A step of the state history whose delta does not fit the block stops Seek, Undo and Redo before it, with the
+    // block, its shadow and the keyframes still matching the cursor
+    int StateFailureTest()
+    {
+        fake_dbase  DataBase;
+        system      System;
+        MoveCursor  MoveCommand(System, &DataBase);
+        System.setStateHistory(&DataBase, sizeof(DataBase), 8, 4);
+        if (Check(System.Init(std::make_unique<storage::memory>())) == false) return 1;
+
+        for (int i = 0; i < 40; ++i) (void)MoveCommand.Move(i, i * 2);
+        System.SynJobQueue();
+
+        auto Corrupt = [&](std::size_t Position)
+        {
+            std::lock_guard<std::mutex> Lock(System.m_History[Position]->m_Mutex);
+            System.m_History[Position]->m_CacheUndoData.pop_back();
+            System.m_State.m_Keyframes.clear();
+        };
+        // Position P is the state after the move P - 1
+        auto State = [](std::uint64_t P) { return P ? fake_dbase{ static_cast<int>(P) - 1, static_cast<int>(P - 1) * 2 } : fake_dbase{}; };
+        auto Stopped = [&](std::size_t Step, int Cursor, const std::string& Err)
+        {
+            const bool bOk = Err.find(std::to_string(System.m_History.getTimeStamp(Step))) != std::string::npos
+                          && System.m_UndoIndex == Cursor && DataBase == State(Cursor)
+                          && std::memcmp(System.m_State.m_Shadow.data(), &DataBase, sizeof(DataBase)) == 0
+                          && std::ranges::all_of(System.m_State.m_Keyframes, [&](auto& K)
+                             {
+                                 const auto Expected = State(K.first);
+                                 return std::memcmp(K.second.data(), &Expected, sizeof(Expected)) == 0;
+                             });
+            assert(bOk);
+            return bOk;
+        };
+
+        Corrupt(20);
+        if (Stopped(20, 21, System.Seek(0)) == false) return 1;
+        System.Undo();
+        if (Stopped(20, 21, std::to_string(System.m_History.getTimeStamp(20))) == false) return 1;
+
+        // Without the cache the good delta comes back from the record
+        System.m_History[20]->m_CacheUndoData.clear();
+        if (Check(System.Seek(0)) == false || DataBase != fake_dbase{}) return 1;
+
+        Corrupt(5);
+        if (Stopped(5, 5, System.Seek(40)) == false) return 1;
+        System.Redo();
+        return Stopped(5, 5, std::to_string(System.m_History.getTimeStamp(5))) ? 0 : 1;
+    }
+
+    // Redoes the same steps with RedoBatch on several threads and with Redo one at a time, the grid must come out
+    // the same. The steps set cells and add cells to others, so many are independent and some wait for others.
+    int RedoBatchTest()
+    {
+        fake_grid Grid;
+        system    System;
+        SetCell   Set(System, &Grid);
+        AddCell   Add(System, &Grid);
+        if (Check(System.Init(std::string_view{}, false)) == false) return 1;
+
+        constexpr int Count = 2000;
+        for (int i = 0; i < Count; ++i)
+        {
+            auto Err = (i % 5 == 4) ? System.Execute(Add, std::format("Add -C {} {}", i * 7, i * 3))
+                                    : System.Execute(Set, std::format("Set -C {} {}", i * 13, i));
+            if (Check(Err) == false) return 1;
+        }
+        const fake_grid Serial = Grid;
+
+        for (const std::size_t Threads : { 1, 2, 8 })
+        {
+            System.setRedoThreads(Threads);
+            (void)System.Seek(0);
+            assert(Grid == fake_grid{});
+
+            if (Check(System.RedoBatch(Count)) == false) return 1;
+            assert(Grid == Serial);
+            if (Grid != Serial) return 1;
+        }
+
+        // And back one at a time
+        (void)System.Seek(0);
+        for (int i = 0; i < Count; ++i) System.Redo();
+        assert(Grid == Serial);
+        return Grid == Serial ? 0 : 1;
+    }
+
+    // Rebuilds a grid from a reloaded history with Replay. Most records are read back from the storage and the
+    // steps are parsed ahead on copies of the commands, the result must be the grid the steps left.
+    int ReplayTest()
+    {
+        constexpr int Count = 3000;
+        fake_grid     Grid;
+        return RunSessions("x64/UndoReplay", 2, [&](system& System, int Session)
+        {
+            SetCell Set(System, &Grid);
+            AddCell Add(System, &Grid);
+            if (Check(System.Init("x64/UndoReplay")) == false) return false;
+
+            if (Session == 0)
+            {
+                for (int i = 0; i < Count; ++i)
+                {
+                    (void)((i % 3 == 2) ? System.Execute(Add, std::format("Add -C {} {}", i * 5, i * 11))
+                                        : System.Execute(Set, std::format("Set -C {} {}", i * 7, i)));
+                }
+                return true;
+            }
+
+            fake_grid    Rebuilt;
+            replay_stats Stats;
+            if (Check(System.Replay(0, Count, &Rebuilt, &Stats)) == false) return false;
+
+            printf("Replay: %zu steps, %zu records read, %.0f steps per second\n", Stats.m_Steps, Stats.m_Loaded, Stats.getStepsPerSecond());
+            assert(Stats.m_Steps == Count && Stats.m_Loaded > 0);
+            assert(Rebuilt == Grid);
+            return Rebuilt == Grid;
+        });
+    }
+
+    // Two users take turns on their own half of a grid. After a reload the users and commands of the steps come from
+    // the index, so the selective undo and the queries work without faulting the evicted pages in.
+    int UserUndoTest()
+    {
+        constexpr int Count = 4000;
+        fake_grid     Grid;
+        return RunSessions("x64/UndoUsers", 2, [&](system& System, int Session)
+        {
+            SetCell Set(System, &Grid);
+            if (Check(System.Init("x64/UndoUsers")) == false) return false;
+
+            // Step i is of user 1 + i % 2, each user has 32 cells
+            if (Session == 0)
+            {
+                for (int i = 0; i < Count; ++i)
+                {
+                    const int User = 1 + i % 2;
+                    (void)System.Execute(Set, std::format("Set -C {} {}", (User - 1) * 32 + (i / 2) % 32, i), User);
+                }
+                return true;
+            }
+
+            for (std::size_t i = 0; i < System.m_History.size(); ++i)
+            {
+                assert(storage::getIndexMetaUser(System.m_History.getMeta(i)) == 1 + static_cast<int>(i % 2));
+            }
+            assert(System.getUserStack(1).m_Applied.size() == Count / 2);
+
+            // The last step of user 1 set cell 15 to Count - 2, the one before it on that cell Count - 66
+            if (Check(System.Undo(1)) == false) return false;
+            assert(Grid.m_Cells[15] == Count - 66);
+            if (Check(System.Redo(1)) == false) return false;
+            assert(Grid.m_Cells[15] == Count - 2);
+
+            const auto Last = System.Query({ .m_UserID = 2, .m_MaxResults = 3 });
+            assert((Last == std::vector<std::size_t>{ Count - 1, Count - 3, Count - 5 }));
+            assert(System.Query({ .m_Command = "Set" }).size() == Count);
+            assert(System.Query({ .m_UserID = 1, .m_Command = "Add" }).empty());
+            return Grid.m_Cells[15] == Count - 2 && Last.size() == 3;
+        });
+    }
+
+    // Grows an undo tree with a branch off the root and one off a step, moves between them and then lets the
+    // retention drop the oldest steps. The branch off the root goes with them, the other one can still be reached.
+    int UndoTreeTest()
+    {
+        fake_dbase DataBase;
+        system     System;
+        MoveCursor MoveCommand(System, &DataBase);
+        if (Check(System.Init(std::string_view{}, false)) == false) return 1;
+        System.setUndoTree(true);
+
+        auto Move = [&](int From, int To)
+        {
+            for (int i = From; i < To; ++i)
+            {
+                if (Check(MoveCommand.Move(i, i)) == false) return false;
+            }
+            return true;
+        };
+
+        // Moves 0 to 9 end up in a branch off the root, 104 and 105 in a branch off 103
+        if (Move(0, 10) == false) return 1;
+        for (int i = 0; i < 10; ++i) System.Undo();
+        if (Move(100, 106) == false) return 1;
+        System.Undo().Undo();
+        if (Move(200, 201) == false) return 1;
+
+        const auto Branches = System.getBranches();
+        assert(Branches.size() == 2 && Branches[0].m_Parent == 0 && Branches[0].m_Steps.size() == 10);
+        const auto Seven    = Branches[0].m_Steps[7].m_TimeStamp;
+        const auto Step103  = System.getHistoryEntry(3).m_TimeStamp;
+        const auto Step105  = Branches[1].m_Steps[1].m_TimeStamp;
+        const auto Step200  = System.getHistoryEntry(4).m_TimeStamp;
+        assert(Branches[1].m_Parent == Step103);
+
+        if (Check(System.SwitchBranch(Seven)) == false) return 1;
+        assert((DataBase == fake_dbase{ 7, 7 }) && System.getHistoryEntry(7).m_TimeStamp == Seven);
+        if (Check(System.SwitchBranch(Step200)) == false) return 1;
+        assert((DataBase == fake_dbase{ 200, 200 }) && System.getBranches().size() == 2);
+
+        // Dropping 100 and 101 takes the root with them
+        System.setRetentionPolicy({ .m_MaxSteps = 3 });
+        assert(System.getBranches().size() == 1 && System.getBranches()[0].m_Parent == Step103);
+        assert(System.SwitchBranch(0).empty() == false);
+
+        if (Check(System.SwitchBranch(Step105)) == false) return 1;
+        assert((DataBase == fake_dbase{ 105, 105 }));
+        return DataBase == fake_dbase{ 105, 105 } && System.getBranches().size() == 1 ? 0 : 1;
+    }
+
+    // Loses the record of a step between two sessions. The step fails to load in the background, so Undo stops
+    // in front of it instead of running a command it does not know.
+    int MissingRecordTest()
+    {
+        const std::string Path = "x64/UndoMissing";
+        fake_dbase        DataBase;
+        std::uint64_t     Lost = 0;
+        return RunSessions(Path, 2, [&](system& System, int Session)
+        {
+            MoveCursor MoveCommand(System, &DataBase);
+            if (Session)
+            {
+                std::error_code Ec;
+                std::filesystem::remove(std::format("{}/UndoStep-{}", Path, Lost), Ec);
+            }
+            if (Check(System.Init(Path)) == false) return false;
+
+            if (Session == 0)
+            {
+                for (int i = 0; i < 10; ++i) (void)MoveCommand.Move(i, i);
+                Lost = System.getHistoryEntry(7).m_TimeStamp;
+                return true;
+            }
+
+            // Undoing 9 and 8 leaves the state of step 7, which can not be undone
+            System.Undo().Undo();
+            assert((DataBase == fake_dbase{ 7, 7 }));
+            System.Undo();
+            assert((DataBase == fake_dbase{ 7, 7 }) && System.getHistoryEntry(7).m_CommandString.empty());
+
+            System.Redo().Redo();
+            assert((DataBase == fake_dbase{ 9, 9 }));
+            return DataBase == fake_dbase{ 9, 9 };
+        });
+    }
+
+    // Detaches a redo tail much longer than the resident pages into a branch. Its evicted pages are not faulted in
+    // for that, their steps are read back when the branch is switched to.
+    int BranchPagingTest()
+    {
+        const std::string Path = "x64/UndoBranchPaging";
+        fake_dbase        DataBase;
+        return RunSessions(Path, 1, [&](system& System, int)
+        {
+            MoveCursor MoveCommand(System, &DataBase);
+            if (Check(System.Init(Path)) == false) return false;
+            System.setUndoTree(true);
+
+            for (int i = 0; i < 3000; ++i) (void)MoveCommand.Move(i, i);
+            const auto Last = System.m_History.getTimeStamp(2999);
+            for (int i = 0; i < 2900; ++i) System.Undo();
+            System.SynJobQueue();
+
+            const auto MaxResident = System.m_ResidentPageRadius * 2 + 2;
+            if (Check(MoveCommand.Move(-1, -1)) == false) return false;
+            const auto& Steps    = System.getBranches()[0].m_Steps;
+            const auto  Resident = std::count_if(Steps.begin(), Steps.end(), [](const branch::step& Step) { return Step.m_Entry != nullptr; });
+            assert(Steps.size() == 2900 && Resident <= static_cast<std::ptrdiff_t>(MaxResident * paged_history::page_size_v));
+            assert(System.m_History.getResidentPageCount() <= MaxResident);
+
+            if (Check(System.SwitchBranch(Last)) == false) return false;
+            assert((DataBase == fake_dbase{ 2999, 2999 }) && System.m_History.size() == 3000);
+            assert(System.getBranches().size() == 1 && System.getBranches()[0].m_Steps.size() == 1);
+
+            System.Undo();
+            assert((DataBase == fake_dbase{ 2998, 2998 }));
+            return DataBase == fake_dbase{ 2998, 2998 };
+        });
+    }
+
+    // Loses the record of a step that the next session moves into a branch. Switching back to that branch can not
+    // redo the step, the switch must say so and leave a tree that can still be switched around.
+    int MissingBranchTest()
+    {
+        const std::string Path = "x64/UndoMissingBranch";
+        fake_dbase        DataBase;
+        std::uint64_t     Lost = 0, Nine = 0;
+        return RunSessions(Path, 2, [&](system& System, int Session)
+        {
+            MoveCursor MoveCommand(System, &DataBase);
+            if (Session)
+            {
+                std::error_code Ec;
+                std::filesystem::remove(std::format("{}/UndoStep-{}", Path, Lost), Ec);
+            }
+            if (Check(System.Init(Path)) == false) return false;
+
+            if (Session == 0)
+            {
+                for (int i = 0; i < 10; ++i) (void)MoveCommand.Move(i, i);
+                Lost = System.getHistoryEntry(7).m_TimeStamp;
+                Nine = System.getHistoryEntry(9).m_TimeStamp;
+                System.Undo().Undo().Undo();
+                return true;
+            }
+
+            // Steps 7 to 9 become a branch off step 6
+            System.setUndoTree(true);
+            if (Check(MoveCommand.Move(100, 100)) == false) return false;
+            const auto Step100 = System.getHistoryEntry(7).m_TimeStamp;
+
+            // The branch is brought back but its first step can not be redone
+            assert(System.SwitchBranch(Nine).find(std::to_string(Lost)) != std::string::npos);
+            assert((DataBase == fake_dbase{ 6, 6 }) && System.getHistoryEntry(9).m_TimeStamp == Nine);
+            assert(System.getBranches().size() == 1 && System.getBranches()[0].m_Parent == System.getHistoryEntry(6).m_TimeStamp);
+
+            if (Check(System.SwitchBranch(Step100)) == false) return false;
+            assert((DataBase == fake_dbase{ 100, 100 }));
+            return DataBase == fake_dbase{ 100, 100 };
+        });
+    }
+
+    // storage::memory that refuses the records while m_bFail is set, the way a full disk would
+    struct failing_storage final : storage::base
+    {
+        bool PutRecord(history_entry& Entry) noexcept override
+        {
+            return m_bFail == false && m_Memory.PutRecord(Entry);
+        }
+
+        bool GetRecord(history_entry& Entry, bool bLoadKeyData, bool bLoadCacheData) noexcept override
+        {
+            while (m_bHold) std::this_thread::yield();
+            return m_Memory.GetRecord(Entry, bLoadKeyData, bLoadCacheData);
+        }
+
+        void        DeleteRecord(std::uint64_t TimeStamp)                   noexcept override { m_Memory.DeleteRecord(TimeStamp); }
+        std::string AppendIndex (std::span<const std::byte> Ops)            noexcept override { return m_bFailIndex ? "Error: index refused" : m_Memory.AppendIndex(Ops); }
+        std::string WriteIndex  (std::span<const std::byte> Snapshot)       noexcept override { return m_Memory.WriteIndex(Snapshot); }
+        std::string ReadIndex   (std::vector<std::byte>& Log)               noexcept override { return m_Memory.ReadIndex(Log); }
+        bool        hasIndex    (void)                              const   noexcept override { return m_Memory.hasIndex(); }
+
+        std::atomic<bool>   m_bFail     = false;
+        std::atomic<bool>   m_bHold     = false;                    // Reads wait until it is cleared
+        std::atomic<bool>   m_bFailIndex= false;                    // The index log refuses appends
+        storage::memory     m_Memory    = {};
+    };
+
+    // Steps whose record the storage refuses stay in memory, the index log goes on past them and they can still be
+    // undone during the session
+    int SaveFailureTest()
+    {
+        fake_dbase  DataBase;
+        system      System;
+        MoveCursor  MoveCommand(System, &DataBase);
+        auto        Storage  = std::make_unique<failing_storage>();
+        auto&       Failing  = *Storage;
+        if (Check(System.Init(std::move(Storage))) == false) return 1;
+
+        for (int i = 0; i < 20; ++i)
+        {
+            Failing.m_bFail = (i >= 10 && i < 15);
+            if (Check(MoveCommand.Move(i, i)) == false) return 1;
+            System.SynJobQueue();
+        }
+
+        // Every push made it to the index, the ones of the lost records without a size
+        std::vector<std::byte> Log;
+        storage::index_state   Index;
+        if (Check(Failing.ReadIndex(Log)) == false) return 1;
+        storage::ReplayIndexLog(Log, Index);
+        assert(Index.m_TimeStamps.size() == 20 && Index.m_Cursor == 20);
+        for (int i = 0; i < 20; ++i) assert((Index.m_Sizes[i] == 0) == (i >= 10 && i < 15));
+
+        for (int i = 19; i >= 0; --i)
+        {
+            System.Undo();
+            const fake_dbase Expected = i ? fake_dbase{ i - 1, i - 1 } : fake_dbase{};
+            assert(DataBase == Expected);
+            if (DataBase != Expected) return 1;
+        }
+        return Index.m_TimeStamps.size() == 20 ? 0 : 1;
+    }
+
+    // When the index log refuses a write the operations stay pending, and so do the deletes of the records the
+    // index on disk still has, the next flush writes them all
+    int IndexFailureTest()
+    {
+        fake_dbase  DataBase;
+        system      System;
+        MoveCursor  MoveCommand(System, &DataBase);
+        auto        Storage  = std::make_unique<failing_storage>();
+        auto&       Failing  = *Storage;
+        if (Check(System.Init(std::move(Storage))) == false) return 1;
+
+        for (int i = 0; i < 10; ++i)
+        {
+            if (Check(MoveCommand.Move(i, i)) == false) return 1;
+        }
+        for (int i = 0; i < 3; ++i) System.Undo();
+        System.SynJobQueue();
+
+        // Truncating the three undone steps queues the deletes of their records behind the refused write
+        Failing.m_bFailIndex = true;
+        if (Check(MoveCommand.Move(100, 100)) == false) return 1;
+        System.SynJobQueue();
+        assert(Failing.m_Memory.m_Records.size() == 11);
+
+        std::vector<std::byte> Log;
+        storage::index_state   Index;
+        if (Check(Failing.ReadIndex(Log)) == false) return 1;
+        storage::ReplayIndexLog(Log, Index);
+        assert(Index.m_TimeStamps.size() == 10 && Index.m_Cursor == 7);
+
+        Failing.m_bFailIndex = false;
+        if (Check(MoveCommand.Move(101, 101)) == false) return 1;
+        System.SynJobQueue();
+
+        Index = {};
+        if (Check(Failing.ReadIndex(Log)) == false) return 1;
+        storage::ReplayIndexLog(Log, Index);
+        assert(Index.m_TimeStamps.size() == 9 && Index.m_Cursor == 9);
+        for (int i = 0; i < 9; ++i) assert(Index.m_Sizes[i] != 0);
+        return Failing.m_Memory.m_Records.size() == 9 && Index.m_TimeStamps.size() == 9 ? 0 : 1;
+    }
+
+    // getPosition finds the steps by time stamp across the table growing and the front of the history being
+    // dropped, and the prefetch does not queue a step again while its cache is still on the way
+    int PositionIndexTest()
+    {
+        fake_dbase  DataBase;
+        system      System;
+        MoveCursor  MoveCommand(System, &DataBase);
+        auto        Storage  = std::make_unique<failing_storage>();
+        auto&       Failing  = *Storage;
+        if (Check(System.Init(std::move(Storage))) == false) return 1;
+
+        auto Positions = [&]
+        {
+            for (std::size_t i = 0; i < System.m_History.size(); ++i)
+            {
+                auto Position = System.getPosition(System.getHistoryEntry(i).m_TimeStamp);
+                assert(Position && *Position == i);
+                if (!Position || *Position != i) return false;
+            }
+            return true;
+        };
+
+        // The table starts with 64 slots so 300 steps rebuild it a few times
+        for (int i = 0; i < 300; ++i)
+        {
+            if (Check(MoveCommand.Move(i, i)) == false) return 1;
+        }
+        System.SynJobQueue();
+        if (Positions() == false) return 1;
+
+        const auto Dropped = System.getHistoryEntry(0).m_TimeStamp;
+        System.setRetentionPolicy({ .m_MaxSteps = 100 });
+        for (int i = 300; i < 400; ++i)
+        {
+            if (Check(MoveCommand.Move(i, i)) == false) return 1;
+            System.SynJobQueue();
+        }
+        assert(System.m_History.size() == 100 && !System.getPosition(Dropped) && !System.getPosition(~std::uint64_t(0)));
+        if (Positions() == false) return 1;
+
+        // The old steps were saved and lost their cache to the LRU. With the reads held back the caches the prefetch asks for
+        // stay empty, asking again must not queue them twice
+        Failing.m_bHold = true;
+        const auto UndoIndex = System.m_UndoIndex;
+        System.m_UndoIndex = 20;
+        System.UpdateLRU();
+        const auto LRUSize = System.m_LRU.size();
+        System.UpdateLRU();
+        std::size_t Queued = 0;
+        for (int i = 15; i <= 25; ++i)
+        {
+            const auto Count = std::count(System.m_LRU.begin(), System.m_LRU.end(), System.m_History[i]);
+            assert(Count == (i != 20));
+            Queued += System.m_History.isCacheQueued(i);
+        }
+        assert(Queued == 10 && System.m_LRU.size() <= LRUSize);
+        System.m_UndoIndex = UndoIndex;
+        Failing.m_bHold = false;
+        System.SynJobQueue();
+
+        return Queued == 10 ? 0 : 1;
+    }
+
+    // "Jump -T x y" moves the cursor like Move, but its backup forgets m_Y: the kind of bug the shadow validation
+    // is there to catch
+    struct Jump final : command<Jump, fake_dbase>
+    {
+        Jump(system& System, void* pDataBase) noexcept : command(System, "Jump", pDataBase)
+        {
+            RegisterArguments();
+        }
+
+        constexpr static auto backup_fields_v = std::tuple{ &fake_dbase::m_X };
+
+        const char* getCommandHelp() const noexcept override
+        {
+            return "Moves the cursor, only X comes back on undo";
+        }
+
+        void RegisterArguments() noexcept override
+        {
+            m_hToPos = m_Parser.addOption("T", "Translate to X, Y position in abs values", true, 2);
+        }
+
+        std::string Move(int X, int Y) noexcept
+        {
+            return m_System.Execute(*this, std::format("{} -T {} {}", m_pCommandName, X, Y));
+        }
+
+        std::string Redo() noexcept override
+        {
+            auto x = m_Parser.getOptionArgAs<int64_t>(m_hToPos, 0);
+            auto y = m_Parser.getOptionArgAs<int64_t>(m_hToPos, 1);
+            if (std::holds_alternative<xcmdline::parser::error>(x) || std::holds_alternative<xcmdline::parser::error>(y)) return "Expecting -T x y";
+
+            auto& DB = getState();
+            DB.m_X = static_cast<int>(std::get<int64_t>(x));
+            DB.m_Y = static_cast<int>(std::get<int64_t>(y));
+            return {};
+        }
+
+        xcmdline::parser::handle m_hToPos;
+    };
+
+    // Checks every step on the shadow database. The moves undo cleanly, each jump must show up as a mismatch. The
+    // steps of a state history are deltas of the block, they are not sampled
+    int ShadowValidationTest()
+    {
+        shadow<fake_dbase>  Shadow;                             // Outlives the system, which checks against it
+        MoveCursor          ShadowMove(Shadow.m_System, nullptr);
+        Jump                ShadowJump(Shadow.m_System, nullptr);
+
+        fake_dbase  DataBase;
+        system      System;
+        MoveCursor  MoveCommand(System, &DataBase);
+        Jump        JumpCommand(System, &DataBase);
+        if (Check(System.Init(std::string_view{}, false)) == false) return 1;
+        System.setShadowValidation(&Shadow, { .m_SampleRate = 1, .m_CpuBudget = 1000, .m_MaxPending = 1000 });
+
+        for (int i = 0; i < 20; ++i)
+        {
+            if (Check(MoveCommand.Move(i, i)) == false) return 1;
+            if (i % 4 == 3 && Check(JumpCommand.Move(-i, 1000 + i)) == false) return 1;
+        }
+
+        auto       Stats    = System.getValidationStats();
+        const auto Deadline = std::chrono::steady_clock::now() + std::chrono::seconds(10);
+        while (Stats.m_Checked < Stats.m_Sampled && std::chrono::steady_clock::now() < Deadline)
+        {
+            std::this_thread::sleep_for(std::chrono::milliseconds(1));
+            Stats = System.getValidationStats();
+        }
+        System.setShadowValidation(nullptr);
+
+        assert(Stats.m_Sampled == 25 && Stats.m_Checked == 25 && Stats.m_Skipped == 0);
+        assert(Stats.m_Mismatches == 5 && Stats.m_Failures.size() == 5);
+        for (auto& Failure : Stats.m_Failures) assert(Failure.find("'Jump -T ") != std::string::npos);
+
+        system      StateSystem;
+        MoveCursor  StateMove(StateSystem, &DataBase);
+        StateSystem.setStateHistory(&DataBase, sizeof(DataBase));
+        if (Check(StateSystem.Init(std::string_view{}, false)) == false) return 1;
+        StateSystem.setShadowValidation(&Shadow, { .m_SampleRate = 1, .m_CpuBudget = 1000, .m_MaxPending = 1000 });
+        for (int i = 0; i < 20; ++i)
+        {
+            if (Check(StateMove.Move(i, i)) == false) return 1;
+        }
+        const auto StateStats = StateSystem.getValidationStats();
+        StateSystem.setShadowValidation(nullptr);
+        assert(StateStats.m_Sampled == 0);
+
+        return Stats.m_Checked == 25 && Stats.m_Mismatches == 5 && StateStats.m_Sampled == 0 ? 0 : 1;
+    }
+
+    // "Warp -T x y" moves the cursor as well and counts its runs of Redo. Its Undo puts back what BackupCurrenState
+    // wrote, so it can restore the state after the step too
+    struct Warp final : command<Warp, fake_dbase>
+    {
+        Warp(system& System, void* pDataBase) noexcept : command(System, "Warp", pDataBase)
+        {
+            RegisterArguments();
+        }
+
+        constexpr static auto backup_fields_v = std::tuple{ &fake_dbase::m_X, &fake_dbase::m_Y };
+
+        const char* getCommandHelp() const noexcept override
+        {
+            return "Moves the cursor, redo restores the position";
+        }
+
+        void RegisterArguments() noexcept override
+        {
+            m_hToPos = m_Parser.addOption("T", "Translate to X, Y position in abs values", true, 2);
+        }
+
+        bool canRestoreForward() const noexcept override
+        {
+            return true;
+        }
+
+        std::string Move(int X, int Y) noexcept
+        {
+            return m_System.Execute(*this, std::format("{} -T {} {}", m_pCommandName, X, Y));
+        }
+
+        std::string Redo() noexcept override
+        {
+            auto x = m_Parser.getOptionArgAs<int64_t>(m_hToPos, 0);
+            auto y = m_Parser.getOptionArgAs<int64_t>(m_hToPos, 1);
+            if (std::holds_alternative<xcmdline::parser::error>(x) || std::holds_alternative<xcmdline::parser::error>(y)) return "Expecting -T x y";
+
+            auto& DB = getState();
+            DB.m_X = static_cast<int>(std::get<int64_t>(x));
+            DB.m_Y = static_cast<int>(std::get<int64_t>(y));
+            ++m_Redos;
+            return {};
+        }
+
+        xcmdline::parser::handle    m_hToPos;
+        int                         m_Redos = 0;
+    };
+
+    // The first ten warps are too quick for the default forward policy and are redone by running Redo, the next
+    // ten keep their "after" payload and are redone from it, in the session and after a reload
+    int ForwardRedoTest()
+    {
+        const std::string Path = "x64/UndoForward";
+
+        fake_dbase DataBase;
+        return RunSessions(Path, 2, [&](system& System, int Session)
+        {
+            Warp WarpCommand(System, &DataBase);
+            if (Check(System.Init(Path)) == false) return false;
+
+            auto Redo = [&]
+            {
+                for (int i = 0; i < 20; ++i) System.Redo();
+                assert((DataBase == fake_dbase{ 19, -19 }) && WarpCommand.m_Redos == 10);
+                return DataBase == fake_dbase{ 19, -19 } && WarpCommand.m_Redos == 10;
+            };
+
+            if (Session == 1) return Redo();
+
+            for (int i = 0; i < 20; ++i)
+            {
+                if (i == 10) System.setForwardPolicy({ .m_MinRedoTime = {}, .m_NsPerByte = 0 });
+                if (Check(WarpCommand.Move(i, -i)) == false) return false;
+            }
+            for (int i = 0; i < 20; ++i) System.Undo();
+            assert((DataBase == fake_dbase{}));
+
+            WarpCommand.m_Redos = 0;
+            if (Redo() == false) return false;
+            for (int i = 0; i < 20; ++i) System.Undo();
+            return DataBase == fake_dbase{};
+        });
+    }
+
+    // A database that lives in one block of memory which keeps its place, for the automatic backups
+    struct fake_arena
+    {
+        std::array<int, 4096> m_Cells = {};
+
+        bool operator==(const fake_arena&) const = default;
+    };
+
+    // "Poke -C cell value" writes one cell of the arena. The system backs the arena up by itself, so
+    // BackupCurrenState and Undo are never called; they count the calls to make sure of it
+    struct Poke final : command_base
+    {
+        Poke(system& System, void* pDataBase) noexcept : command_base(System, "Poke", pDataBase)
+        {
+            RegisterArguments();
+        }
+
+        const char* getCommandHelp() const noexcept override
+        {
+            return "Writes a cell of the arena";
+        }
+
+        void RegisterArguments() noexcept override
+        {
+            m_hCell = m_Parser.addOption("C", "Cell and value", true, 2);
+        }
+
+        std::span<std::byte> getAutoBackupArena() noexcept override
+        {
+            return std::as_writable_bytes(std::span{ get<fake_arena>().m_Cells });
+        }
+
+        std::string Redo() noexcept override
+        {
+            auto Cell  = m_Parser.getOptionArgAs<int64_t>(m_hCell, 0);
+            auto Value = m_Parser.getOptionArgAs<int64_t>(m_hCell, 1);
+            if (std::holds_alternative<xcmdline::parser::error>(Cell) || std::holds_alternative<xcmdline::parser::error>(Value)) return "Expecting -C cell value";
+
+            get<fake_arena>().m_Cells[std::get<int64_t>(Cell) % 4096] = static_cast<int>(std::get<int64_t>(Value));
+            return {};
+        }
+
+        void Undo(undo_file& /*File*/) noexcept override
+        {
+            ++m_ManualCalls;
+        }
+
+        void BackupCurrenState(undo_file& /*File*/) noexcept override
+        {
+            ++m_ManualCalls;
+        }
+
+        xcmdline::parser::handle    m_hCell;
+        int                         m_ManualCalls = 0;
+    };
+
+    // Pokes cells of a 16 KB arena, each step must keep only the cell it changed. Undoing and redoing everything,
+    // in the session and after a reload (most payloads then come from the records), gives back the arena as it was
+    int AutoBackupTest()
+    {
+        const std::string Path = "x64/UndoArena";
+
+        auto       Arena    = std::make_unique<fake_arena>();
+        fake_arena Expected = {};
+        for (int i = 0; i < 100; ++i) Expected.m_Cells[i * 37 % 4096] = i + 1;
+
+        return RunSessions(Path, 2, [&](system& System, int Session)
+        {
+            Poke PokeCommand(System, Arena.get());
+            if (Check(System.Init(Path)) == false) return false;
+
+            if (Session == 0)
+            {
+                for (int i = 0; i < 100; ++i)
+                {
+                    if (Check(System.Execute(PokeCommand, std::format("Poke -C {} {}", i * 37, i + 1))) == false) return false;
+                    assert(System.getHistoryEntry(i).m_CacheUndoData.size() <= 32);
+                }
+                assert(*Arena == Expected);
+
+                for (int i = 0; i < 100; ++i) System.Undo();
+                assert(*Arena == fake_arena{});
+                for (int i = 0; i < 100; ++i) System.Redo();
+                assert(*Arena == Expected);
+            }
+
+            // The first session leaves the cursor in the middle, the second one goes both ways from there
+            for (int i = 0; i < 50; ++i) System.Undo();
+            if (Session == 1)
+            {
+                assert(*Arena == fake_arena{});
+                for (int i = 0; i < 100; ++i) System.Redo();
+                assert(*Arena == Expected);
+            }
+            assert(PokeCommand.m_ManualCalls == 0);
+            return PokeCommand.m_ManualCalls == 0 && (Session == 0 || *Arena == Expected);
+        });
+    }
+
+    // A step whose automatic backup does not fit the arena is not undone, the cursor stays after it
+    int BadBackupTest()
+    {
+        auto    Arena   = std::make_unique<fake_arena>();
+        system  System;
+        Poke    PokeCommand(System, Arena.get());
+        if (Check(System.Init(std::make_unique<storage::memory>())) == false) return 1;
+
+        for (int i = 0; i < 3; ++i)
+        {
+            if (Check(System.Execute(PokeCommand, std::format("Poke -C {} {}", i, i + 1))) == false) return 1;
+        }
+        System.SynJobQueue();
+
+        // Cut the delta of the last step short
+        {
+            std::lock_guard<std::mutex> Lock(System.m_History[2]->m_Mutex);
+            System.m_History[2]->m_CacheUndoData.pop_back();
+        }
+        System.Undo();
+        assert(System.m_UndoIndex == 3 && Arena->m_Cells[2] == 3);
+
+        // The steps before it are still fine once the cursor gets past it
+        System.m_History[2]->m_CacheUndoData.clear();
+        System.Undo().Undo();
+        assert(System.m_UndoIndex == 1 && Arena->m_Cells[1] == 0 && Arena->m_Cells[0] == 1);
+        return System.m_UndoIndex == 1 ? 0 : 1;
+    }
+
+    enum class fake_kind : std::int16_t { none, negative = -2, big = 30000 };
+
+    struct fake_point
+    {
+        std::int32_t    m_X = 0;
+        std::int32_t    m_Y = 0;
+
+        constexpr static auto fields_v = std::tuple{ &fake_point::m_X, &fake_point::m_Y };
+
+        bool operator==(const fake_point&) const = default;
+    };
+
+    // A bit of every kind of field undo_file::Serialize knows
+    struct fake_record
+    {
+        std::int64_t                        m_Min       = 0;
+        std::uint64_t                       m_Max       = 0;
+        std::int8_t                         m_Byte      = 0;
+        bool                                m_bFlag     = false;
+        fake_kind                           m_Kind      = fake_kind::none;
+        std::string                         m_Name      = {};
+        std::vector<std::int32_t>           m_Values    = {};
+        std::vector<std::string>            m_Tags      = {};
+        std::map<std::int32_t, std::string> m_Names     = {};
+        std::list<std::int64_t>             m_Keys      = {};
+        std::optional<std::int32_t>         m_Some      = {};
+        std::optional<std::int32_t>         m_None      = {};
+        std::pair<std::int16_t, fake_point> m_Pair      = {};
+        std::array<fake_point, 2>           m_Corners   = {};
+        std::vector<fake_point>             m_Path      = {};
+
+        constexpr static auto fields_v = std::tuple{ &fake_record::m_Min, &fake_record::m_Max, &fake_record::m_Byte, &fake_record::m_bFlag
+            , &fake_record::m_Kind, &fake_record::m_Name, &fake_record::m_Values, &fake_record::m_Tags, &fake_record::m_Names
+            , &fake_record::m_Keys, &fake_record::m_Some, &fake_record::m_None, &fake_record::m_Pair, &fake_record::m_Corners
+            , &fake_record::m_Path };
+
+        bool operator==(const fake_record&) const = default;
+    };
+
+    // Writes values with undo_file::Serialize and reads them back. Integers are zigzag varints, so the bytes they
+    // take depend on their magnitude only, up to ten for the 64 bit extremes. Containers of trivially copyable
+    // elements are their count and one copy, and reading into a container replaces what it had.
+    int SerializationTest()
+    {
+        history_entry Entry;
+        auto RoundTrip = [&](auto Value)
+        {
+            Entry.m_CacheUndoData.clear();
+            undo_file Out(Entry);
+            Out.Serialize(Value);
+
+            decltype(Value) Back{};
+            undo_file In(Entry);
+            In.Deserialize(Back);
+            assert(Back == Value && In.m_Index == Out.m_Index && Out.m_Index == Entry.m_CacheUndoData.size());
+            return Back == Value ? Out.m_Index : 0;
+        };
+
+        assert(RoundTrip(std::int64_t{ 0 }) == 1 && RoundTrip(std::int64_t{ -1 }) == 1 && RoundTrip(std::int64_t{ 63 }) == 1 && RoundTrip(std::int64_t{ -64 }) == 1);
+        assert(RoundTrip(std::int64_t{ 64 }) == 2 && RoundTrip(std::int64_t{ -65 }) == 2);
+        assert(RoundTrip(std::numeric_limits<std::int64_t>::min()) == 10 && RoundTrip(std::numeric_limits<std::int64_t>::max()) == 10);
+        assert(RoundTrip(std::numeric_limits<std::uint64_t>::max()) == 10 && RoundTrip(std::uint32_t{ 127 }) == 1 && RoundTrip(std::uint32_t{ 128 }) == 2);
+        assert(RoundTrip(std::numeric_limits<std::int32_t>::min()) == 5 && RoundTrip(std::numeric_limits<std::int16_t>::min()) == 3);
+        assert(RoundTrip(std::int8_t{ -128 }) == 1 && RoundTrip(fake_kind::big) == 3 && RoundTrip(fake_kind::negative) == 1);
+        assert(RoundTrip(std::vector<std::int32_t>(1000, -1)) == 2 + 4000 && RoundTrip(std::string(300, 'x')) == 2 + 300);
+        assert(RoundTrip(std::vector<std::int32_t>{}) == 1 && RoundTrip(std::array<std::int32_t, 3>{ 1, 2, 3 }) == 12);
+
+        fake_record Record;
+        Record.m_Min     = std::numeric_limits<std::int64_t>::min();
+        Record.m_Max     = std::numeric_limits<std::uint64_t>::max();
+        Record.m_Byte    = -7;
+        Record.m_bFlag   = true;
+        Record.m_Kind    = fake_kind::negative;
+        Record.m_Name    = "record";
+        Record.m_Values  = { 0, -1, std::numeric_limits<std::int32_t>::min(), std::numeric_limits<std::int32_t>::max() };
+        Record.m_Tags    = { "", "a", std::string(200, 't') };
+        Record.m_Names   = { { -3, "minus three" }, { 1 << 20, "" } };
+        Record.m_Keys    = { std::numeric_limits<std::int64_t>::min(), 0, 1 };
+        Record.m_Some    = -100;
+        Record.m_Pair    = { -300, { 5, -5 } };
+        Record.m_Corners = { fake_point{ -1, 1 }, fake_point{ 1 << 30, -(1 << 30) } };
+        Record.m_Path    = { { 1, 2 }, { 3, 4 }, { -5, -6 } };
+
+        // Two records back to back, the second read over one that has data already
+        Entry.m_CacheUndoData.clear();
+        {
+            undo_file Out(Entry);
+            Out.Serialize(Record);
+            Out.Serialize(fake_record{});
+        }
+
+        fake_record First, Second = Record;
+        undo_file   In(Entry);
+        In.Deserialize(First);
+        In.Deserialize(Second);
+        assert(First == Record && Second == fake_record{} && In.m_Index == Entry.m_CacheUndoData.size());
+        return First == Record && Second == fake_record{} ? 0 : 1;
+    }
+
+    // Memory-only mode: storage::memory with a byte cap and no disk. The recent payloads stay raw in the cache, the
+    // records are kept compressed and the oldest steps are dropped to stay within the cap. Undoing every step
+    // left reads most of them back from the compressed records.
+    int MemoryOnlyTest()
+    {
+        constexpr std::uint64_t Cap   = 32 * 1024;
+        constexpr int           Steps = 2000;
+
+        fake_grid   Grid;
+        system      System;
+        SetCell     SetCommand(System, &Grid);
+        auto        Storage  = std::make_unique<storage::memory>();
+        auto&       Memory   = *Storage;
+        if (Check(System.Init(std::move(Storage))) == false) return 1;
+        System.setMaxStorageBytes(Cap);
+
+        // Each pass over the grid writes one value, so the payloads (the whole grid) compress well
+        auto Value = [](int i) { return i / 64 % 8 + 1; };
+        for (int i = 0; i < Steps; ++i)
+        {
+            if (Check(System.Execute(SetCommand, std::format("Set -C {} {}", i % 64, Value(i)))) == false) return 1;
+            System.SynJobQueue();
+        }
+        for (std::size_t Size = 0; Size != System.m_History.size(); )
+        {
+            System.SynJobQueue();
+            Size = System.m_History.size();
+            System.EnforceRetention();
+        }
+
+        // Every record left is compressed and together they fit the cap
+        std::uint64_t RecordBytes = 0;
+        for (auto& [TimeStamp, Stored] : Memory.m_Records)
+        {
+            std::uint32_t RawSize;
+            std::memcpy(&RawSize, Stored.data(), sizeof(RawSize));
+            assert(RawSize > Stored.size());
+            RecordBytes += Stored.size();
+        }
+        const auto Kept = System.m_History.size();
+        printf("Memory: %zu of %d steps kept in %llu bytes of records with a cap of %llu\n", Kept, Steps
+            , static_cast<unsigned long long>(RecordBytes), static_cast<unsigned long long>(Cap));
+        assert(Kept < Steps && Memory.m_Records.size() == Kept && System.getStorageBytes() <= Cap);
+
+        // Only the latest steps still have their payload raw
+        assert(System.m_History[0]->m_CacheUndoData.empty() && System.m_History[Kept - 1]->m_CacheUndoData.empty() == false);
+
+        // Undoing everything gives back the grid the dropped steps left
+        fake_grid Expected;
+        for (std::size_t i = 0; i < Steps - Kept; ++i) Expected.m_Cells[i % 64] = Value(static_cast<int>(i));
+        for (std::size_t i = 0; i < Kept; ++i) System.Undo();
+        assert(Grid == Expected);
+        return Grid == Expected ? 0 : 1;
+    }
+
+    // Compares backing up a whole buffer with undo_file::WriteDiff when one int every 4 KB changed, for buffers of
+    // 4 KB to 256 MB. Small buffers are repeated so every size moves about the same amount of memory.
+    int DiffBenchmark()
+    {
+        using clock = std::chrono::steady_clock;
+        auto GBs = [](std::size_t Bytes, clock::duration Time)
+        {
+            return static_cast<double>(Bytes) / std::max(1e-9, std::chrono::duration<double>(Time).count()) / 1e9;
+        };
+
+        printf("%10s %14s %12s %10s %10s %10s\n", "Size", "Full bytes", "Diff bytes", "Copy GB/s", "Diff GB/s", "Apply GB/s");
+        for (std::size_t Size = 4 << 10; Size <= std::size_t{ 256 } << 20; Size *= 4)
+        {
+            std::vector<std::byte> Before(Size, std::byte{ 1 });
+            std::vector<std::byte> After(Before);
+            for (std::size_t i = 0; i < Size; i += 4096) After[i] = std::byte{ 2 };
+
+            const std::size_t   Reps = std::max<std::size_t>(1, (std::size_t{ 64 } << 20) / Size);
+            history_entry       Full, Diff;
+
+            auto Start = clock::now();
+            for (std::size_t i = 0; i < Reps; ++i)
+            {
+                Full.m_CacheUndoData.clear();
+                undo_file(Full).Write(Before.data(), Size);
+            }
+            const auto CopyTime = clock::now() - Start;
+
+            Start = clock::now();
+            for (std::size_t i = 0; i < Reps; ++i)
+            {
+                Diff.m_CacheUndoData.clear();
+                if (undo_file(Diff).WriteDiff(Before.data(), After.data(), Size) == false) return 1;
+            }
+            const auto DiffTime = clock::now() - Start;
+
+            // Bigger buffers do not fit the 32 bits of the delta, they are refused before anything is read
+            assert(undo_file(Diff).WriteDiff(Before.data(), After.data(), diff::max_size_v + 1) == false);
+
+            // Undo and redo in turns, an even count leaves the buffer as it was
+            auto Data = After;
+            Start = clock::now();
+            for (std::size_t i = 0; i < Reps * 2; ++i)
+            {
+                if (undo_file(Diff).ApplyDiff(Data.data(), Size, i & 1) == false) return 1;
+            }
+            const auto ApplyTime = clock::now() - Start;
+
+            undo_file(Diff).ApplyDiff(Data.data(), Size);
+            if (Data != Before)
+            {
+                printf("Error: the diff of %zu bytes does not give back the buffer\n", Size);
+                return 1;
+            }
+
+            printf("%10zu %14zu %12zu %10.2f %10.2f %10.2f\n", Size, Full.m_CacheUndoData.size(), Diff.m_CacheUndoData.size(),
+                GBs(Size * Reps, CopyTime), GBs(Size * Reps, DiffTime), GBs(Size * Reps * 2, ApplyTime));
+        }
+        return 0;
+    }
+
+    // Executes the same moves through system::Execute (name lookup in the string pool plus virtual calls) and
+    // through static_system (compile time name table, direct calls), undoes and redoes them all through both, and
+    // times the name lookups on their own. There is no storage so the rest of the time is the history
+    // bookkeeping, the same for both.
+    int DispatchBenchmark()
+    {
+        using clock = std::chrono::steady_clock;
+        using moves = static_system<MoveCursor>;
+        constexpr int               Count = 200000;
+        fake_dbase                  DataBase;
+        std::vector<std::string>    Commands;
+        for (int i = 0; i < Count; ++i) Commands.push_back(std::format("Move -T {} {}", i, i));
+
+        auto Run = [&](auto&& Execute, system& System)
+        {
+            if (auto Err = System.Init(std::string_view{}, false); Err.empty() == false) printf("%s\n", Err.c_str());
+
+            const auto Start = clock::now();
+            for (const auto& Cmd : Commands)
+            {
+                if (auto Err = Execute(Cmd); Err.empty() == false) printf("%s\n", Err.c_str());
+            }
+            return clock::now() - Start;
+        };
+
+        auto Lookup = [&](auto&& Find)
+        {
+            std::size_t Sum   = 0;
+            const auto  Start = clock::now();
+            for (const auto& Cmd : Commands) Sum += Find(getCommandName(Cmd));
+            if (Sum == ~std::size_t(0)) printf("\n");
+            return clock::now() - Start;
+        };
+
+        // Back to the first move and forward again
+        auto UndoRedo = [&](auto& System)
+        {
+            const auto Start = clock::now();
+            for (int i = 1; i < Count; ++i) System.Undo();
+            assert(DataBase.m_X == 0 && DataBase.m_Y == 0);
+            for (int i = 1; i < Count; ++i) System.Redo();
+            assert(DataBase.m_X == Count - 1 && DataBase.m_Y == Count - 1);
+            return clock::now() - Start;
+        };
+
+        clock::duration DynamicTime, StaticTime, DynamicStepTime, StaticStepTime;
+        {
+            system     System;
+            MoveCursor MoveCommand(System, &DataBase);
+            DynamicTime     = Run([&](std::string_view Cmd) { return System.Execute(Cmd); }, System);
+            DynamicStepTime = UndoRedo(System);
+        }
+        {
+            moves System(&DataBase);
+            StaticTime     = Run([&](std::string_view Cmd) { return System.Execute(Cmd); }, System.getSystem());
+            StaticStepTime = UndoRedo(System);
+        }
+        const auto PoolTime  = Lookup([](std::string_view Name) { return string_pool::getInstance().Find(Name); });
+        const auto TableTime = Lookup([](std::string_view Name) { return moves::Find(Name); });
+
+        auto NsPerStep = [](clock::duration Time) { return std::chrono::duration<double, std::nano>(Time).count() / Count; };
+        printf("system::Execute          %8.1f ns per step\n", NsPerStep(DynamicTime));
+        printf("static_system::Execute   %8.1f ns per step\n", NsPerStep(StaticTime));
+        printf("system::Undo/Redo        %8.1f ns per step\n", NsPerStep(DynamicStepTime) / 2);
+        printf("static_system::Undo/Redo %8.1f ns per step\n", NsPerStep(StaticStepTime) / 2);
+        printf("string_pool::Find        %8.1f ns per lookup\n", NsPerStep(PoolTime));
+        printf("static_system::Find      %8.1f ns per lookup\n", NsPerStep(TableTime));
+        return DataBase.m_X == Count - 1 ? 0 : 1;
+    }
+
+    // Checks that once warm Execute, Undo and Redo of MoveCursor do not allocate: no storage, a retention that
+    // keeps the history at 1000 steps, commands read in place and failures as error codes (TryExecute).
+    int AllocationBenchmark()
+    {
+        fake_dbase  DataBase;
+        system      System;
+        MoveCursor  MoveCommand(System, &DataBase);
+
+        if (auto Err = System.Init(std::string_view{}, false); Err.empty() == false)
+        {
+            printf("%s\n", Err.c_str());
+            return 1;
+        }
+        System.setRetentionPolicy({ .m_MaxSteps = 1000 });
+
+        auto Run = [&](int Count)
+        {
+            char Buffer[64];
+            for (int i = 0; i < Count; ++i)
+            {
+                const int Size = std::snprintf(Buffer, sizeof(Buffer), "Move -T %d %d", i, i);
+                if (System.TryExecute(MoveCommand, { Buffer, static_cast<std::size_t>(Size) }) != exec_error::none) return false;
+
+                // Undoing and executing again moves over steps that are already there
+                if (i % 8 == 0) System.Undo().Undo().Redo();
+            }
+            return true;
+        };
+
+        using clock = std::chrono::steady_clock;
+        constexpr int Count = 100000;
+
+        if (Run(Count) == false) return 1;
+
+    #ifdef XUNDO_EXAMPLE_COUNT_ALLOCATIONS
+        const std::size_t Before = g_Allocations;
+    #endif
+        const auto Start = clock::now();
+        if (Run(Count) == false) return 1;
+        const auto Time  = clock::now() - Start;
+
+        printf("%.1f ns per step\n", std::chrono::duration<double, std::nano>(Time).count() / Count);
+    #ifdef XUNDO_EXAMPLE_COUNT_ALLOCATIONS
+        const std::size_t Allocations = g_Allocations - Before;
+        printf("%zu allocations in %d steps\n", Allocations, Count);
+        return Allocations == 0 ? 0 : 1;
+    #else
+        printf("Define XUNDO_EXAMPLE_COUNT_ALLOCATIONS to count the allocations\n");
+        return 0;
+    #endif
+    }
 }
 #endif
\ No newline at end of file
@@ -16,8 +16,27 @@
 #include <condition_variable>
 #include <queue>
 #include <list>
+#include <deque>
 #include <filesystem>
 #include <cassert>
+#include <cstring>
+#include <span>
+#include <atomic>
+#include <algorithm>
+#include <charconv>
+#include <optional>
+#include <bit>
+#include <map>
+#include <ranges>
+#include <tuple>
+#include <type_traits>
+#include <limits>
+
+#if defined(__AVX2__)
+    #include <immintrin.h>
+#elif defined(__SSE2__) || defined(_M_X64) || defined(_M_AMD64)
+    #include <emmintrin.h>
+#endif
 
 //
 // Dependencies
@@ -26,7 +45,7 @@ namespace xundo
 {
     class system;
     struct command_base;
-    namespace example{ int StressTest(); }
+    namespace example{ int StressTest(); int JournalTest(); int PagingTest(); int StateHistoryTest(); int UserUndoTest(); int SaveFailureTest(); int IndexFailureTest(); int PositionIndexTest(); int MemoryOnlyTest(); int BranchPagingTest(); int BadBackupTest(); int StateFailureTest(); }
 }
 
 //
@@ -34,624 +53,5016 @@ namespace xundo
 //
 namespace xundo
 {
-    // This structure holds the history of commands
-    struct history_entry
+    // This function extracts the command name from a string
+    inline std::string_view getCommandName(std::string_view str)
     {
-        mutable std::mutex      m_Mutex;                 // Mutex to protect the cache
-        int                     m_UserID;                // User ID  
-        std::uint64_t           m_TimeStamp;             // Time stamp
-        std::string             m_CommandString;         // Command string
-        std::vector<std::byte>  m_CacheUndoData;         // Cache undo data
-        bool                    m_bHasBeenSaved = false; // Has this entry been saved to disk
-    };
+        size_t pos = str.find(' ');
+        return pos == std::string_view::npos ? str : str.substr(0, pos);
+    }
 
-    // This class is used to read and write data to the undo cache
-    struct undo_file
+    // Time stamps are milliseconds * 1000, the last three digits tell apart the steps done in the same millisecond
+    inline std::uint64_t toTimeStamp(std::chrono::system_clock::time_point Time) noexcept
     {
-        history_entry&      m_Entry;    // Reference to the history entry
-        std::uint32_t       m_Index;    // Current index
-
-        undo_file(history_entry& Entry, std::uint32_t Index = 0) :m_Entry(Entry), m_Index(Index)
-        {
-        }
+        return static_cast<std::uint64_t>(std::chrono::duration_cast<std::chrono::milliseconds>(Time.time_since_epoch()).count()) * 1000;
+    }
 
-        void Write(const void* pData, std::uint64_t Size) noexcept
-        {
-            auto& Cache = m_Entry.m_CacheUndoData;
-            assert(pData);
-            Cache.insert(Cache.begin() + m_Index, reinterpret_cast<const std::byte*>(pData), reinterpret_cast<const std::byte*>(pData) + Size);
-            m_Index += static_cast<std::uint32_t>(Size);
-        }
+    // Append-only arena for the command strings of the history plus the table of interned command names.
+    // Strings are copied into big chunks so an entry only holds a view; the chunks are reference counted by
+    // the entries pointing into them, so they go away with the pages of the history that used them.
+    // Command names are interned for the life of the program and are identified by a small integer.
+    class string_pool
+    {
+    public:
 
-        template<typename T>
-        void Write(const T& Data) noexcept
-        {
-            Write(&Data, sizeof(T));
-        }
+        constexpr static std::size_t    chunk_size_v    = 64 * 1024;
+        constexpr static std::size_t    kept_chunks_v   = 4;
+        constexpr static std::uint32_t  invalid_id_v    = 0xffffffffu;
 
-        void Read(void* pData, std::uint64_t Size) noexcept
+        struct chunk
         {
-            auto& Cache = m_Entry.m_CacheUndoData;
-            assert(pData && m_Index + Size <= Cache.size());
-            std::memcpy(pData, Cache.data() + m_Index, Size);
-            m_Index += static_cast<std::uint32_t>(Size);
-        }
+            std::unique_ptr<char[]>     m_pData;
+            std::size_t                 m_Capacity;
+            std::size_t                 m_Used      = 0;
+        };
 
-        template<typename T>
-        void Read(T& Data) noexcept
+        static string_pool& getInstance(void) noexcept
         {
-            Read(&Data, sizeof(T));
+            static string_pool Pool;
+            return Pool;
         }
-    };
-
-    // This namespace contains the jobs that are executed by the IO worker
-    namespace job
-    {
-        // Base class for all jobs
-        struct base
-        {
-            virtual            ~base() = default;
-            virtual void        Execute() noexcept = 0;
-        };
 
-        // This job saves the history entry to disk
-        struct save_to_disk final : base
+        // Copies the string into the arena, Chunk keeps the memory alive for as long as the view is used
+        std::string_view Store(std::string_view Str, std::shared_ptr<const chunk>& Chunk) noexcept
         {
-            save_to_disk(system& System, std::shared_ptr<history_entry> Entry) noexcept
-                : m_System(System), m_Entry(Entry)
+            std::lock_guard<std::mutex> Lock(m_Mutex);
+            if (!m_Current || m_Current->m_Capacity - m_Current->m_Used < Str.size())
             {
+                m_Current = NewChunk(Str.size());
             }
 
-            void Execute() noexcept override;
-
-            static bool Save(const history_entry& Entry, std::string_view Path) noexcept
-            {
-                FILE* File;
-                if (auto Err = fopen_s(&File, std::format("{}/UndoStep-{}", Path, Entry.m_TimeStamp).c_str(), "wb"); Err)
-                {
-                    char ErrMsg[100];
-                    strerror_s(ErrMsg, sizeof(ErrMsg), Err);
-                    std::printf("Error: %s\n", ErrMsg);
-                    return false;
-                }
-                bool Ok = true;
-
-                uint32_t DataLen = static_cast<uint32_t>(Entry.m_CacheUndoData.size());
-                Ok &= fwrite(&DataLen, sizeof(uint32_t), 1, File) == 1;
-                Ok &= fwrite(Entry.m_CacheUndoData.data(), DataLen, 1, File) == 1;
-                Ok &= fwrite(&Entry.m_UserID, sizeof(int), 1, File) == 1;
-                Ok &= fwrite(&Entry.m_TimeStamp, sizeof(uint64_t), 1, File) == 1;
-
-                uint32_t StrLen = static_cast<uint32_t>(Entry.m_CommandString.size());
-                Ok &= fwrite(&StrLen, sizeof(uint32_t), 1, File) == 1;
-                Ok &= fwrite(Entry.m_CommandString.data(), StrLen, 1, File) == 1;
-                fclose(File);
-                return Ok;
-            }
-            system&                         m_System;
-            std::shared_ptr<history_entry>  m_Entry;
-        };
+            char* pDest = m_Current->m_pData.get() + m_Current->m_Used;
+            std::memcpy(pDest, Str.data(), Str.size());
+            m_Current->m_Used += Str.size();
+            Chunk = m_Current;
+            return { pDest, Str.size() };
+        }
 
-        // This job deletes the history entries from disk
-        struct delete_entries final : base
+        std::uint32_t Intern(std::string_view Name) noexcept
         {
-            delete_entries(system& System, std::vector<std::uint64_t>&& TimeStamps) noexcept
-                : m_System(System), m_TimeStamps(std::move(TimeStamps))
-            {
-            }
+            std::lock_guard<std::mutex> Lock(m_Mutex);
+            if (auto It = m_NameIDs.find(Name); It != m_NameIDs.end()) return It->second;
 
-            void Execute() noexcept override;
+            const auto ID = static_cast<std::uint32_t>(m_Names.size());
+            m_NameIDs.emplace(m_Names.emplace_back(Name), ID);
+            return ID;
+        }
 
-            system&                     m_System;
-            std::vector<std::uint64_t>  m_TimeStamps;
-        };
+        // Same as Intern but does not add unknown names
+        std::uint32_t Find(std::string_view Name) const noexcept
+        {
+            std::lock_guard<std::mutex> Lock(m_Mutex);
+            if (auto It = m_NameIDs.find(Name); It != m_NameIDs.end()) return It->second;
+            return invalid_id_v;
+        }
 
-        // This job loads the history entry from disk
-        struct warmup_cache final : base
+        std::string_view getName(std::uint32_t ID) const noexcept
         {
-            warmup_cache(system& System, std::shared_ptr<history_entry> Entry) noexcept
-                : m_System(System), m_Entry(Entry)
-            {
-            }
+            std::lock_guard<std::mutex> Lock(m_Mutex);
+            assert(ID < m_Names.size());
+            return m_Names[ID];
+        }
 
-            void Execute() noexcept override;
+    protected:
 
-            static bool Load(history_entry& Entry, std::string_view Path, bool bLoadKeyData, bool bLoadCacheData) noexcept
+        // The last few chunks are kept, once no entry points into one of them anymore it is reused as it is.
+        // A history that stops growing then stops allocating chunks.
+        std::shared_ptr<chunk> NewChunk(std::size_t Size) noexcept
+        {
+            for (auto& Chunk : m_Kept)
             {
-                FILE* File;
-                if (auto Err = fopen_s(&File, std::format("{}/UndoStep-{}", Path, Entry.m_TimeStamp).c_str(), "rb"); Err)
-                {
-                    char ErrMsg[100];
-                    strerror_s(ErrMsg, sizeof(ErrMsg), Err);
-                    std::printf("Error: %s\n", ErrMsg);
-                    return false;
-                }
-
-                bool Ok = true;
-                uint32_t DataLen;
-                Ok &= fread(&DataLen, sizeof(uint32_t), 1, File) == 1;
-
-                if (bLoadCacheData)
-                {
-                    Entry.m_CacheUndoData.resize(DataLen);
-                    Ok &= fread(Entry.m_CacheUndoData.data(), DataLen, 1, File) == 1;
-                }
-                else
-                {
-                    std::fseek(File, DataLen, SEEK_CUR);
-                }
-
-                if (bLoadKeyData)
+                if (Chunk.use_count() == 1 && Chunk->m_Capacity >= Size)
                 {
-                    Ok &= fread(&Entry.m_UserID, sizeof(int), 1, File) == 1;
-                    Ok &= fread(&Entry.m_TimeStamp, sizeof(uint64_t), 1, File) == 1;
-                    uint32_t StrLen;
-                    Ok &= fread(&StrLen, sizeof(uint32_t), 1, File) == 1;
-                    Entry.m_CommandString.resize(StrLen);
-                    Ok &= fread(Entry.m_CommandString.data(), StrLen, 1, File) == 1;
+                    Chunk->m_Used = 0;
+                    return Chunk;
                 }
-
-                fclose(File);
-                return Ok;
             }
 
-            system&                         m_System;
-            std::shared_ptr<history_entry>  m_Entry;
-        };
-
-        // This job deletes the history entries from disk
-        struct load_entries final : base
-        {
-            load_entries(system& System, std::shared_ptr<history_entry> Entry) : m_System(System), m_Entry(Entry)
+            const auto Capacity = std::max(chunk_size_v, Size);
+            auto       Chunk    = std::make_shared<chunk>(chunk{ std::make_unique_for_overwrite<char[]>(Capacity), Capacity });
+            if (Capacity == chunk_size_v)
             {
+                if (m_Kept.size() == kept_chunks_v) m_Kept.erase(m_Kept.begin());
+                m_Kept.push_back(Chunk);
             }
+            return Chunk;
+        }
 
-            void Execute() noexcept override;
-
-            system&                         m_System;
-            std::shared_ptr<history_entry>  m_Entry;
-        };
+        std::shared_ptr<chunk>                              m_Current   = {};
+        std::vector<std::shared_ptr<chunk>>                 m_Kept      = {};   // The newest chunks, for reuse
+        std::deque<std::string>                             m_Names     = {};   // Deque so the views in m_NameIDs stay valid
+        std::unordered_map<std::string_view, std::uint32_t> m_NameIDs   = {};
+        mutable std::mutex                                  m_Mutex     = {};
+    };
 
+    // Whether the key data of an entry (user, command string) is there, entries loaded at startup start pending
+    enum class hydration : std::uint8_t
+    {
+        pending,
+        done,
+        failed,     // The record could not be read, the step can not be undone or redone
     };
 
-    // This is the base class for all commands
-    struct command_base
+    // This structure holds the history of commands
+    struct history_entry
     {
-        command_base(system& System, const char* pName, void* pDataBase) noexcept;
+        mutable std::mutex                          m_Mutex;                    // Mutex to protect the cache
+        int                                         m_UserID;                   // User ID  
+        std::uint64_t                               m_TimeStamp;                // Time stamp
+        std::string_view                            m_CommandString;            // Command string (lives in the string_pool)
+        std::shared_ptr<const string_pool::chunk>   m_StringChunk;              // Keeps m_CommandString alive
+        std::uint32_t                               m_CommandID = string_pool::invalid_id_v; // Interned command name
+        std::vector<std::byte>                      m_CacheUndoData;            // Cache undo data
+        std::uint32_t                               m_ForwardOffset = 0;        // Where the redo payload starts in m_CacheUndoData (zero for none), loaded with it
+        std::uint32_t                               m_StorageSize   = 0;        // Bytes used by the record of this entry in the storage
+        bool                                        m_bHasBeenSaved = false;    // Has this entry been saved to disk
+        bool                                        m_bHasBeenDeleted = false;  // Entry was removed from the history, do not save it anymore
+        bool                                        m_bSaveFailed   = false;    // The storage refused the record, the entry only lives in memory
+        std::atomic<hydration>                      m_Hydration     = hydration::done; // Pending until the startup load fills the key data
+        bool                                        m_bUndone       = false;    // Reverted by a selective undo, Undo/Redo step over it
 
-        template<typename T>T& get() noexcept
+        // Back to a new entry, keeping the memory of the payload unless it grew big (see entry_pool)
+        void Reset(std::size_t MaxKeptBytes) noexcept
         {
-            return *static_cast<T*>(m_pDataBase);
+            m_UserID        = 0;
+            m_TimeStamp     = 0;
+            m_CommandString = {};
+            m_StringChunk.reset();
+            m_CommandID     = string_pool::invalid_id_v;
+            if (m_CacheUndoData.capacity() > MaxKeptBytes) std::vector<std::byte>().swap(m_CacheUndoData);
+            else                                           m_CacheUndoData.clear();
+            m_ForwardOffset   = 0;
+            m_StorageSize     = 0;
+            m_bHasBeenSaved   = false;
+            m_bHasBeenDeleted = false;
+            m_bSaveFailed     = false;
+            m_Hydration       = hydration::done;
+            m_bUndone         = false;
         }
 
-        virtual                        ~command_base        (void)                          noexcept = default;
-        virtual const char*             getCommandHelp      (void)                  const   noexcept = 0;
-        virtual void                    RegisterArguments   (void)                          noexcept = 0;
-        virtual std::string             Redo                (void)                          noexcept = 0;
-        virtual void                    Undo                (undo_file& File)               noexcept = 0;
-        virtual void                    BackupCurrenState   (undo_file& File)               noexcept = 0;
-        std::string                     Parse               (std::string_view cmd_str)      noexcept
+        // Blocks until the key data of the entry is there (only entries loaded at startup ever wait), false when
+        // its record could not be read
+        bool WaitHydrated() const noexcept
         {
-            m_Parser.clearArgs();
-            return m_Parser.Parse(cmd_str);
+            m_Hydration.wait(hydration::pending);
+            return m_Hydration == hydration::done;
         }
 
-        system&                         m_System;
-        xcmdline::parser                m_Parser        = {};
-        const char*                     m_pCommandName  = {};
-        void*                           m_pDataBase     = {};
-        xcmdline::parser::handle        m_hHelp         = {};
+        void setCommandString(std::string_view Str) noexcept
+        {
+            auto& Pool      = string_pool::getInstance();
+            m_CommandString = Pool.Store(Str, m_StringChunk);
+            m_CommandID     = Pool.Intern(getCommandName(Str));
+        }
     };
 
-    // This function extracts the command name from a string
-    std::string_view getCommandName(std::string_view str)
-    {
-        size_t pos = str.find(' ');
-        return pos == std::string_view::npos ? str : str.substr(0, pos);
-    }
-
-    // This is the main class that manages the undo system
-    class system
+    // Recycles the entries made by Execute, with the memory of their payload, and the control blocks of their
+    // shared_ptr so a history that stops growing (retention, undo and execute over the same steps) stops
+    // allocating them. Entries may be let go from any thread (the IO jobs hold them too).
+    // The free lists are capped so that a burst (a big truncate, a reload) does not pin its memory for good: past
+    // max_kept_entries_v the entries and blocks are deleted, and past max_kept_bytes_v they are kept without
+    // their payload.
+    class entry_pool
     {
     public:
 
-        system() = default;
-        ~system() noexcept
+        constexpr static std::size_t max_kept_payload_v = 4 * 1024;    // Bigger payloads are freed, not kept
+        constexpr static std::size_t max_kept_entries_v = 1024;        // Free entries (and control blocks) kept
+        constexpr static std::size_t max_kept_bytes_v   = 1024 * 1024; // Payload memory kept by the free entries
+
+        entry_pool(void) noexcept = default;
+        entry_pool(const entry_pool&) = delete;
+
+        ~entry_pool(void) noexcept
         {
-            //
-            // Make sure we save the timestamps before we exit
-            //
+            for (auto pEntry : m_Entries) delete pEntry;
+            for (auto pBlock : m_Blocks)  ::operator delete(pBlock);
+        }
 
-            // Prune to only active steps
-            if (!m_UndoPath.empty())
+        std::shared_ptr<history_entry> New(void) noexcept
+        {
+            history_entry* pEntry = nullptr;
             {
-                if (m_bAutoLoadSave)
+                std::lock_guard<std::mutex> Lock(m_Mutex);
+                if (m_Entries.empty() == false)
                 {
-                    if (auto Err = SaveTimestamps(); !Err.empty())
-                    {
-                        std::cerr << Err << "\n";
-                    }
+                    pEntry = m_Entries.back();
+                    m_Entries.pop_back();
+                    m_KeptBytes -= pEntry->m_CacheUndoData.capacity();
                 }
             }
+            if (pEntry == nullptr) pEntry = new history_entry;
+            return std::shared_ptr<history_entry>(pEntry, recycler{ this }, allocator<history_entry>{ this });
+        }
 
-            //
-            // Signal the IO threads to exit
-            //
-            if (m_Done==false)
-            {
-                // Set done to true...
-                {
-                    std::lock_guard<std::mutex> lock(m_Mutex);
-                    m_Done = true;
-                }
-                m_Cond.notify_all();
+    protected:
 
-                // wait for the threats to exit
-                for (auto& E : m_IOThread)
+        struct recycler
+        {
+            entry_pool* m_pPool;
+
+            void operator()(history_entry* pEntry) const noexcept
+            {
+                pEntry->Reset(max_kept_payload_v);
                 {
-                    E.join();
+                    std::lock_guard<std::mutex> Lock(m_pPool->m_Mutex);
+                    if (m_pPool->m_Entries.size() < max_kept_entries_v)
+                    {
+                        const auto Bytes = pEntry->m_CacheUndoData.capacity();
+                        if (m_pPool->m_KeptBytes + Bytes > max_kept_bytes_v) std::vector<std::byte>().swap(pEntry->m_CacheUndoData);
+                        else                                                 m_pPool->m_KeptBytes += Bytes;
+                        m_pPool->m_Entries.push_back(pEntry);
+                        return;
+                    }
                 }
+                delete pEntry;
             }
-        }
+        };
 
-        [[nodiscard]] std::string Init( std::string_view UndoPath = {}, bool bAutoLoadSave = true ) noexcept
+        // The control blocks all have the same size, they go back to a free list
+        template<typename T>
+        struct allocator
         {
-            m_UndoPath          = UndoPath;
-            m_bAutoLoadSave     = bAutoLoadSave;
-            m_Done              = false;
+            using value_type = T;
 
-            if (!UndoPath.empty())
-            {
-                for (int i = 0; i < 4; ++i) m_IOThread.emplace_back(std::thread(&system::IOWorker, std::ref(*this)));
+            entry_pool* m_pPool;
+
+            allocator(entry_pool* pPool) noexcept : m_pPool(pPool) {}
+            template<typename U> allocator(const allocator<U>& Other) noexcept : m_pPool(Other.m_pPool) {}
 
-                if (m_bAutoLoadSave)
+            T* allocate(std::size_t Count)
+            {
+                const auto Size = Count * sizeof(T);
                 {
-                    if (std::string Path = std::format("{}/UndoTimestamps.bin", m_UndoPath); std::filesystem::exists(Path) )
+                    std::lock_guard<std::mutex> Lock(m_pPool->m_Mutex);
+                    if (m_pPool->m_Blocks.empty() == false && m_pPool->m_BlockSize == Size)
                     {
-                        return LoadTimestamps(Path);
+                        auto pBlock = m_pPool->m_Blocks.back();
+                        m_pPool->m_Blocks.pop_back();
+                        return static_cast<T*>(pBlock);
                     }
                 }
+                return static_cast<T*>(::operator new(Size));
             }
-            else
+
+            void deallocate(T* p, std::size_t Count) noexcept
             {
-                assert( m_bAutoLoadSave == false );
+                {
+                    std::lock_guard<std::mutex> Lock(m_pPool->m_Mutex);
+                    if (m_pPool->m_Blocks.size() < max_kept_entries_v)
+                    {
+                        m_pPool->m_BlockSize = Count * sizeof(T);
+                        m_pPool->m_Blocks.push_back(p);
+                        return;
+                    }
+                }
+                ::operator delete(p);
             }
 
-            return {};
-        }
+            template<typename U> bool operator==(const allocator<U>& Other) const noexcept { return m_pPool == Other.m_pPool; }
+        };
 
-        [[nodiscard]] std::string Execute(std::string_view cmd_str, int UserID = -1)
-        {
-            assert(m_Done==false);
+        std::mutex                      m_Mutex     = {};
+        std::vector<history_entry*>     m_Entries   = {};
+        std::vector<void*>              m_Blocks    = {};
+        std::size_t                     m_BlockSize = 0;
+        std::size_t                     m_KeptBytes = 0;   // Payload capacity of m_Entries
+    };
 
-            auto name = getCommandName(cmd_str);
-            auto Cmd  = m_Commands.find(std::string(name));
-            
-            if(Cmd != m_Commands.end())
+    // Byte level diff of two buffers of the same size. A delta is a list of runs [offset][size][old bytes][new bytes]
+    // so it can be applied both ways. Equal gaps shorter than min_gap_v are folded into the runs, a run header
+    // costs about as much. The scans use AVX2 or SSE2 when the compiler targets them.
+    namespace diff
+    {
+        constexpr static std::size_t min_gap_v = 16;
+
+        // Largest buffer a delta can be made of. Offsets and sizes are 32 bits, like the payloads of the history
+        // (see undo_file), and the delta of a buffer may take up to about 2.5 times its size.
+        constexpr static std::size_t max_size_v = std::numeric_limits<std::uint32_t>::max() / 3;
+
+        // Offset of the first byte that differs, Size when there is none
+        inline std::size_t FindDifferent(const std::byte* pA, const std::byte* pB, std::size_t Size) noexcept
+        {
+            std::size_t i = 0;
+        #if defined(__AVX2__)
+            for (; i + 32 <= Size; i += 32)
             {
-                return Execute( *Cmd->second, cmd_str, UserID);
+                const auto Equal = _mm256_cmpeq_epi8(_mm256_loadu_si256(reinterpret_cast<const __m256i*>(pA + i)), _mm256_loadu_si256(reinterpret_cast<const __m256i*>(pB + i)));
+                const auto Mask  = ~static_cast<std::uint32_t>(_mm256_movemask_epi8(Equal));
+                if (Mask) return i + std::countr_zero(Mask);
             }
-
-            return std::format("Unable find the command: {}", name);
+        #endif
+        #if defined(__AVX2__) || defined(__SSE2__) || defined(_M_X64) || defined(_M_AMD64)
+            for (; i + 16 <= Size; i += 16)
+            {
+                const auto Equal = _mm_cmpeq_epi8(_mm_loadu_si128(reinterpret_cast<const __m128i*>(pA + i)), _mm_loadu_si128(reinterpret_cast<const __m128i*>(pB + i)));
+                const auto Mask  = ~static_cast<std::uint32_t>(_mm_movemask_epi8(Equal)) & 0xffffu;
+                if (Mask) return i + std::countr_zero(Mask);
+            }
+        #endif
+            for (; i + 8 <= Size; i += 8)
+            {
+                std::uint64_t A, B;
+                std::memcpy(&A, pA + i, sizeof(A));
+                std::memcpy(&B, pB + i, sizeof(B));
+                if (A != B) break;
+            }
+            for (; i < Size; ++i)
+            {
+                if (pA[i] != pB[i]) return i;
+            }
+            return Size;
         }
 
-        [[nodiscard]] std::string Execute(command_base& Cmd, std::string_view cmd_str, int UserID = -1) noexcept
+        // Offset where the first run of at least min_gap_v equal bytes starts, Size when there is none. Runs are
+        // looked for in blocks of min_gap_v bytes so a run that does not cover a whole block is missed.
+        inline std::size_t FindEqualRun(const std::byte* pA, const std::byte* pB, std::size_t Size) noexcept
         {
-            assert(m_Done == false);
-
-            // Check to see if the command line has any errors
-            if (auto err = Cmd.Parse(cmd_str); !err.empty()) return err;
-
-            // Check for help flag
-            if (Cmd.m_Parser.hasOption(Cmd.m_hHelp))
+            for (std::size_t i = 0; i + min_gap_v <= Size; i += min_gap_v)
             {
-                Cmd.m_Parser.printHelp();
-                return {};
+            #if defined(__AVX2__) || defined(__SSE2__) || defined(_M_X64) || defined(_M_AMD64)
+                const auto Equal = _mm_cmpeq_epi8(_mm_loadu_si128(reinterpret_cast<const __m128i*>(pA + i)), _mm_loadu_si128(reinterpret_cast<const __m128i*>(pB + i)));
+                if (_mm_movemask_epi8(Equal) != 0xffff) continue;
+            #else
+                if (std::memcmp(pA + i, pB + i, min_gap_v)) continue;
+            #endif
+                while (i && pA[i - 1] == pB[i - 1]) --i;
+                return i;
             }
+            return Size;
+        }
 
-            // Ready to begin execution...
-            auto Entry = std::make_shared<history_entry>();
-            if (UserID == -1)UserID = m_DefaultUser;
+        // Appends to Delta what turns Old into New. Buffers bigger than max_size_v are refused (nothing is appended)
+        inline bool Encode(std::span<const std::byte> Old, std::span<const std::byte> New, std::vector<std::byte>& Delta) noexcept
+        {
+            assert(Old.size() == New.size());
+            const auto Size = Old.size();
+            if (Size > max_size_v) return false;
 
-            Entry->m_UserID         = UserID;
-            Entry->m_TimeStamp      = std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::system_clock::now().time_since_epoch()).count() * 1000 + m_CommandCounter++;
-            Entry->m_CommandString  = cmd_str;
+            for (auto i = FindDifferent(Old.data(), New.data(), Size); i < Size; )
             {
-                undo_file File(*Entry);
-                Cmd.BackupCurrenState(File);
+                const auto          End       = i + FindEqualRun(Old.data() + i, New.data() + i, Size - i);
+                const std::uint32_t Header[2] = { static_cast<std::uint32_t>(i), static_cast<std::uint32_t>(End - i) };
+                Delta.insert(Delta.end(), reinterpret_cast<const std::byte*>(Header), reinterpret_cast<const std::byte*>(Header) + sizeof(Header));
+                Delta.insert(Delta.end(), Old.data() + i, Old.data() + End);
+                Delta.insert(Delta.end(), New.data() + i, New.data() + End);
+                i = End + FindDifferent(Old.data() + End, New.data() + End, Size - End);
+            }
+            return true;
+        }
+
+        // Forward turns the old buffer into the new one, backward the new one into the old one. Returns false when
+        // the delta does not fit the buffer (the runs before the bad one are applied)
+        inline bool Apply(std::span<std::byte> Data, std::span<const std::byte> Delta, bool bForward) noexcept
+        {
+            for (std::size_t i = 0; i < Delta.size(); )
+            {
+                std::uint32_t Header[2];
+                if (i + sizeof(Header) > Delta.size()) return false;
+                std::memcpy(Header, Delta.data() + i, sizeof(Header));
+                i += sizeof(Header);
+
+                const std::size_t Offset = Header[0];
+                const std::size_t Size   = Header[1];
+                if (Offset + Size > Data.size() || i + 2 * Size > Delta.size()) return false;
+                std::memcpy(Data.data() + Offset, Delta.data() + i + (bForward ? Size : 0), Size);
+                i += 2 * Size;
+            }
+            return true;
+        }
+    }
+
+    // How undo_file::Serialize writes each type, picked at compile time:
+    // - Structs with a fields_v tuple of member pointers are written field by field
+    // - Integers are varints, signed ones zigzag encoded first, so small values take a byte; enums as their integer
+    // - Pairs, tuples and optionals (a bool first) element by element
+    // - Containers are a varint count and their elements; contiguous containers of trivially copyable elements
+    //   are copied in one go, std::array has no count
+    // - Anything else trivially copyable is copied as it is
+    namespace serialization
+    {
+        template<typename T> concept has_fields     = requires { T::fields_v; };
+        template<typename T> concept varint         = std::is_integral_v<T> && (sizeof(T) > 1);
+        template<typename T> concept fixed_size     = requires { std::tuple_size<T>::value; };
+        template<typename T> concept container      = std::ranges::sized_range<T> && !has_fields<T>;
+        template<typename T> concept tuple_like     = fixed_size<T> && !container<T> && !has_fields<T>;
+        template<typename T> concept bulk           = std::ranges::contiguous_range<T> && std::is_trivially_copyable_v<std::ranges::range_value_t<T>>
+                                                   && !has_fields<std::ranges::range_value_t<T>>;
+        template<typename T> concept associative    = requires { typename T::key_type; typename T::mapped_type; };
+
+        template<typename T> struct is_optional                     : std::false_type {};
+        template<typename T> struct is_optional<std::optional<T>>   : std::true_type  {};
+
+        constexpr static std::size_t max_varint_v = 10;
+
+        inline std::size_t EncodeVarint(std::uint64_t Value, std::uint8_t* pOut) noexcept
+        {
+            std::size_t n = 0;
+            for (; Value >= 0x80; Value >>= 7) pOut[n++] = static_cast<std::uint8_t>(Value | 0x80);
+            pOut[n++] = static_cast<std::uint8_t>(Value);
+            return n;
+        }
+
+        template<typename T>
+        constexpr std::uint64_t ZigZag(T Value) noexcept
+        {
+            if constexpr (std::is_signed_v<T>) return (static_cast<std::uint64_t>(Value) << 1) ^ static_cast<std::uint64_t>(static_cast<std::int64_t>(Value) >> 63);
+            else                               return static_cast<std::uint64_t>(Value);
+        }
+
+        template<typename T>
+        constexpr T UnZigZag(std::uint64_t Value) noexcept
+        {
+            if constexpr (std::is_signed_v<T>) return static_cast<T>(static_cast<std::int64_t>(Value >> 1) ^ -static_cast<std::int64_t>(Value & 1));
+            else                               return static_cast<T>(Value);
+        }
+    }
+
+    // This class is used to read and write data to the undo cache
+    struct undo_file
+    {
+        history_entry&      m_Entry;    // Reference to the history entry
+        std::uint32_t       m_Index;    // Current index
+
+        undo_file(history_entry& Entry, std::uint32_t Index = 0) :m_Entry(Entry), m_Index(Index)
+        {
+        }
+
+        void Write(const void* pData, std::uint64_t Size) noexcept
+        {
+            auto& Cache = m_Entry.m_CacheUndoData;
+            assert(pData);
+            Cache.insert(Cache.begin() + m_Index, reinterpret_cast<const std::byte*>(pData), reinterpret_cast<const std::byte*>(pData) + Size);
+            m_Index += static_cast<std::uint32_t>(Size);
+        }
+
+        template<typename T>
+        void Write(const T& Data) noexcept
+        {
+            Write(&Data, sizeof(T));
+        }
+
+        void Read(void* pData, std::uint64_t Size) noexcept
+        {
+            auto& Cache = m_Entry.m_CacheUndoData;
+            assert(pData && m_Index + Size <= Cache.size());
+            std::memcpy(pData, Cache.data() + m_Index, Size);
+            m_Index += static_cast<std::uint32_t>(Size);
+        }
+
+        template<typename T>
+        void Read(T& Data) noexcept
+        {
+            Read(&Data, sizeof(T));
+        }
+
+        void WriteVarint(std::uint64_t Value) noexcept
+        {
+            std::uint8_t Buffer[serialization::max_varint_v];
+            Write(Buffer, serialization::EncodeVarint(Value, Buffer));
+        }
+
+        std::uint64_t ReadVarint(void) noexcept
+        {
+            auto&         Cache = m_Entry.m_CacheUndoData;
+            std::uint64_t Value = 0;
+            for (int Shift = 0; Shift < 64; Shift += 7)
+            {
+                assert(m_Index < Cache.size());
+                const auto Byte = static_cast<std::uint8_t>(Cache[m_Index++]);
+                Value |= static_cast<std::uint64_t>(Byte & 0x7f) << Shift;
+                if ((Byte & 0x80) == 0) break;
+            }
+            return Value;
+        }
+
+        // Typed writes, see the serialization namespace for the format of each type
+        template<typename T>
+        void Serialize(const T& Data) noexcept
+        {
+            using namespace serialization;
+            if constexpr (has_fields<T>)
+            {
+                std::apply([&](auto... pField) { (Serialize(Data.*pField), ...); }, T::fields_v);
+            }
+            else if constexpr (std::is_enum_v<T>)
+            {
+                Serialize(static_cast<std::underlying_type_t<T>>(Data));
+            }
+            else if constexpr (varint<T>)
+            {
+                WriteVarint(ZigZag(Data));
+            }
+            else if constexpr (is_optional<T>::value)
+            {
+                Serialize(Data.has_value());
+                if (Data) Serialize(*Data);
+            }
+            else if constexpr (tuple_like<T>)
+            {
+                std::apply([&](const auto&... Element) { (Serialize(Element), ...); }, Data);
+            }
+            else if constexpr (container<T>)
+            {
+                if constexpr (!fixed_size<T>) WriteVarint(std::ranges::size(Data));
+                if constexpr (bulk<T>) { if (std::ranges::size(Data)) Write(std::ranges::data(Data), std::ranges::size(Data) * sizeof(std::ranges::range_value_t<T>)); }
+                else for (const auto& Element : Data) Serialize(Element);
+            }
+            else
+            {
+                static_assert(std::is_trivially_copyable_v<T>, "Give the type a fields_v list or make it trivially copyable");
+                Write(Data);
+            }
+        }
+
+        template<typename T>
+        void Deserialize(T& Data) noexcept
+        {
+            using namespace serialization;
+            if constexpr (has_fields<T>)
+            {
+                std::apply([&](auto... pField) { (Deserialize(Data.*pField), ...); }, T::fields_v);
+            }
+            else if constexpr (std::is_enum_v<T>)
+            {
+                std::underlying_type_t<T> Value;
+                Deserialize(Value);
+                Data = static_cast<T>(Value);
+            }
+            else if constexpr (varint<T>)
+            {
+                Data = UnZigZag<T>(ReadVarint());
+            }
+            else if constexpr (is_optional<T>::value)
+            {
+                bool bHasValue;
+                Deserialize(bHasValue);
+                if (bHasValue == false) Data.reset();
+                else Deserialize(Data.emplace());
+            }
+            else if constexpr (tuple_like<T>)
+            {
+                std::apply([&](auto&... Element) { (Deserialize(Element), ...); }, Data);
+            }
+            else if constexpr (container<T>)
+            {
+                if constexpr (fixed_size<T>)
+                {
+                    if constexpr (bulk<T>) Read(std::ranges::data(Data), sizeof(Data));
+                    else for (auto& Element : Data) Deserialize(Element);
+                }
+                else
+                {
+                    const auto Count = static_cast<std::size_t>(ReadVarint());
+                    if constexpr (bulk<T>)
+                    {
+                        Data.resize(Count);
+                        if (Count) Read(std::ranges::data(Data), Count * sizeof(std::ranges::range_value_t<T>));
+                    }
+                    else if constexpr (associative<T>)
+                    {
+                        Data.clear();
+                        for (std::size_t i = 0; i < Count; ++i)
+                        {
+                            typename T::key_type    Key;
+                            typename T::mapped_type Value;
+                            Deserialize(Key);
+                            Deserialize(Value);
+                            Data.emplace(std::move(Key), std::move(Value));
+                        }
+                    }
+                    else
+                    {
+                        Data.clear();
+                        for (std::size_t i = 0; i < Count; ++i)
+                        {
+                            typename T::value_type Element;
+                            Deserialize(Element);
+                            if constexpr (requires { Data.push_back(std::move(Element)); }) Data.push_back(std::move(Element));
+                            else                                                            Data.insert(std::move(Element));
+                        }
+                    }
+                }
+            }
+            else
+            {
+                static_assert(std::is_trivially_copyable_v<T>, "Give the type a fields_v list or make it trivially copyable");
+                Read(Data);
+            }
+        }
+
+        // Writes what changed between two snapshots of a buffer as a diff (see diff), for commands that would back
+        // up a large buffer to change a few bytes of it. The size of the delta goes first. Buffers bigger than
+        // diff::max_size_v are refused, nothing is written and it returns false.
+        [[nodiscard]] bool WriteDiff(const void* pBefore, const void* pAfter, std::uint64_t Size) noexcept
+        {
+            if (Size > diff::max_size_v) return false;
+
+            auto&       Cache = m_Entry.m_CacheUndoData;
+            const auto  Start = m_Index;
+            const auto  Old   = std::span(static_cast<const std::byte*>(pBefore), Size);
+            const auto  New   = std::span(static_cast<const std::byte*>(pAfter), Size);
+            Write(std::uint32_t{ 0 });
+
+            // Usually the payload ends here and the delta can be encoded in place
+            std::uint32_t DeltaSize;
+            if (m_Index == Cache.size())
+            {
+                diff::Encode(Old, New, Cache);
+                DeltaSize = static_cast<std::uint32_t>(Cache.size() - m_Index);
+            }
+            else
+            {
+                std::vector<std::byte> Delta;
+                diff::Encode(Old, New, Delta);
+                Cache.insert(Cache.begin() + m_Index, Delta.begin(), Delta.end());
+                DeltaSize = static_cast<std::uint32_t>(Delta.size());
+            }
+
+            std::memcpy(Cache.data() + Start, &DeltaSize, sizeof(DeltaSize));
+            m_Index += DeltaSize;
+            return true;
+        }
+
+        // Puts a buffer back to its before snapshot from a WriteDiff delta, or forward to the after one. Fails on a
+        // delta that does not fit the buffer.
+        bool ApplyDiff(void* pData, std::uint64_t Size, bool bForward = false) noexcept
+        {
+            auto&         Cache = m_Entry.m_CacheUndoData;
+            std::uint32_t DeltaSize;
+            Read(DeltaSize);
+            assert(m_Index + DeltaSize <= Cache.size());
+
+            const bool Ok = diff::Apply({ static_cast<std::byte*>(pData), Size }, { Cache.data() + m_Index, DeltaSize }, bForward);
+            m_Index += DeltaSize;
+            return Ok;
+        }
+    };
+
+    // Small LZ style compressor used to keep cold payloads in memory. The stream is a sequence of tokens:
+    // [0LLLLLLL] followed by L+1 literal bytes, or [1LLLLLLL][offset lo][offset hi] copying L+min_match_v bytes
+    // from offset bytes back. Not meant to compete with real compressors, just cheap and dependency free.
+    namespace compression
+    {
+        constexpr static std::size_t min_match_v    = 4;
+        constexpr static std::size_t max_match_v    = 127 + min_match_v;
+        constexpr static std::size_t max_literal_v  = 128;
+        constexpr static std::size_t max_offset_v   = 0xffff;
+        constexpr static std::size_t hash_bits_v    = 12;
+
+        inline void Compress(std::span<const std::byte> Src, std::vector<std::byte>& Dst) noexcept
+        {
+            std::uint32_t   HashTable[1 << hash_bits_v];
+            std::fill(std::begin(HashTable), std::end(HashTable), 0xffffffffu);
+
+            const auto      pSrc         = reinterpret_cast<const std::uint8_t*>(Src.data());
+            const auto      Size         = Src.size();
+            std::size_t     LiteralStart = 0;
+            std::size_t     i            = 0;
+
+            auto FlushLiterals = [&](std::size_t End)
+            {
+                while (LiteralStart < End)
+                {
+                    const auto Count = std::min(End - LiteralStart, max_literal_v);
+                    Dst.push_back(static_cast<std::byte>(Count - 1));
+                    Dst.insert(Dst.end(), Src.begin() + LiteralStart, Src.begin() + LiteralStart + Count);
+                    LiteralStart += Count;
+                }
+            };
+
+            while (i + min_match_v <= Size)
+            {
+                std::uint32_t Word;
+                std::memcpy(&Word, pSrc + i, sizeof(Word));
+                const auto Hash      = (Word * 2654435761u) >> (32 - hash_bits_v);
+                const auto Candidate = HashTable[Hash];
+                HashTable[Hash]      = static_cast<std::uint32_t>(i);
+
+                if (Candidate != 0xffffffffu && i - Candidate <= max_offset_v && std::memcmp(pSrc + Candidate, pSrc + i, min_match_v) == 0)
+                {
+                    std::size_t Length = min_match_v;
+                    while (Length < max_match_v && i + Length < Size && pSrc[Candidate + Length] == pSrc[i + Length]) ++Length;
+
+                    FlushLiterals(i);
+                    const auto Offset = static_cast<std::uint16_t>(i - Candidate);
+                    Dst.push_back(static_cast<std::byte>(0x80 | (Length - min_match_v)));
+                    Dst.push_back(static_cast<std::byte>(Offset & 0xff));
+                    Dst.push_back(static_cast<std::byte>(Offset >> 8));
+
+                    i           += Length;
+                    LiteralStart = i;
+                }
+                else
+                {
+                    ++i;
+                }
+            }
+
+            FlushLiterals(Size);
+        }
+
+        inline bool Decompress(std::span<const std::byte> Src, std::vector<std::byte>& Dst, std::size_t DecompressedSize) noexcept
+        {
+            const auto  Base = Dst.size();
+            std::size_t i    = 0;
+            Dst.reserve(Base + DecompressedSize);
+
+            while (i < Src.size())
+            {
+                const auto Token = static_cast<std::uint8_t>(Src[i++]);
+                if (Token & 0x80)
+                {
+                    if (i + 2 > Src.size()) return false;
+                    const std::size_t Length = (Token & 0x7f) + min_match_v;
+                    const std::size_t Offset = static_cast<std::size_t>(Src[i]) | (static_cast<std::size_t>(Src[i + 1]) << 8);
+                    i += 2;
+
+                    if (Offset == 0 || Offset > Dst.size() - Base || Dst.size() - Base + Length > DecompressedSize) return false;
+
+                    // Byte by byte since the match can overlap with what it is producing
+                    for (std::size_t k = 0; k < Length; ++k)
+                    {
+                        const auto Byte = Dst[Dst.size() - Offset];
+                        Dst.push_back(Byte);
+                    }
+                }
+                else
+                {
+                    const std::size_t Count = Token + 1u;
+                    if (i + Count > Src.size() || Dst.size() - Base + Count > DecompressedSize) return false;
+                    Dst.insert(Dst.end(), Src.begin() + i, Src.begin() + i + Count);
+                    i += Count;
+                }
+            }
+
+            return Dst.size() - Base == DecompressedSize;
+        }
+    }
+
+    // This namespace contains the different ways the history can be persisted
+    namespace storage
+    {
+        // Operations of the index log. Replaying them in order rebuilds the history time stamps and the cursor:
+        // push appends an entry (the cursor moves to the end), truncate keeps the first Value entries,
+        // drop_front removes the oldest Value entries and cursor sets the undo index. undone and redone flag the
+        // entry at position Value as reverted by a selective undo (or not anymore). size follows a push with the
+        // bytes of its record and meta with its user and command (see MakeIndexMeta); logs without them leave
+        // those unknown. base sets how many entries were dropped from the front before the first one of a
+        // snapshot, which keeps the page numbers of the paged history across sessions.
+        enum class index_op : std::uint8_t
+        {
+            push        = 1,
+            truncate    = 2,
+            drop_front  = 3,
+            cursor      = 4,
+            undone      = 5,
+            redone      = 6,
+            size        = 7,
+            meta        = 8,
+            base        = 9
+        };
+
+        // Set on the time stamps of the index for the entries reverted by a selective undo
+        constexpr static std::uint64_t undone_bit_v = 1ull << 63;
+
+        // Each operation is written as [op][value]
+        constexpr static std::size_t index_op_size_v = sizeof(std::uint8_t) + sizeof(std::uint64_t);
+
+        inline void EncodeIndexOp(index_op Op, std::uint64_t Value, std::vector<std::byte>& Log) noexcept
+        {
+            const auto Offset = Log.size();
+            Log.resize(Offset + index_op_size_v);
+            Log[Offset] = static_cast<std::byte>(Op);
+            std::memcpy(Log.data() + Offset + 1, &Value, sizeof(Value));
+        }
+
+        // Names of commands as the index keeps them: FNV-1a, never zero (interned IDs do not last across runs)
+        inline std::uint32_t CommandNameHash(std::string_view Name) noexcept
+        {
+            std::uint32_t H = 2166136261u;
+            for (const char c : Name) H = (H ^ static_cast<std::uint8_t>(c)) * 16777619u;
+            return H ? H : 1;
+        }
+
+        // What the index knows of a step besides its time stamp: [command name hash][user], zero when unknown
+        inline std::uint64_t MakeIndexMeta(int UserID, std::string_view CommandString) noexcept
+        {
+            return (std::uint64_t(CommandNameHash(getCommandName(CommandString))) << 32) | static_cast<std::uint32_t>(UserID);
+        }
+
+        inline int getIndexMetaUser(std::uint64_t Meta) noexcept
+        {
+            return static_cast<int>(static_cast<std::uint32_t>(Meta));
+        }
+
+        inline std::uint32_t getIndexMetaCommand(std::uint64_t Meta) noexcept
+        {
+            return static_cast<std::uint32_t>(Meta >> 32);
+        }
+
+        // The index as the log rebuilds it
+        struct index_state
+        {
+            std::vector<std::uint64_t>  m_TimeStamps    = {};   // With undone_bit_v set on the reverted entries
+            std::vector<std::uint32_t>  m_Sizes         = {};   // Bytes of the record of each entry, zero if unknown
+            std::vector<std::uint64_t>  m_Meta          = {};   // User and command of each entry (MakeIndexMeta), zero if unknown
+            std::uint64_t               m_Cursor        = 0;
+            std::uint64_t               m_Base          = 0;    // Entries dropped from the front since the history started
+        };
+
+        // A snapshot is just the log that would rebuild the given state from nothing
+        inline void EncodeIndexSnapshot(const index_state& State, std::vector<std::byte>& Log) noexcept
+        {
+            Log.reserve(Log.size() + (State.m_TimeStamps.size() * 3 + 2) * index_op_size_v);
+            if (State.m_Base) EncodeIndexOp(index_op::base, State.m_Base, Log);
+            for (std::size_t i = 0; i < State.m_TimeStamps.size(); ++i)
+            {
+                EncodeIndexOp(index_op::push, State.m_TimeStamps[i], Log);
+                if (State.m_Sizes[i]) EncodeIndexOp(index_op::size, State.m_Sizes[i], Log);
+                if (State.m_Meta[i])  EncodeIndexOp(index_op::meta, State.m_Meta[i], Log);
+            }
+            EncodeIndexOp(index_op::cursor, State.m_Cursor, Log);
+        }
+
+        // Replays the log on top of State, a partially written operation at the end (crash) is ignored
+        inline void ReplayIndexLog(std::span<const std::byte> Log, index_state& State) noexcept
+        {
+            auto& TimeStamps = State.m_TimeStamps;
+            auto& Sizes      = State.m_Sizes;
+            auto& Meta       = State.m_Meta;
+            auto& Cursor     = State.m_Cursor;
+            auto& Base       = State.m_Base;
+            for (std::size_t Offset = 0; Offset + index_op_size_v <= Log.size(); Offset += index_op_size_v)
+            {
+                std::uint64_t Value;
+                std::memcpy(&Value, Log.data() + Offset + 1, sizeof(Value));
+
+                switch (static_cast<index_op>(Log[Offset]))
+                {
+                case index_op::push:        TimeStamps.push_back(Value); Sizes.push_back(0); Meta.push_back(0); Cursor = TimeStamps.size(); break;
+                case index_op::truncate:    TimeStamps.resize(std::min<std::size_t>(Value, TimeStamps.size())); Sizes.resize(TimeStamps.size()); Meta.resize(TimeStamps.size()); Cursor = std::min<std::uint64_t>(Cursor, TimeStamps.size()); break;
+                case index_op::drop_front:  Value = std::min<std::uint64_t>(Value, TimeStamps.size()); TimeStamps.erase(TimeStamps.begin(), TimeStamps.begin() + Value); Sizes.erase(Sizes.begin(), Sizes.begin() + Value); Meta.erase(Meta.begin(), Meta.begin() + Value); Cursor -= std::min(Cursor, Value); Base += Value; break;
+                case index_op::cursor:      Cursor = std::min<std::uint64_t>(Value, TimeStamps.size()); break;
+                case index_op::undone:      if (Value < TimeStamps.size()) TimeStamps[Value] |= undone_bit_v; break;
+                case index_op::redone:      if (Value < TimeStamps.size()) TimeStamps[Value] &= ~undone_bit_v; break;
+                case index_op::size:        if (!Sizes.empty()) Sizes.back() = static_cast<std::uint32_t>(Value); break;
+                case index_op::meta:        if (!Meta.empty()) Meta.back() = Value; break;
+                case index_op::base:        Base = Value; break;
+                default:                    return;
+                }
+            }
+        }
+
+        // A key found in the storage by a key_scanner
+        struct stored_key
+        {
+            std::uint64_t   m_Key;      // Time stamp of a record or key of a page
+            bool            m_bPage;    // Tells which of the two
+        };
+
+        // Walks the keys kept in a storage a batch at a time. Next appends up to Count keys and returns false once
+        // there is nothing left to walk.
+        struct key_scanner
+        {
+            virtual         ~key_scanner    (void)                                                  noexcept = default;
+            virtual bool     Next           (std::size_t Count, std::vector<stored_key>& Keys)      noexcept = 0;
+        };
+
+        // Base class for all storage backends. A backend knows how to keep the records (one per history entry)
+        // and the index (the time stamps of the history plus the cursor). Records may be accessed from several IO
+        // threads at once, the system serializes the calls to the index (they may come from any thread).
+        // PutRecord and GetRecord (with key data) fill Entry.m_StorageSize with the bytes the record takes.
+        // The index is an append-only log of encoded operations (AppendIndex) that WriteIndex replaces with a
+        // compact snapshot, ReadIndex returns the log (snapshot plus operations) for ReplayIndexLog.
+        struct base
+        {
+            virtual                    ~base            (void)                                                                  noexcept = default;
+            virtual std::string         Open            (void)                                                                  noexcept { return {}; }
+            virtual bool                PutRecord       (history_entry& Entry)                                                  noexcept = 0;
+            virtual bool                GetRecord       (history_entry& Entry, bool bLoadKeyData, bool bLoadCacheData)          noexcept = 0;
+            virtual void                DeleteRecord    (std::uint64_t TimeStamp)                                               noexcept = 0;
+            virtual std::string         AppendIndex     (std::span<const std::byte> Ops)                                        noexcept = 0;
+            virtual std::string         WriteIndex      (std::span<const std::byte> Snapshot)                                   noexcept = 0;
+            virtual std::string         ReadIndex       (std::vector<std::byte>& Log)                                           noexcept = 0;
+            virtual bool                hasIndex        (void)                                                          const   noexcept = 0;
+
+            // Optional support for the pages of the paged history (see paged_history). Backends without it still
+            // work, evicted pages are then rebuilt from the records.
+            virtual bool                hasPages        (void)                                                          const   noexcept { return false; }
+            virtual bool                PutPage         (std::uint64_t /*Key*/, std::span<const std::byte> /*Page*/)            noexcept { return false; }
+            virtual bool                GetPage         (std::uint64_t /*Key*/, std::vector<std::byte>& /*Page*/)               noexcept { return false; }
+            virtual void                DeletePage      (std::uint64_t /*Key*/)                                                 noexcept {}
+            virtual std::uint64_t       getPageBytes    (std::uint64_t /*Key*/)                                         const   noexcept { return 0; }
+
+            // Optional, bytes the index takes in the storage. The records are accounted by the system as they are
+            // saved (see history_entry::m_StorageSize), the index and the pages are counted on top of them.
+            virtual std::uint64_t       getIndexBytes   (void)                                                          const   noexcept { return 0; }
+
+            // Optional, the byte cap of the retention policy (0 means none). Backends that keep dead space around
+            // (see journal) use it to reclaim that space before the disk use passes the cap.
+            virtual void                setMaxBytes     (std::uint64_t /*MaxBytes*/)                                            noexcept {}
+
+            // Optional, walks the keys of everything kept in the storage so the garbage collector can find records
+            // and pages nobody references anymore (crashes leave them behind). No scanner means nothing to collect.
+            virtual std::unique_ptr<key_scanner> ScanKeys(void)                                                                 noexcept { return {}; }
+        };
+
+        // Serializes a record with the same layout used by the per file backend:
+        // cache data size, cache data, user id, time stamp, command string size, command string, forward offset
+        // (see history_entry::m_ForwardOffset, records written before it existed end at the command string)
+        inline void EncodeRecord(const history_entry& Entry, std::vector<std::byte>& Record) noexcept
+        {
+            auto Append = [&](const void* pData, std::size_t Size)
+            {
+                Record.insert(Record.end(), reinterpret_cast<const std::byte*>(pData), reinterpret_cast<const std::byte*>(pData) + Size);
+            };
+
+            const uint32_t DataLen = static_cast<uint32_t>(Entry.m_CacheUndoData.size());
+            const uint32_t StrLen  = static_cast<uint32_t>(Entry.m_CommandString.size());
+
+            Record.reserve(Record.size() + sizeof(uint32_t) * 3 + DataLen + sizeof(int) + sizeof(uint64_t) + StrLen);
+            Append(&DataLen, sizeof(uint32_t));
+            Append(Entry.m_CacheUndoData.data(), DataLen);
+            Append(&Entry.m_UserID, sizeof(int));
+            Append(&Entry.m_TimeStamp, sizeof(uint64_t));
+            Append(&StrLen, sizeof(uint32_t));
+            Append(Entry.m_CommandString.data(), StrLen);
+            Append(&Entry.m_ForwardOffset, sizeof(uint32_t));
+        }
+
+        // Deserializes a record written by EncodeRecord
+        inline bool DecodeRecord(std::span<const std::byte> Record, history_entry& Entry, bool bLoadKeyData, bool bLoadCacheData) noexcept
+        {
+            std::size_t Offset = 0;
+            auto Read = [&](void* pData, std::size_t Size)
+            {
+                if (Offset + Size > Record.size()) return false;
+                std::memcpy(pData, Record.data() + Offset, Size);
+                Offset += Size;
+                return true;
+            };
+
+            bool Ok = true;
+            uint32_t DataLen = 0;
+            Ok &= Read(&DataLen, sizeof(uint32_t));
+            if (!Ok || Offset + DataLen > Record.size()) return false;
+
+            if (bLoadCacheData) Entry.m_CacheUndoData.assign(Record.data() + Offset, Record.data() + Offset + DataLen);
+            Offset += DataLen;
+
+            int      UserID    = 0;
+            uint64_t TimeStamp = 0;
+            uint32_t StrLen    = 0;
+            Ok &= Read(&UserID, sizeof(int));
+            Ok &= Read(&TimeStamp, sizeof(uint64_t));
+            Ok &= Read(&StrLen, sizeof(uint32_t));
+            if (!Ok || Offset + StrLen > Record.size()) return false;
+
+            if (bLoadKeyData)
+            {
+                Entry.m_UserID    = UserID;
+                Entry.m_TimeStamp = TimeStamp;
+                Entry.setCommandString({ reinterpret_cast<const char*>(Record.data() + Offset), StrLen });
+            }
+            Offset += StrLen;
+
+            if (bLoadCacheData && Read(&Entry.m_ForwardOffset, sizeof(uint32_t)) == false) Entry.m_ForwardOffset = 0;
+            return Ok;
+        }
+
+        // Original layout: one "UndoStep-{timestamp}" file per entry plus an "UndoTimestamps.bin" index
+        struct per_file final : base
+        {
+            per_file(std::string_view Path) noexcept : m_Path(Path)
+            {
+            }
+
+            ~per_file() noexcept override
+            {
+                if (m_pIndexFile) fclose(m_pIndexFile);
+            }
+
+            bool PutRecord(history_entry& Entry) noexcept override
+            {
+                FILE* File;
+                if (auto Err = fopen_s(&File, getRecordPath(Entry.m_TimeStamp).c_str(), "wb"); Err)
+                {
+                    char ErrMsg[100];
+                    strerror_s(ErrMsg, sizeof(ErrMsg), Err);
+                    std::printf("Error: %s\n", ErrMsg);
+                    return false;
+                }
+                bool Ok = true;
+
+                uint32_t DataLen = static_cast<uint32_t>(Entry.m_CacheUndoData.size());
+                Ok &= fwrite(&DataLen, sizeof(uint32_t), 1, File) == 1;
+                Ok &= DataLen == 0 || fwrite(Entry.m_CacheUndoData.data(), DataLen, 1, File) == 1;
+                Ok &= fwrite(&Entry.m_UserID, sizeof(int), 1, File) == 1;
+                Ok &= fwrite(&Entry.m_TimeStamp, sizeof(uint64_t), 1, File) == 1;
+
+                uint32_t StrLen = static_cast<uint32_t>(Entry.m_CommandString.size());
+                Ok &= fwrite(&StrLen, sizeof(uint32_t), 1, File) == 1;
+                Ok &= fwrite(Entry.m_CommandString.data(), StrLen, 1, File) == 1;
+                Ok &= fwrite(&Entry.m_ForwardOffset, sizeof(uint32_t), 1, File) == 1;
+                fclose(File);
+
+                Entry.m_StorageSize = getRecordSize(DataLen, StrLen);
+                return Ok;
+            }
+
+            bool GetRecord(history_entry& Entry, bool bLoadKeyData, bool bLoadCacheData) noexcept override
+            {
+                FILE* File;
+                if (auto Err = fopen_s(&File, getRecordPath(Entry.m_TimeStamp).c_str(), "rb"); Err)
+                {
+                    char ErrMsg[100];
+                    strerror_s(ErrMsg, sizeof(ErrMsg), Err);
+                    std::printf("Error: %s\n", ErrMsg);
+                    return false;
+                }
+
+                bool Ok = true;
+                uint32_t DataLen;
+                Ok &= fread(&DataLen, sizeof(uint32_t), 1, File) == 1;
+
+                if (bLoadCacheData)
+                {
+                    Entry.m_CacheUndoData.resize(DataLen);
+                    Ok &= DataLen == 0 || fread(Entry.m_CacheUndoData.data(), DataLen, 1, File) == 1;
+                }
+                else
+                {
+                    std::fseek(File, DataLen, SEEK_CUR);
+                }
+
+                if (bLoadKeyData)
+                {
+                    Ok &= fread(&Entry.m_UserID, sizeof(int), 1, File) == 1;
+                    Ok &= fread(&Entry.m_TimeStamp, sizeof(uint64_t), 1, File) == 1;
+                    uint32_t StrLen;
+                    Ok &= fread(&StrLen, sizeof(uint32_t), 1, File) == 1;
+                    std::string CommandString(StrLen, '\0');
+                    Ok &= fread(CommandString.data(), StrLen, 1, File) == 1;
+                    Entry.setCommandString(CommandString);
+                    Entry.m_StorageSize = getRecordSize(DataLen, StrLen);
+                }
+                else if (bLoadCacheData)
+                {
+                    uint32_t StrLen = 0;
+                    std::fseek(File, sizeof(int) + sizeof(uint64_t), SEEK_CUR);
+                    Ok &= fread(&StrLen, sizeof(uint32_t), 1, File) == 1;
+                    std::fseek(File, StrLen, SEEK_CUR);
+                }
+
+                // Old records end at the command string
+                if (bLoadCacheData && fread(&Entry.m_ForwardOffset, sizeof(uint32_t), 1, File) != 1) Entry.m_ForwardOffset = 0;
+
+                fclose(File);
+                return Ok;
+            }
+
+            void DeleteRecord(std::uint64_t TimeStamp) noexcept override
+            {
+                std::error_code Ec;
+                std::filesystem::remove(getRecordPath(TimeStamp), Ec);
+            }
+
+            std::string AppendIndex(std::span<const std::byte> Ops) noexcept override
+            {
+                if (m_pIndexFile == nullptr)
+                {
+                    if (auto Err = fopen_s(&m_pIndexFile, getIndexPath().c_str(), "ab"); Err)
+                    {
+                        char ErrMsg[100];
+                        strerror_s(ErrMsg, sizeof(ErrMsg), Err);
+                        return std::format("Error opening the index log: {}", ErrMsg);
+                    }
+                }
+
+                if (std::fwrite(Ops.data(), Ops.size(), 1, m_pIndexFile) != 1 || std::fflush(m_pIndexFile))
+                    return std::format("Error appending to the index log {}", getIndexPath());
+
+                m_IndexBytes += Ops.size();
+                return {};
+            }
+
+            // The snapshot goes to a temporary file which then replaces the log, so a crash leaves either one intact
+            std::string WriteIndex(std::span<const std::byte> Snapshot) noexcept override
+            {
+                const auto TempPath = getIndexPath() + ".tmp";
+                FILE* File;
+                if (auto Err = fopen_s(&File, TempPath.c_str(), "wb"); Err)
+                {
+                    char ErrMsg[100];
+                    strerror_s(ErrMsg, sizeof(ErrMsg), Err);
+                    return std::format("Error saving timestamps: {}", ErrMsg);
+                }
+                const bool Ok = Snapshot.empty() || std::fwrite(Snapshot.data(), Snapshot.size(), 1, File) == 1;
+                fclose(File);
+                if (!Ok) return std::format("Error saving timestamps to {}", TempPath);
+
+                if (m_pIndexFile)
+                {
+                    fclose(m_pIndexFile);
+                    m_pIndexFile = nullptr;
+                }
+
+                std::error_code Ec;
+                std::filesystem::rename(TempPath, getIndexPath(), Ec);
+                if (Ec) return std::format("Error replacing the index log: {}", Ec.message());
+                std::filesystem::remove(getLegacyIndexPath(), Ec);
+
+                m_IndexBytes = Snapshot.size();
+                return {};
+            }
+
+            std::string ReadIndex(std::vector<std::byte>& Log) noexcept override
+            {
+                Log.clear();
+
+                // Older versions kept the timestamps in UndoTimestamps.bin as [count][timestamps]
+                const bool bLegacy = !std::filesystem::exists(getIndexPath());
+                const auto Path    = bLegacy ? getLegacyIndexPath() : getIndexPath();
+
+                FILE* File;
+                if (auto Err = fopen_s(&File, Path.c_str(), "rb"); Err)
+                {
+                    char ErrMsg[100];
+                    strerror_s(ErrMsg, sizeof(ErrMsg), Err);
+                    return std::format("Error: {}", ErrMsg);
+                }
+
+                std::fseek(File, 0, SEEK_END);
+                std::vector<std::byte> Data(static_cast<std::size_t>(std::ftell(File)));
+                std::fseek(File, 0, SEEK_SET);
+                const bool Ok = Data.empty() || std::fread(Data.data(), Data.size(), 1, File) == 1;
+                fclose(File);
+                if (!Ok) return std::format("Error: failed to read the index file {}", Path);
+                m_IndexBytes = Data.size();
+
+                if (bLegacy)
+                {
+                    uint32_t Count = 0;
+                    if (Data.size() >= sizeof(uint32_t)) std::memcpy(&Count, Data.data(), sizeof(uint32_t));
+                    if (Data.size() < sizeof(uint32_t) + Count * sizeof(uint64_t)) return std::format("Error: the index file {} is truncated", Path);
+
+                    index_state State{ std::vector<std::uint64_t>(Count), std::vector<std::uint32_t>(Count), std::vector<std::uint64_t>(Count), Count };
+                    std::memcpy(State.m_TimeStamps.data(), Data.data() + sizeof(uint32_t), Count * sizeof(uint64_t));
+                    EncodeIndexSnapshot(State, Log);
+                }
+                else
+                {
+                    Log = std::move(Data);
+                }
+
+                return {};
+            }
+
+            bool hasIndex(void) const noexcept override
+            {
+                return std::filesystem::exists(getIndexPath()) || std::filesystem::exists(getLegacyIndexPath());
+            }
+
+            bool hasPages(void) const noexcept override
+            {
+                return true;
+            }
+
+            bool PutPage(std::uint64_t Key, std::span<const std::byte> Page) noexcept override
+            {
+                FILE* File;
+                if (fopen_s(&File, getPagePath(Key).c_str(), "wb")) return false;
+                bool Ok = std::fwrite(Page.data(), Page.size(), 1, File) == 1;
+                fclose(File);
+                return Ok;
+            }
+
+            bool GetPage(std::uint64_t Key, std::vector<std::byte>& Page) noexcept override
+            {
+                FILE* File;
+                if (fopen_s(&File, getPagePath(Key).c_str(), "rb")) return false;
+                std::fseek(File, 0, SEEK_END);
+                Page.resize(static_cast<std::size_t>(std::ftell(File)));
+                std::fseek(File, 0, SEEK_SET);
+                bool Ok = Page.empty() || std::fread(Page.data(), Page.size(), 1, File) == 1;
+                fclose(File);
+                return Ok;
+            }
+
+            void DeletePage(std::uint64_t Key) noexcept override
+            {
+                std::error_code Ec;
+                std::filesystem::remove(getPagePath(Key), Ec);
+            }
+
+            std::uint64_t getPageBytes(std::uint64_t Key) const noexcept override
+            {
+                std::error_code Ec;
+                const auto      Size = std::filesystem::file_size(getPagePath(Key), Ec);
+                return Ec ? 0 : Size;
+            }
+
+            std::uint64_t getIndexBytes(void) const noexcept override
+            {
+                return m_IndexBytes.load(std::memory_order_relaxed);
+            }
+
+            // Walks the undo directory, files that are not records or pages are skipped
+            struct scanner final : key_scanner
+            {
+                scanner(const std::string& Path) noexcept
+                {
+                    m_It = std::filesystem::directory_iterator(Path, m_Ec);
+                }
+
+                bool Next(std::size_t Count, std::vector<stored_key>& Keys) noexcept override
+                {
+                    for (; Count && !m_Ec && m_It != std::filesystem::directory_iterator(); m_It.increment(m_Ec))
+                    {
+                        const auto Name = m_It->path().filename().string();
+                        const bool bPage = Name.starts_with("UndoPage-");
+                        if (!bPage && !Name.starts_with("UndoStep-")) continue;
+
+                        std::uint64_t Key;
+                        const auto    Begin = Name.data() + (bPage ? sizeof("UndoPage-") : sizeof("UndoStep-")) - 1;
+                        if (auto [End, Err] = std::from_chars(Begin, Name.data() + Name.size(), Key); Err != std::errc{} || End != Name.data() + Name.size()) continue;
+
+                        Keys.push_back({ Key, bPage });
+                        --Count;
+                    }
+                    return !m_Ec && m_It != std::filesystem::directory_iterator();
+                }
+
+                std::filesystem::directory_iterator m_It = {};
+                std::error_code                     m_Ec = {};
+            };
+
+            std::unique_ptr<key_scanner> ScanKeys(void) noexcept override
+            {
+                return std::make_unique<scanner>(m_Path);
+            }
+
+            static std::uint32_t getRecordSize(std::uint32_t DataLen, std::uint32_t StrLen) noexcept
+            {
+                return static_cast<std::uint32_t>(sizeof(uint32_t) + DataLen + sizeof(int) + sizeof(uint64_t) + sizeof(uint32_t) + StrLen + sizeof(uint32_t));
+            }
+
+            std::string getRecordPath(std::uint64_t TimeStamp) const noexcept
+            {
+                return std::format("{}/UndoStep-{}", m_Path, TimeStamp);
+            }
+
+            std::string getIndexPath(void) const noexcept
+            {
+                return std::format("{}/UndoIndex.log", m_Path);
+            }
+
+            std::string getLegacyIndexPath(void) const noexcept
+            {
+                return std::format("{}/UndoTimestamps.bin", m_Path);
+            }
+
+            std::string getPagePath(std::uint64_t Key) const noexcept
+            {
+                return std::format("{}/UndoPage-{}", m_Path, Key);
+            }
+
+            std::string                 m_Path;
+            FILE*                       m_pIndexFile = nullptr;     // Open for appending while the index log is in use
+            std::atomic<std::uint64_t>  m_IndexBytes = 0;           // Size of the index log
+        };
+
+        // Journal layout: every record is appended to a single "UndoJournal.bin" file. Each journal block is
+        // [time stamp][size][record]. Deleted records are appended as tombstones (size == deleted_v). Index snapshots
+        // are blocks with time stamp zero (the last one wins) and every index operation after it is a block with
+        // time stamp one. Pages use their key with page_bit_v set.
+        // Tombstones, replaced blocks and old snapshots are dead space; once there is more of it than live blocks
+        // (and at least compact_min_v) the live blocks are copied to a new file that replaces the journal, so the
+        // file stays within about twice what it holds. With a byte cap (setMaxBytes) it is also compacted once the
+        // file passes the cap and the dead space is worth it (a sixteenth of the cap).
+        // Good for file systems that are slow creating/deleting lots of small files.
+        struct journal final : base
+        {
+            constexpr static std::uint64_t index_v          = 0;
+            constexpr static std::uint64_t index_op_v       = 1;
+            constexpr static std::uint64_t page_bit_v       = 1ull << 63;
+            constexpr static std::uint32_t deleted_v        = 0xffffffffu;
+            constexpr static std::int64_t  header_size_v    = sizeof(std::uint64_t) + sizeof(std::uint32_t);
+            constexpr static std::int64_t  compact_min_v    = 64 * 1024;
+
+            struct location
+            {
+                std::int64_t    m_Offset;   // Offset of the record (after the block header)
+                std::uint32_t   m_Size;     // Size of the record
+            };
+
+            journal(std::string_view Path) noexcept : m_Path(std::format("{}/UndoJournal.bin", Path))
+            {
+            }
+
+            ~journal() noexcept override
+            {
+                if (m_pFile) fclose(m_pFile);
+            }
+
+            std::string Open(void) noexcept override
+            {
+                std::lock_guard<std::mutex> Lock(m_Mutex);
+                if (m_pFile) return {};
+
+                if (auto Err = fopen_s(&m_pFile, m_Path.c_str(), "a+b"); Err)
+                {
+                    char ErrMsg[100];
+                    strerror_s(ErrMsg, sizeof(ErrMsg), Err);
+                    return std::format("Error opening journal: {}", ErrMsg);
+                }
+
+                // Rebuild the location table; a partially written block at the end (crash) is simply ignored
+                const auto FileSize = getFileSize();
+                Seek(m_pFile, 0, SEEK_SET);
+                while (true)
+                {
+                    std::uint64_t TimeStamp;
+                    std::uint32_t Size;
+                    if (std::fread(&TimeStamp, sizeof(TimeStamp), 1, m_pFile) != 1) break;
+                    if (std::fread(&Size, sizeof(Size), 1, m_pFile) != 1) break;
+
+                    const auto Offset = Tell(m_pFile);
+                    if (Size == deleted_v)
+                    {
+                        Erase(TimeStamp);
+                        m_FileSize = Offset;
+                        continue;
+                    }
+                    if (Offset + Size > FileSize || Seek(m_pFile, Size, SEEK_CUR)) break;
+                    Track(TimeStamp, location{ Offset, Size });
+                    m_FileSize = Offset + Size;
+                }
+
+                // New blocks would go after a partial one, which would then hide them
+                if (m_FileSize < FileSize || isWasteful()) Compact();
+                return {};
+            }
+
+            bool PutRecord(history_entry& Entry) noexcept override
+            {
+                std::vector<std::byte> Record;
+                EncodeRecord(Entry, Record);
+                Entry.m_StorageSize = static_cast<std::uint32_t>(Record.size());
+                return Append(Entry.m_TimeStamp, Record);
+            }
+
+            bool GetRecord(history_entry& Entry, bool bLoadKeyData, bool bLoadCacheData) noexcept override
+            {
+                std::vector<std::byte> Record;
+                if (!ReadBlock(Entry.m_TimeStamp, Record)) return false;
+                if (bLoadKeyData) Entry.m_StorageSize = static_cast<std::uint32_t>(Record.size());
+                return DecodeRecord(Record, Entry, bLoadKeyData, bLoadCacheData);
+            }
+
+            void DeleteRecord(std::uint64_t TimeStamp) noexcept override
+            {
+                Append(TimeStamp, {}, deleted_v);
+            }
+
+            std::string AppendIndex(std::span<const std::byte> Ops) noexcept override
+            {
+                if (!Append(index_op_v, Ops)) return std::format("Error appending to the index in the journal {}", m_Path);
+                return {};
+            }
+
+            std::string WriteIndex(std::span<const std::byte> Snapshot) noexcept override
+            {
+                if (!Append(index_v, Snapshot)) return std::format("Error saving timestamps to the journal {}", m_Path);
+                return {};
+            }
+
+            std::string ReadIndex(std::vector<std::byte>& Log) noexcept override
+            {
+                Log.clear();
+
+                // Having no snapshot is fine, the operations alone rebuild the index
+                {
+                    std::lock_guard<std::mutex> Lock(m_Mutex);
+                    if (auto It = m_Locations.find(index_v); It != m_Locations.end())
+                    {
+                        Log.resize(It->second.m_Size);
+                        if (!ReadAt(It->second, Log)) return std::format("Error: failed to read the index from {}", m_Path);
+                    }
+
+                    for (auto& Op : m_IndexOps)
+                    {
+                        const auto Offset = Log.size();
+                        Log.resize(Offset + Op.m_Size);
+                        if (!ReadAt(Op, std::span<std::byte>(Log).subspan(Offset))) return std::format("Error: failed to read the index from {}", m_Path);
+                    }
+                }
+
+                return {};
+            }
+
+            bool hasIndex(void) const noexcept override
+            {
+                std::lock_guard<std::mutex> Lock(m_Mutex);
+                return m_Locations.contains(index_v) || !m_IndexOps.empty();
+            }
+
+            bool hasPages(void) const noexcept override
+            {
+                return true;
+            }
+
+            bool PutPage(std::uint64_t Key, std::span<const std::byte> Page) noexcept override
+            {
+                return Append(Key | page_bit_v, Page);
+            }
+
+            bool GetPage(std::uint64_t Key, std::vector<std::byte>& Page) noexcept override
+            {
+                return ReadBlock(Key | page_bit_v, Page);
+            }
+
+            void DeletePage(std::uint64_t Key) noexcept override
+            {
+                Append(Key | page_bit_v, {}, deleted_v);
+            }
+
+            std::uint64_t getPageBytes(std::uint64_t Key) const noexcept override
+            {
+                std::lock_guard<std::mutex> Lock(m_Mutex);
+                auto It = m_Locations.find(Key | page_bit_v);
+                return It == m_Locations.end() ? 0 : header_size_v + It->second.m_Size;
+            }
+
+            std::uint64_t getIndexBytes(void) const noexcept override
+            {
+                std::lock_guard<std::mutex> Lock(m_Mutex);
+                return m_IndexBytes;
+            }
+
+            void setMaxBytes(std::uint64_t MaxBytes) noexcept override
+            {
+                std::lock_guard<std::mutex> Lock(m_Mutex);
+                m_MaxBytes = static_cast<std::int64_t>(std::min<std::uint64_t>(MaxBytes, ~0ull >> 1));
+            }
+
+            // Walks a copy of the keys in the location table taken when the scan starts. Deleting appends tombstones,
+            // the space is given back when the journal is compacted.
+            struct scanner final : key_scanner
+            {
+                bool Next(std::size_t Count, std::vector<stored_key>& Keys) noexcept override
+                {
+                    for (; Count && m_Next < m_Keys.size(); --Count, ++m_Next) Keys.push_back(m_Keys[m_Next]);
+                    return m_Next < m_Keys.size();
+                }
+
+                std::vector<stored_key> m_Keys = {};
+                std::size_t             m_Next = 0;
+            };
+
+            std::unique_ptr<key_scanner> ScanKeys(void) noexcept override
+            {
+                auto Scanner = std::make_unique<scanner>();
+                std::lock_guard<std::mutex> Lock(m_Mutex);
+                for (auto& [Key, Location] : m_Locations)
+                {
+                    if (Key == index_v) continue;
+                    Scanner->m_Keys.push_back({ Key & ~page_bit_v, (Key & page_bit_v) != 0 });
+                }
+                return Scanner;
+            }
+
+            // Size of the journal file and how much of it is in use (the rest goes away with the next compaction)
+            std::int64_t getFileBytes(void) const noexcept
+            {
+                std::lock_guard<std::mutex> Lock(m_Mutex);
+                return m_FileSize;
+            }
+
+            std::int64_t getLiveBytes(void) const noexcept
+            {
+                std::lock_guard<std::mutex> Lock(m_Mutex);
+                return m_LiveBytes;
+            }
+
+        protected:
+
+            // 64 bit offsets, long is 32 bits on Windows and 32 bit targets (fseeko needs _FILE_OFFSET_BITS=64 there)
+            static int Seek(FILE* pFile, std::int64_t Offset, int Origin) noexcept
+            {
+            #if defined(_WIN32)
+                return _fseeki64(pFile, Offset, Origin);
+            #else
+                return fseeko(pFile, static_cast<off_t>(Offset), Origin);
+            #endif
+            }
+
+            static std::int64_t Tell(FILE* pFile) noexcept
+            {
+            #if defined(_WIN32)
+                return _ftelli64(pFile);
+            #else
+                return static_cast<std::int64_t>(ftello(pFile));
+            #endif
+            }
+
+            // The mutex must be held
+            std::int64_t getFileSize(void) const noexcept
+            {
+                Seek(m_pFile, 0, SEEK_END);
+                return Tell(m_pFile);
+            }
+
+            bool ReadBlock(std::uint64_t Key, std::vector<std::byte>& Block) noexcept
+            {
+                std::lock_guard<std::mutex> Lock(m_Mutex);
+                auto It = m_Locations.find(Key);
+                if (It == m_Locations.end()) return false;
+
+                Block.resize(It->second.m_Size);
+                return ReadAt(It->second, Block);
+            }
+
+            // The mutex must be held, compacting moves the blocks
+            bool ReadAt(const location& Location, std::span<std::byte> Data) noexcept
+            {
+                if (!m_pFile) return false;
+                if (Seek(m_pFile, Location.m_Offset, SEEK_SET)) return false;
+                return Data.empty() || std::fread(Data.data(), Data.size(), 1, m_pFile) == 1;
+            }
+
+            // Remembers where a block lives, index operations are kept in order since they all matter
+            void Track(std::uint64_t Key, const location& Location) noexcept
+            {
+                m_LiveBytes += header_size_v + Location.m_Size;
+                if (Key == index_op_v)
+                {
+                    m_IndexOps.push_back(Location);
+                    m_IndexBytes += header_size_v + Location.m_Size;
+                    return;
+                }
+                if (Key == index_v)
+                {
+                    for (auto& Op : m_IndexOps) m_LiveBytes -= header_size_v + Op.m_Size;
+                    m_IndexOps.clear();
+                    m_IndexBytes = header_size_v + Location.m_Size;
+                }
+                Erase(Key);
+                m_Locations[Key] = Location;
+            }
+
+            void Erase(std::uint64_t Key) noexcept
+            {
+                if (auto It = m_Locations.find(Key); It != m_Locations.end())
+                {
+                    m_LiveBytes -= header_size_v + It->second.m_Size;
+                    m_Locations.erase(It);
+                }
+            }
+
+            bool isWasteful(void) const noexcept
+            {
+                const auto Dead = m_FileSize - m_LiveBytes;
+                if (m_MaxBytes && m_FileSize > m_MaxBytes && Dead > m_MaxBytes / 16) return true;
+                return Dead > compact_min_v && Dead > m_LiveBytes;
+            }
+
+            bool Append(std::uint64_t TimeStamp, std::span<const std::byte> Record, std::uint32_t Size = 0) noexcept
+            {
+                if (Size != deleted_v) Size = static_cast<std::uint32_t>(Record.size());
+
+                std::lock_guard<std::mutex> Lock(m_Mutex);
+                if (!m_pFile) return false;
+
+                const auto Offset = getFileSize() + header_size_v;
+
+                bool Ok = true;
+                Ok &= std::fwrite(&TimeStamp, sizeof(TimeStamp), 1, m_pFile) == 1;
+                Ok &= std::fwrite(&Size, sizeof(Size), 1, m_pFile) == 1;
+                if (!Record.empty()) Ok &= std::fwrite(Record.data(), Record.size(), 1, m_pFile) == 1;
+                Ok &= std::fflush(m_pFile) == 0;
+
+                m_FileSize = Offset + static_cast<std::int64_t>(Record.size());
+                if (Size == deleted_v) Erase(TimeStamp);
+                else if (Ok)           Track(TimeStamp, location{ Offset, Size });
+
+                if (isWasteful()) Compact();
+                return Ok;
+            }
+
+            // Copies the live blocks to a new file (snapshot before the index operations that follow it) which then
+            // replaces the journal, a crash leaves one or the other. The mutex must be held.
+            void Compact(void) noexcept
+            {
+                const auto TempPath = m_Path + ".tmp";
+                FILE*      pNew;
+                if (fopen_s(&pNew, TempPath.c_str(), "wb")) return;
+
+                std::vector<std::pair<std::uint64_t, location>> Blocks(m_Locations.begin(), m_Locations.end());
+                std::sort(Blocks.begin(), Blocks.end(), [](const auto& A, const auto& B) { return A.second.m_Offset < B.second.m_Offset; });
+                for (auto& Op : m_IndexOps) Blocks.push_back({ index_op_v, Op });
+
+                std::vector<std::byte> Data;
+                std::int64_t           Offset = 0;
+                bool                   Ok     = true;
+                for (auto& [Key, Location] : Blocks)
+                {
+                    Data.resize(Location.m_Size);
+                    Ok = Ok && ReadAt(Location, Data);
+                    Ok = Ok && std::fwrite(&Key, sizeof(Key), 1, pNew) == 1;
+                    Ok = Ok && std::fwrite(&Location.m_Size, sizeof(Location.m_Size), 1, pNew) == 1;
+                    Ok = Ok && (Data.empty() || std::fwrite(Data.data(), Data.size(), 1, pNew) == 1);
+                    Location.m_Offset = Offset + header_size_v;
+                    Offset            = Location.m_Offset + Location.m_Size;
+                }
+                Ok &= std::fflush(pNew) == 0;
+                fclose(pNew);
+
+                std::error_code Ec;
+                if (Ok)
+                {
+                    fclose(m_pFile);
+                    m_pFile = nullptr;
+                    std::filesystem::rename(TempPath, m_Path, Ec);
+                }
+                if (!Ok || Ec)
+                {
+                    std::filesystem::remove(TempPath, Ec);
+                    if (m_pFile == nullptr) fopen_s(&m_pFile, m_Path.c_str(), "a+b");
+                    return;
+                }
+                if (fopen_s(&m_pFile, m_Path.c_str(), "a+b")) m_pFile = nullptr;
+
+                m_Locations.clear();
+                m_IndexOps.clear();
+                m_LiveBytes  = 0;
+                m_IndexBytes = 0;
+                for (auto& [Key, Location] : Blocks) Track(Key, Location);
+                m_FileSize = Offset;
+            }
+
+            std::string                                     m_Path;
+            FILE*                                           m_pFile     = nullptr;
+            std::unordered_map<std::uint64_t, location>     m_Locations = {};
+            std::vector<location>                           m_IndexOps  = {};   // Index operations after the last snapshot
+            std::int64_t                                    m_FileSize  = 0;    // Up to the end of the last complete block
+            std::int64_t                                    m_LiveBytes = 0;    // Blocks in use, with their headers
+            std::int64_t                                    m_IndexBytes= 0;    // Blocks of the index (snapshot and operations)
+            std::int64_t                                    m_MaxBytes  = 0;    // Byte cap of the retention policy, 0 for none
+            mutable std::mutex                              m_Mutex     = {};
+        };
+
+        // Pure in-memory backend, nothing touches the disk. Useful for tests, benchmarks and disk-less machines.
+        // Records are kept compressed (the cold tier) while the system keeps the recent payloads raw in its cache.
+        // Each record is stored as [uncompressed size][compressed record], or [0][record] when compression does not help.
+        struct memory final : base
+        {
+            memory(bool bCompress = true) noexcept : m_bCompress(bCompress)
+            {
+            }
+
+            bool PutRecord(history_entry& Entry) noexcept override
+            {
+                std::vector<std::byte> Record;
+                EncodeRecord(Entry, Record);
+
+                std::vector<std::byte> Stored(sizeof(std::uint32_t));
+                std::uint32_t          RawSize = 0;
+                if (m_bCompress)
+                {
+                    compression::Compress(Record, Stored);
+                    RawSize = static_cast<std::uint32_t>(Record.size());
+                }
+
+                if (RawSize == 0 || Stored.size() >= Record.size() + sizeof(std::uint32_t))
+                {
+                    RawSize = 0;
+                    Stored.resize(sizeof(std::uint32_t));
+                    Stored.insert(Stored.end(), Record.begin(), Record.end());
+                }
+                std::memcpy(Stored.data(), &RawSize, sizeof(std::uint32_t));
+                Stored.shrink_to_fit();
+                Entry.m_StorageSize = static_cast<std::uint32_t>(Stored.size());
+
+                std::lock_guard<std::mutex> Lock(m_Mutex);
+                m_Records[Entry.m_TimeStamp] = std::move(Stored);
+                return true;
+            }
+
+            bool GetRecord(history_entry& Entry, bool bLoadKeyData, bool bLoadCacheData) noexcept override
+            {
+                std::vector<std::byte> Record;
+                {
+                    std::lock_guard<std::mutex> Lock(m_Mutex);
+                    auto It = m_Records.find(Entry.m_TimeStamp);
+                    if (It == m_Records.end()) return false;
+
+                    const auto& Stored = It->second;
+                    std::uint32_t RawSize;
+                    std::memcpy(&RawSize, Stored.data(), sizeof(std::uint32_t));
+                    if (bLoadKeyData) Entry.m_StorageSize = static_cast<std::uint32_t>(Stored.size());
+
+                    const auto Payload = std::span<const std::byte>(Stored).subspan(sizeof(std::uint32_t));
+                    if (RawSize == 0) return DecodeRecord(Payload, Entry, bLoadKeyData, bLoadCacheData);
+                    if (!compression::Decompress(Payload, Record, RawSize)) return false;
+                }
+                return DecodeRecord(Record, Entry, bLoadKeyData, bLoadCacheData);
+            }
+
+            void DeleteRecord(std::uint64_t TimeStamp) noexcept override
+            {
+                std::lock_guard<std::mutex> Lock(m_Mutex);
+                m_Records.erase(TimeStamp);
+            }
+
+            std::string AppendIndex(std::span<const std::byte> Ops) noexcept override
+            {
+                std::lock_guard<std::mutex> Lock(m_Mutex);
+                m_IndexLog.insert(m_IndexLog.end(), Ops.begin(), Ops.end());
+                m_bHasIndex = true;
+                return {};
+            }
+
+            std::string WriteIndex(std::span<const std::byte> Snapshot) noexcept override
+            {
+                std::lock_guard<std::mutex> Lock(m_Mutex);
+                m_IndexLog.assign(Snapshot.begin(), Snapshot.end());
+                m_bHasIndex = true;
+                return {};
+            }
+
+            std::string ReadIndex(std::vector<std::byte>& Log) noexcept override
+            {
+                std::lock_guard<std::mutex> Lock(m_Mutex);
+                if (!m_bHasIndex) return "Error: the memory storage has no index";
+                Log = m_IndexLog;
+                return {};
+            }
+
+            bool hasIndex(void) const noexcept override
+            {
+                std::lock_guard<std::mutex> Lock(m_Mutex);
+                return m_bHasIndex;
+            }
+
+            bool hasPages(void) const noexcept override
+            {
+                return true;
+            }
+
+            bool PutPage(std::uint64_t Key, std::span<const std::byte> Page) noexcept override
+            {
+                std::lock_guard<std::mutex> Lock(m_Mutex);
+                m_Pages[Key].assign(Page.begin(), Page.end());
+                return true;
+            }
+
+            bool GetPage(std::uint64_t Key, std::vector<std::byte>& Page) noexcept override
+            {
+                std::lock_guard<std::mutex> Lock(m_Mutex);
+                auto It = m_Pages.find(Key);
+                if (It == m_Pages.end()) return false;
+                Page = It->second;
+                return true;
+            }
+
+            void DeletePage(std::uint64_t Key) noexcept override
+            {
+                std::lock_guard<std::mutex> Lock(m_Mutex);
+                m_Pages.erase(Key);
+            }
+
+            std::uint64_t getPageBytes(std::uint64_t Key) const noexcept override
+            {
+                std::lock_guard<std::mutex> Lock(m_Mutex);
+                auto It = m_Pages.find(Key);
+                return It == m_Pages.end() ? 0 : It->second.size();
+            }
+
+            std::uint64_t getIndexBytes(void) const noexcept override
+            {
+                std::lock_guard<std::mutex> Lock(m_Mutex);
+                return m_IndexLog.size();
+            }
+
+            std::unordered_map<std::uint64_t, std::vector<std::byte>>   m_Records   = {};
+            std::unordered_map<std::uint64_t, std::vector<std::byte>>   m_Pages     = {};
+            std::vector<std::byte>                                      m_IndexLog  = {};
+            bool                                                        m_bHasIndex = false;
+            bool                                                        m_bCompress = true;
+            mutable std::mutex                                          m_Mutex     = {};
+        };
+    }
+
+    // This namespace contains the jobs that are executed by the IO worker
+    namespace job
+    {
+        // Base class for all jobs
+        struct base
+        {
+            virtual            ~base() = default;
+            virtual void        Execute() noexcept = 0;
+        };
+
+        // This job saves the history entry to the storage
+        struct save_to_disk final : base
+        {
+            constexpr static int max_tries_v = 3;   // Then the record is given up (see history_entry::m_bSaveFailed)
+
+            save_to_disk(system& System, std::shared_ptr<history_entry> Entry) noexcept
+                : m_System(System), m_Entry(Entry)
+            {
+            }
+
+            void Execute() noexcept override;
+
+            system&                         m_System;
+            std::shared_ptr<history_entry>  m_Entry;
+        };
+
+        // This job deletes the history entries (and the pages of the paged history that went with them) from the storage
+        struct delete_entries final : base
+        {
+            delete_entries(system& System, std::vector<std::uint64_t>&& TimeStamps, std::vector<std::uint64_t>&& Pages = {}) noexcept
+                : m_System(System), m_TimeStamps(std::move(TimeStamps)), m_Pages(std::move(Pages))
+            {
+            }
+
+            void Execute() noexcept override;
+
+            system&                     m_System;
+            std::vector<std::uint64_t>  m_TimeStamps;
+            std::vector<std::uint64_t>  m_Pages;
+        };
+
+        // This job reads the records of history entries once each, taking the key data, the cache or both. Loading
+        // the key data hydrates an entry and wakes up whoever is waiting for it, entry by entry.
+        struct load_entries final : base
+        {
+            load_entries(system& System, std::shared_ptr<history_entry> Entry, bool bLoadKeyData, bool bLoadCacheData) noexcept
+                : m_System(System), m_bLoadKeyData(bLoadKeyData), m_bLoadCacheData(bLoadCacheData)
+            {
+                m_Entries.push_back(std::move(Entry));
+            }
+
+            load_entries(system& System, std::vector<std::shared_ptr<history_entry>>&& Entries, bool bLoadKeyData, bool bLoadCacheData) noexcept
+                : m_System(System), m_Entries(std::move(Entries)), m_bLoadKeyData(bLoadKeyData), m_bLoadCacheData(bLoadCacheData)
+            {
+            }
+
+            void Execute() noexcept override;
+
+            system&                                     m_System;
+            std::vector<std::shared_ptr<history_entry>> m_Entries;
+            bool                                        m_bLoadKeyData;
+            bool                                        m_bLoadCacheData;
+        };
+
+        // This job writes an evicted page of the paged history to the storage
+        struct save_page final : base
+        {
+            save_page(system& System, std::uint64_t Key, std::vector<std::byte>&& Data) noexcept
+                : m_System(System), m_Key(Key), m_Data(std::move(Data))
+            {
+            }
+
+            void Execute() noexcept override;
+
+            system&                     m_System;
+            std::uint64_t               m_Key;
+            std::vector<std::byte>      m_Data;
+        };
+
+        // This job loads the history entry from the storage
+        struct warmup_cache final : base
+        {
+            warmup_cache(system& System, std::shared_ptr<history_entry> Entry) noexcept
+                : m_System(System), m_Entry(Entry)
+            {
+            }
+
+            void Execute() noexcept override;
+
+            system&                         m_System;
+            std::shared_ptr<history_entry>  m_Entry;
+        };
+
+
+        // Low priority job that deletes the records and pages the history does not reference (left by crashes).
+        // It looks at one batch of storage keys per run, rate limits the deletes and then queues itself again as an
+        // idle job, so it only ever runs when the IO threads have nothing better to do.
+        struct collect_garbage final : base
+        {
+            constexpr static std::size_t batch_size_v         = 256;    // Storage keys looked at per run
+            constexpr static std::size_t deletes_per_second_v = 512;    // Rate limit of the deletes
+
+            collect_garbage(system& System, std::vector<std::uint64_t>&& Live, std::uint64_t Newer, std::uint64_t FirstPage) noexcept
+                : m_System(System), m_Live(std::move(Live)), m_Newer(Newer), m_FirstPage(FirstPage)
+            {
+            }
+
+            void Execute() noexcept override;
+
+            system&                                 m_System;
+            std::unique_ptr<storage::key_scanner>   m_Scanner   = {};
+            std::vector<std::uint64_t>              m_Live;         // Sorted time stamps of the history when the scan started
+            std::uint64_t                           m_Newer;        // Records from this time stamp on were created after the scan started
+            std::uint64_t                           m_FirstPage;    // Pages before it were dropped when the scan started, the others may be in use
+        };
+    };
+
+    // This is the base class for all commands
+    struct command_base
+    {
+        command_base(system& System, const char* pName, void* pDataBase) noexcept;
+
+        template<typename T>T& get() noexcept
+        {
+            return *static_cast<T*>(m_pDataBase);
+        }
+
+        virtual                        ~command_base        (void)                          noexcept = default;
+        virtual const char*             getCommandHelp      (void)                  const   noexcept = 0;
+        virtual void                    RegisterArguments   (void)                          noexcept = 0;
+        virtual std::string             Redo                (void)                          noexcept = 0;
+        virtual void                    Undo                (undo_file& File)               noexcept = 0;
+        virtual void                    BackupCurrenState   (undo_file& File)               noexcept = 0;
+
+        // Optional, lists the keys of the data the parsed command writes so selective undo can detect conflicts
+        // between steps. Returning false means the command does not know, so it conflicts with everything.
+        virtual bool                    getWriteKeys        (std::vector<std::uint64_t>& /*Keys*/)  noexcept { return false; }
+
+        // Optional, says that Undo can also restore what BackupCurrenState writes after Redo. The system may then keep
+        // that "after" payload and redo the step by restoring it instead of running Redo again (see forward_policy).
+        virtual bool                    canRestoreForward   (void)                          const   noexcept { return false; }
+
+        // Optional, same for the data the parsed command reads. With both lists RedoBatch can run the step in
+        // parallel with the steps that do not touch the same keys.
+        virtual bool                    getReadKeys         (std::vector<std::uint64_t>& /*Keys*/)  noexcept { return false; }
+
+        // Optional, a copy of the command that parses into its own parser. RedoBatch runs the steps of a command
+        // that has one on copies so they do not wait for each other; without it they run one after the other.
+        // The copy is not registered with the system (see command, which does it for copyable commands).
+        virtual std::unique_ptr<command_base> Clone         (void)                  const   noexcept { return {}; }
+
+        // Optional, for databases that live in one contiguous block that keeps its place and size. When the command
+        // returns it the system backs the step up by itself: it copies the block before Redo and keeps what changed
+        // (see diff) as the payload, which restores both ways. BackupCurrenState and Undo are then never called.
+        // The block can not be bigger than diff::max_size_v.
+        virtual std::span<std::byte>    getAutoBackupArena  (void)                          noexcept { return {}; }
+
+        // Optional, the size of what BackupCurrenState writes when it is always the same (0 when it is not known).
+        // The system reserves it in the payload before the backup.
+        virtual std::size_t             getPayloadSize      (void)                  const   noexcept { return 0; }
+
+        // Optional, reads the arguments of the usual forms of the command straight from the string, which the
+        // parser can not do without allocating. Returns false for anything it does not handle, the parser takes it.
+        virtual bool                    ParseInPlace        (std::string_view /*cmd_str*/)  noexcept { return false; }
+
+        std::string                     Parse               (std::string_view cmd_str)      noexcept
+        {
+            if ((m_bParsedInPlace = ParseInPlace(cmd_str))) return {};
+            m_Parser.clearArgs();
+            return m_Parser.Parse(cmd_str);
+        }
+
+        bool                            isHelp              (void)                          noexcept
+        {
+            return m_bParsedInPlace == false && m_Parser.hasOption(m_hHelp);
+        }
+
+        system&                         m_System;
+        xcmdline::parser                m_Parser        = {};
+        const char*                     m_pCommandName  = {};
+        void*                           m_pDataBase     = {};
+        xcmdline::parser::handle        m_hHelp         = {};
+        bool                            m_bParsedInPlace= false;    // The last Parse went through ParseInPlace
+    };
+
+    // Base for the commands whose undo puts back some fields of the database, with the backup and the undo generated
+    // from the list of fields. T_DERIVED lists them in backup_fields_v, a tuple of member pointers into T_STATE (all
+    // of T_STATE::fields_v when it does not). When every field is trivially copyable the payload has a fixed size
+    // and goes in one copy, otherwise the fields go through undo_file::Serialize.
+    template<typename T_DERIVED, typename T_STATE>
+    struct command : command_base
+    {
+        command(system& System, const char* pName, void* pDataBase) noexcept : command_base(System, pName, pDataBase)
+        {
+        }
+
+        T_STATE& getState(void) noexcept
+        {
+            return get<T_STATE>();
+        }
+
+        void BackupCurrenState(undo_file& File) noexcept override final
+        {
+            auto& State = getState();
+            if constexpr (isFixed())
+            {
+                std::array<std::byte, getFixedSize()> Buffer;
+                std::size_t                           Offset = 0;
+                std::apply([&](auto... pField) { ((std::memcpy(Buffer.data() + Offset, &(State.*pField), sizeof(State.*pField)), Offset += sizeof(State.*pField)), ...); }, getFields());
+                File.Write(Buffer.data(), Buffer.size());
+            }
+            else
+            {
+                std::apply([&](auto... pField) { (File.Serialize(State.*pField), ...); }, getFields());
+            }
+        }
+
+        void Undo(undo_file& File) noexcept override final
+        {
+            auto& State = getState();
+            if constexpr (isFixed())
+            {
+                std::array<std::byte, getFixedSize()> Buffer;
+                std::size_t                           Offset = 0;
+                File.Read(Buffer.data(), Buffer.size());
+                std::apply([&](auto... pField) { ((std::memcpy(&(State.*pField), Buffer.data() + Offset, sizeof(State.*pField)), Offset += sizeof(State.*pField)), ...); }, getFields());
+            }
+            else
+            {
+                std::apply([&](auto... pField) { (File.Deserialize(State.*pField), ...); }, getFields());
+            }
+        }
+
+        std::size_t getPayloadSize(void) const noexcept override
+        {
+            if constexpr (isFixed()) return getFixedSize();
+            else                     return 0;
+        }
+
+        std::unique_ptr<command_base> Clone(void) const noexcept override
+        {
+            if constexpr (std::is_copy_constructible_v<T_DERIVED>) return std::make_unique<T_DERIVED>(static_cast<const T_DERIVED&>(*this));
+            else                                                   return {};
+        }
+
+    private:
+
+        // The derived class is not complete where the base is, so the list is only looked at from inside functions
+        constexpr static auto getFields(void) noexcept
+        {
+            if constexpr (requires { T_DERIVED::backup_fields_v; }) return T_DERIVED::backup_fields_v;
+            else                                                    return T_STATE::fields_v;
+        }
+
+        template<typename T_FIELD>
+        using field_t = std::remove_cvref_t<decltype(std::declval<T_STATE&>().*std::declval<T_FIELD>())>;
+
+        constexpr static bool isFixed(void) noexcept
+        {
+            return std::apply([](auto... pField) { return (std::is_trivially_copyable_v<field_t<decltype(pField)>> && ...); }, getFields());
+        }
+
+        constexpr static std::size_t getFixedSize(void) noexcept
+        {
+            return std::apply([](auto... pField) { return (sizeof(field_t<decltype(pField)>) + ... + 0); }, getFields());
+        }
+    };
+
+    // A vector that is trimmed from the front by moving an offset; the dead front is dropped in one go once it is
+    // half of it. Unlike a deque sliding a window over it does not keep allocating and freeing blocks.
+    template<typename T>
+    class sliding_vector
+    {
+    public:
+
+        std::size_t size    (void) const noexcept { return m_Data.size() - m_Front; }
+        bool        empty   (void) const noexcept { return size() == 0; }
+        auto        begin   (void)       noexcept { return m_Data.begin() + m_Front; }
+        auto        begin   (void) const noexcept { return m_Data.begin() + m_Front; }
+        auto        end     (void)       noexcept { return m_Data.end(); }
+        auto        end     (void) const noexcept { return m_Data.end(); }
+        T&          front   (void)       noexcept { return m_Data[m_Front]; }
+        T&          back    (void)       noexcept { return m_Data.back(); }
+
+        T&          operator[](std::size_t i)       noexcept { return m_Data[m_Front + i]; }
+        const T&    operator[](std::size_t i) const noexcept { return m_Data[m_Front + i]; }
+
+        template<typename... T_ARGS>
+        T& emplace_back(T_ARGS&&... Args) noexcept
+        {
+            return m_Data.emplace_back(std::forward<T_ARGS>(Args)...);
+        }
+
+        void push_back(T Value) noexcept
+        {
+            m_Data.push_back(std::move(Value));
+        }
+
+        void pop_back(void) noexcept
+        {
+            m_Data.pop_back();
+        }
+
+        void erase_front(std::size_t Count) noexcept
+        {
+            m_Front += Count;
+            if (m_Front * 2 >= m_Data.size())
+            {
+                m_Data.erase(m_Data.begin(), m_Data.begin() + m_Front);
+                m_Front = 0;
+            }
+        }
+
+        void resize(std::size_t Count) noexcept
+        {
+            m_Data.resize(m_Front + Count);
+        }
+
+        void resize(std::size_t Count, const T& Value) noexcept
+        {
+            m_Data.resize(m_Front + Count, Value);
+        }
+
+        template<typename T_IT>
+        void assign(T_IT Begin, T_IT End) noexcept
+        {
+            m_Data.assign(Begin, End);
+            m_Front = 0;
+        }
+
+        void clear(void) noexcept
+        {
+            m_Data.clear();
+            m_Front = 0;
+        }
+
+    protected:
+
+        std::vector<T>  m_Data  = {};
+        std::size_t     m_Front = 0;
+    };
+
+    // The history of the system split in fixed size pages. The time stamps are always resident (they are the index)
+    // while the entries themselves (user, command string, cache...) of pages far from the undo index can be evicted
+    // to the storage and are faulted back in when somebody touches them. Positions are relative to the oldest entry,
+    // pages are numbered from the first entry of the session so dropping old entries does not move them.
+    // A small hash table maps time stamps back to positions.
+    class paged_history
+    {
+    public:
+
+        constexpr static std::size_t page_size_v  = 256;
+        constexpr static std::size_t spare_pages_v= 4;
+        constexpr static std::size_t npos         = ~std::size_t(0);
+
+        struct page
+        {
+            std::vector<std::shared_ptr<history_entry>>     m_Entries   = {};       // page_size_v slots while resident, empty when evicted
+            std::uint64_t                                   m_StoredBytes = 0;      // Bytes of the copy of the page in the storage
+            bool                                            m_bDirty    = true;     // The copy of the page in the storage is out of date
+        };
+
+        // A page that was evicted and needs to be written to the storage
+        struct evicted_page
+        {
+            std::uint64_t                                   m_Key;
+            std::vector<std::byte>                          m_Data;
+        };
+
+        // The entries of the pages faulted in come from Pool, their records are read by the IO threads of System
+        void setStorage(system& System, storage::base* pStorage, std::atomic<std::uint64_t>* pStorageBytes, entry_pool& Pool) noexcept
+        {
+            m_pSystem       = &System;
+            m_pStorage      = pStorage;
+            m_pStorageBytes = pStorageBytes;
+            m_pEntryPool    = &Pool;
+        }
+
+        std::size_t size(void) const noexcept
+        {
+            return m_TimeStamps.size();
+        }
+
+        bool empty(void) const noexcept
+        {
+            return m_TimeStamps.empty();
+        }
+
+        // Never faults, the time stamps are always resident
+        std::uint64_t getTimeStamp(std::size_t i) const noexcept
+        {
+            return m_TimeStamps[i] & ~storage::undone_bit_v;
+        }
+
+        // The time stamp as it goes in the index, with storage::undone_bit_v when the entry is undone
+        std::uint64_t getIndexTimeStamp(std::size_t i) const noexcept
+        {
+            return m_TimeStamps[i];
+        }
+
+        bool isUndone(std::size_t i) const noexcept
+        {
+            return (m_TimeStamps[i] & storage::undone_bit_v) != 0;
+        }
+
+        // Bytes of the record of the entry as accounted in the storage bytes, zero while it is not saved (or its
+        // size is not known yet, for indexes written before sizes were logged). Never faults
+        std::uint32_t getStorageSize(std::size_t i) const noexcept
+        {
+            if (auto Entry = peek(i))
+            {
+                std::lock_guard<std::mutex> lock(Entry->m_Mutex);
+                return Entry->m_bHasBeenSaved ? Entry->m_StorageSize : 0;
+            }
+            return m_Sizes[i];
+        }
+
+        // User and command of the entry (see storage::MakeIndexMeta), zero for entries loaded from indexes written
+        // before they were logged. Never faults
+        std::uint64_t getMeta(std::size_t i) const noexcept
+        {
+            return m_Meta[i];
+        }
+
+        // Set while a job that loads the cache of the entry is queued, so the prefetch does not queue it again
+        bool isCacheQueued(std::size_t i) const noexcept
+        {
+            return m_CacheQueued[i] != 0;
+        }
+
+        void setCacheQueued(std::size_t i, bool bQueued) noexcept
+        {
+            m_CacheQueued[i] = bQueued;
+        }
+
+        // Flags the entry as reverted by a selective undo, the flag is kept with the time stamp so it survives evictions
+        void setUndone(std::size_t i, bool bUndone) noexcept
+        {
+            (*this)[i]->m_bUndone = bUndone;
+            if (bUndone) m_TimeStamps[i] |= storage::undone_bit_v;
+            else         m_TimeStamps[i] &= ~storage::undone_bit_v;
+        }
+
+        // Absolute position of the first entry, positions stay valid while entries are dropped from the front
+        std::uint64_t getBase(void) const noexcept
+        {
+            return m_Base;
+        }
+
+        // Position of the entry with this time stamp, npos if it is not in the history. O(1)
+        std::size_t find(std::uint64_t TimeStamp) const noexcept
+        {
+            if (m_Slots.empty()) return npos;
+
+            const auto Mask = m_Slots.size() - 1;
+            for (auto i = Hash(TimeStamp) & Mask; m_Slots[i]; i = (i + 1) & Mask)
+            {
+                const auto Abs = m_SlotBase + m_Slots[i] - 1;
+                if (Abs >= m_Base && Abs < m_Base + m_TimeStamps.size() && getTimeStamp(Abs - m_Base) == TimeStamp) return Abs - m_Base;
+            }
+            return npos;
+        }
+
+        // First position with a time stamp not older than TimeStamp, the history is in time order
+        std::size_t lower_bound(std::uint64_t TimeStamp) const noexcept
+        {
+            return static_cast<std::size_t>(std::partition_point(m_TimeStamps.begin(), m_TimeStamps.end(), [&](std::uint64_t T)
+            {
+                return (T & ~storage::undone_bit_v) < TimeStamp;
+            }) - m_TimeStamps.begin());
+        }
+
+        std::size_t getResidentPageCount(void) const noexcept
+        {
+            return m_Resident.size();
+        }
+
+        // Page numbers in use start at getFirstPage(), they only grow (see storage::index_state::m_Base)
+        std::uint64_t getFirstPage(void) const noexcept
+        {
+            return m_FirstPage;
+        }
+
+        // Makes the pages of [Begin, End) resident without reading any record. Entries whose key data was not in
+        // a stored page are only created (time stamp, saved, not hydrated) and their positions added to Missing, so
+        // the caller can read each record once, together with its cache if it wants it.
+        void Prefetch(std::size_t Begin, std::size_t End, std::vector<std::size_t>& Missing) noexcept
+        {
+            End = std::min(End, m_TimeStamps.size());
+            for (auto i = Begin; i < End; i = (m_Base + i) / page_size_v * page_size_v + page_size_v - m_Base)
+            {
+                const auto PageNumber = (m_Base + i) / page_size_v;
+                if (getPage(PageNumber).m_Entries.empty()) FaultIn(PageNumber, &Missing);
+            }
+        }
+
+        // The entry if its page is resident, null otherwise. Never faults
+        std::shared_ptr<history_entry> peek(std::size_t i) const noexcept
+        {
+            assert(i < m_TimeStamps.size());
+            const auto Abs  = m_Base + i;
+            auto&      Page = getPage(Abs / page_size_v);
+            return Page.m_Entries.empty() ? nullptr : Page.m_Entries[Abs % page_size_v];
+        }
+
+        // Faults the page in if it was evicted
+        const std::shared_ptr<history_entry>& operator[](std::size_t i) const noexcept
+        {
+            assert(i < m_TimeStamps.size());
+            const auto Abs  = m_Base + i;
+            auto&      Page = getPage(Abs / page_size_v);
+            if (Page.m_Entries.empty()) FaultIn(Abs / page_size_v);
+            return Page.m_Entries[Abs % page_size_v];
+        }
+
+        void push_back(std::shared_ptr<history_entry> Entry) noexcept
+        {
+            const auto Abs        = m_Base + m_TimeStamps.size();
+            const auto PageNumber = Abs / page_size_v;
+
+            if (PageNumber >= m_FirstPage + m_Pages.size())
+            {
+                auto& Page = m_Pages.emplace_back();
+                if (m_SparePages.empty())
+                {
+                    Page.m_Entries.resize(page_size_v);
+                }
+                else
+                {
+                    Page.m_Entries = std::move(m_SparePages.back());
+                    m_SparePages.pop_back();
+                }
+                m_Resident.push_back(PageNumber);
+            }
+            else if (getPage(PageNumber).m_Entries.empty())
+            {
+                FaultIn(PageNumber);
+            }
+
+            m_TimeStamps.push_back(Entry->m_TimeStamp | (Entry->m_bUndone ? storage::undone_bit_v : 0));
+            m_Sizes.push_back(0);
+            m_Meta.push_back(storage::MakeIndexMeta(Entry->m_UserID, Entry->m_CommandString));
+            m_CacheQueued.push_back(0);
+            IndexTimeStamp(Abs);
+            auto& Page = getPage(PageNumber);
+            Page.m_Entries[Abs % page_size_v] = std::move(Entry);
+            Page.m_bDirty = true;
+        }
+
+        // Replaces the history with the entries of the index, they live in the storage and nothing is loaded
+        // until touched. The entries keep the absolute positions they had (see storage::index_state::m_Base) so
+        // the pages in the storage are found under the same numbers. Returns the bytes they take in the storage:
+        // their records (as far as the index knows them) and their pages.
+        std::uint64_t assign(const storage::index_state& Index) noexcept
+        {
+            clear();
+            m_Base      = Index.m_Base;
+            m_FirstPage = m_Base / page_size_v;
+            m_TimeStamps.assign(Index.m_TimeStamps.begin(), Index.m_TimeStamps.end());
+            m_Sizes.assign(Index.m_Sizes.begin(), Index.m_Sizes.end());
+            m_Meta.assign(Index.m_Meta.begin(), Index.m_Meta.end());
+            m_CacheQueued.resize(m_TimeStamps.size(), 0);
+            if (m_TimeStamps.empty() == false)
+            {
+                m_Pages.resize((m_Base + m_TimeStamps.size() + page_size_v - 1) / page_size_v - m_FirstPage, page{ .m_bDirty = false });
+            }
+            Reindex();
+
+            std::uint64_t Bytes = 0;
+            for (auto Size : m_Sizes) Bytes += Size;
+            for (std::size_t i = 0; m_pStorage && i < m_Pages.size(); ++i)
+            {
+                m_Pages[i].m_StoredBytes = m_pStorage->getPageBytes(m_FirstPage + i);
+                Bytes += m_Pages[i].m_StoredBytes;
+            }
+            return Bytes;
+        }
+
+        void clear(void) noexcept
+        {
+            m_TimeStamps.clear();
+            m_Sizes.clear();
+            m_Meta.clear();
+            m_CacheQueued.clear();
+            m_Pages.clear();
+            m_Resident.clear();
+            m_Base      = 0;
+            m_FirstPage = 0;
+            m_Slots.clear();
+            m_SlotsUsed = 0;
+        }
+
+        // Removes the entries from Count onward, returns the keys of the pages that no longer exist (added to Deleted)
+        std::vector<std::uint64_t> truncate(std::size_t Count, std::vector<std::uint64_t> Deleted = {}) noexcept
+        {
+            if (Count >= m_TimeStamps.size()) return Deleted;
+
+            const auto End      = m_Base + Count;
+            const auto LastPage = (End + page_size_v - 1) / page_size_v;
+            while (m_FirstPage + m_Pages.size() > std::max<std::size_t>(LastPage, m_FirstPage))
+            {
+                Deleted.push_back(m_FirstPage + m_Pages.size() - 1);
+                Forget(m_Pages.back());
+                Recycle(m_Pages.back());
+                m_Pages.pop_back();
+            }
+            std::erase_if(m_Resident, [&](std::uint64_t P) { return P >= m_FirstPage + m_Pages.size(); });
+
+            if (End % page_size_v && !m_Pages.empty())
+            {
+                auto& Page = m_Pages.back();
+                Page.m_bDirty = true;
+                if (!Page.m_Entries.empty()) std::fill(Page.m_Entries.begin() + End % page_size_v, Page.m_Entries.end(), nullptr);
+            }
+
+            m_TimeStamps.resize(Count);
+            m_Sizes.resize(Count);
+            m_Meta.resize(Count);
+            m_CacheQueued.resize(Count);
+            return Deleted;
+        }
+
+        // Removes the oldest Count entries, returns the keys of the pages that no longer exist (added to Deleted)
+        std::vector<std::uint64_t> erase_front(std::size_t Count, std::vector<std::uint64_t> Deleted = {}) noexcept
+        {
+            Count = std::min(Count, m_TimeStamps.size());
+
+            for (auto Abs = m_Base; Abs < m_Base + Count; ++Abs)
+            {
+                auto& Page = getPage(Abs / page_size_v);
+                if (!Page.m_Entries.empty()) Page.m_Entries[Abs % page_size_v] = nullptr;
+            }
+
+            m_Base += Count;
+            m_TimeStamps.erase_front(Count);
+            m_Sizes.erase_front(Count);
+            m_Meta.erase_front(Count);
+            m_CacheQueued.erase_front(Count);
+
+            while (!m_Pages.empty() && (m_FirstPage + 1) * page_size_v <= m_Base)
+            {
+                Deleted.push_back(m_FirstPage);
+                Forget(m_Pages.front());
+                Recycle(m_Pages.front());
+                m_Pages.erase_front(1);
+                m_FirstPage++;
+            }
+            std::erase_if(m_Resident, [&](std::uint64_t P) { return P < m_FirstPage; });
+
+            return Deleted;
+        }
+
+        // Flags the entries in [Begin, End) as deleted and collects their time stamps. Returns the storage bytes
+        // their records were using. Evicted pages are released without faulting them in.
+        std::uint64_t Release(std::size_t Begin, std::size_t End, std::vector<std::uint64_t>& TimeStamps) noexcept
+        {
+            std::uint64_t Freed = 0;
+            TimeStamps.reserve(TimeStamps.size() + End - Begin);
+
+            for (auto i = Begin; i < End; )
+            {
+                const auto Abs        = m_Base + i;
+                const auto PageNumber = Abs / page_size_v;
+                const auto PageEnd    = std::min(End, (PageNumber + 1) * page_size_v - m_Base);
+                auto&      Page       = getPage(PageNumber);
+
+                if (Page.m_Entries.empty())
+                {
+                    for (; i < PageEnd; ++i)
+                    {
+                        Freed += m_Sizes[i];
+                        TimeStamps.push_back(getTimeStamp(i));
+                    }
+                    continue;
+                }
+
+                for (; i < PageEnd; ++i)
+                {
+                    auto& Entry = *Page.m_Entries[(m_Base + i) % page_size_v];
+                    std::lock_guard<std::mutex> lock(Entry.m_Mutex);
+                    Entry.m_bHasBeenDeleted = true;
+                    if (Entry.m_bHasBeenSaved) Freed += Entry.m_StorageSize;
+                    TimeStamps.push_back(Entry.m_TimeStamp);
+                }
+            }
+
+            return Freed;
+        }
+
+        // Evicts the resident pages that are further than Radius pages away from the entry at Center, the page
+        // holding the newest entry always stays. Pages with entries not saved or not hydrated yet are kept for now,
+        // the ones with a record that failed to save for the session (their payload only lives in memory).
+        // Adds the pages that must be written to the storage to Evicted and returns how many pages went away.
+        std::size_t Trim(std::size_t Center, std::size_t Radius, std::vector<evicted_page>& Evicted) noexcept
+        {
+            if (m_pStorage == nullptr || m_TimeStamps.empty()) return 0;
+
+            const auto Count      = m_Resident.size();
+            const auto CenterPage = (m_Base + std::min(Center, m_TimeStamps.size() - 1)) / page_size_v;
+            const auto TailPage   = (m_Base + m_TimeStamps.size() - 1) / page_size_v;
+
+            std::erase_if(m_Resident, [&](std::uint64_t PageNumber)
+            {
+                if (PageNumber == TailPage) return false;
+                if (PageNumber + Radius >= CenterPage && PageNumber <= CenterPage + Radius) return false;
+
+                auto& Page = getPage(PageNumber);
+                for (auto& E : Page.m_Entries)
+                {
+                    if (!E) continue;
+                    std::lock_guard<std::mutex> lock(E->m_Mutex);
+                    if (!E->m_bHasBeenSaved || E->m_Hydration != hydration::done) return false;
+                }
+
+                // The sizes of the records stay resident for the accounting, the entries are built again (with no
+                // cache) when faulted in so whatever was queued for them does not count anymore
+                const auto Begin = std::max(PageNumber * page_size_v, m_Base);
+                const auto End   = std::min((PageNumber + 1) * page_size_v, m_Base + m_TimeStamps.size());
+                for (auto Abs = Begin; Abs < End; ++Abs)
+                {
+                    m_Sizes[Abs - m_Base]       = Page.m_Entries[Abs % page_size_v]->m_StorageSize;
+                    m_CacheQueued[Abs - m_Base] = 0;
+                }
+
+                if (Page.m_bDirty && m_pStorage->hasPages())
+                {
+                    auto Data = Serialize(Page);
+                    if (m_pStorageBytes)
+                    {
+                        *m_pStorageBytes += Data.size();
+                        *m_pStorageBytes -= Page.m_StoredBytes;
+                    }
+                    Page.m_StoredBytes = Data.size();
+                    Evicted.push_back({ PageNumber, std::move(Data) });
+                    Page.m_bDirty = false;
+                }
+
+                std::vector<std::shared_ptr<history_entry>>().swap(Page.m_Entries);
+                return true;
+            });
+
+            return Count - m_Resident.size();
+        }
+
+    protected:
+
+        static std::size_t Hash(std::uint64_t TimeStamp) noexcept
+        {
+            TimeStamp ^= TimeStamp >> 33;
+            TimeStamp *= 0xff51afd7ed558ccdull;
+            TimeStamp ^= TimeStamp >> 33;
+            return static_cast<std::size_t>(TimeStamp);
+        }
+
+        // Adds the entry at absolute position Abs to the time stamp table. Slots of entries that were truncated or
+        // dropped are not removed, find skips them, they are reclaimed when the table is rebuilt.
+        void IndexTimeStamp(std::uint64_t Abs) noexcept
+        {
+            if ((m_SlotsUsed + 1) * 4 > m_Slots.size() * 3 || Abs - m_SlotBase >= 0xffffffffu)
+            {
+                Reindex();
+                return;
+            }
+
+            const auto Mask = m_Slots.size() - 1;
+            auto       i    = Hash(getTimeStamp(Abs - m_Base)) & Mask;
+            while (m_Slots[i]) i = (i + 1) & Mask;
+            m_Slots[i] = static_cast<std::uint32_t>(Abs - m_SlotBase + 1);
+            ++m_SlotsUsed;
+        }
+
+        // Rebuilds the time stamp table with room for the history to double
+        void Reindex(void) noexcept
+        {
+            m_SlotBase  = m_Base;
+            m_SlotsUsed = 0;
+            m_Slots.assign(std::bit_ceil(std::max<std::size_t>(64, m_TimeStamps.size() * 2)), 0);
+
+            const auto Mask = m_Slots.size() - 1;
+            for (std::size_t Pos = 0; Pos < m_TimeStamps.size(); ++Pos)
+            {
+                auto i = Hash(getTimeStamp(Pos)) & Mask;
+                while (m_Slots[i]) i = (i + 1) & Mask;
+                m_Slots[i] = static_cast<std::uint32_t>(Pos + 1);
+                ++m_SlotsUsed;
+            }
+        }
+
+        // The copy of a page that goes away is deleted from the storage
+        void Forget(page& Page) noexcept
+        {
+            if (m_pStorageBytes) *m_pStorageBytes -= Page.m_StoredBytes;
+            Page.m_StoredBytes = 0;
+        }
+
+        // Keeps the slots of a resident page that goes away for the next new page
+        void Recycle(page& Page) noexcept
+        {
+            if (Page.m_Entries.empty() || m_SparePages.size() == spare_pages_v) return;
+            std::fill(Page.m_Entries.begin(), Page.m_Entries.end(), nullptr);
+            if (m_SparePages.capacity() == 0) m_SparePages.reserve(spare_pages_v);
+            m_SparePages.push_back(std::move(Page.m_Entries));
+        }
+
+        page& getPage(std::uint64_t PageNumber) const noexcept
+        {
+            assert(PageNumber >= m_FirstPage && PageNumber < m_FirstPage + m_Pages.size());
+            return m_Pages[PageNumber - m_FirstPage];
+        }
+
+        // Page layout: [entry count] then per entry [time stamp][user id][storage size][string size][command string]
+        static std::vector<std::byte> Serialize(const page& Page) noexcept
+        {
+            std::vector<std::byte> Data(sizeof(std::uint32_t));
+            auto Append = [&](const void* pData, std::size_t Size)
+            {
+                Data.insert(Data.end(), reinterpret_cast<const std::byte*>(pData), reinterpret_cast<const std::byte*>(pData) + Size);
+            };
+
+            std::uint32_t Count = 0;
+            for (auto& E : Page.m_Entries)
+            {
+                if (!E) continue;
+                const std::uint32_t StrLen = static_cast<std::uint32_t>(E->m_CommandString.size());
+                Append(&E->m_TimeStamp, sizeof(std::uint64_t));
+                Append(&E->m_UserID, sizeof(int));
+                Append(&E->m_StorageSize, sizeof(std::uint32_t));
+                Append(&StrLen, sizeof(std::uint32_t));
+                Append(E->m_CommandString.data(), StrLen);
+                ++Count;
+            }
+            std::memcpy(Data.data(), &Count, sizeof(std::uint32_t));
+            return Data;
+        }
+
+        static void Deserialize(std::span<const std::byte> Data, std::vector<std::shared_ptr<history_entry>>& Entries, entry_pool& Pool) noexcept
+        {
+            std::size_t Offset = 0;
+            auto Read = [&](void* pData, std::size_t Size)
+            {
+                if (Offset + Size > Data.size()) return false;
+                std::memcpy(pData, Data.data() + Offset, Size);
+                Offset += Size;
+                return true;
+            };
+
+            std::uint32_t Count = 0;
+            if (!Read(&Count, sizeof(std::uint32_t))) return;
+            Entries.reserve(Count);
+
+            for (std::uint32_t k = 0; k < Count; ++k)
+            {
+                auto          Entry  = Pool.New();
+                std::uint32_t StrLen = 0;
+                bool          Ok     = true;
+                Ok &= Read(&Entry->m_TimeStamp, sizeof(std::uint64_t));
+                Ok &= Read(&Entry->m_UserID, sizeof(int));
+                Ok &= Read(&Entry->m_StorageSize, sizeof(std::uint32_t));
+                Ok &= Read(&StrLen, sizeof(std::uint32_t));
+                if (!Ok || Offset + StrLen > Data.size()) return;
+
+                Entry->setCommandString({ reinterpret_cast<const char*>(Data.data() + Offset), StrLen });
+                Entry->m_bHasBeenSaved = true;
+                Offset += StrLen;
+                Entries.push_back(std::move(Entry));
+            }
+        }
+
+        // Loads the entries of an evicted page. Entries are taken from the page in the storage when it has them
+        // (it may be stale or from an older session, so they are matched by time stamp), the rest are created
+        // not hydrated and their records are read by the IO threads in one job, or are left for the caller to
+        // load when pMissing is given. Whoever needs one of them waits for that entry only (see WaitHydrated).
+        // The storage bytes of the records are accounted already, except for the sizes the index did not know
+        // (those are counted as they show up).
+        void FaultIn(std::uint64_t PageNumber, std::vector<std::size_t>* pMissing = nullptr) const noexcept
+        {
+            assert(m_pStorage && m_pEntryPool);
+            auto&       Page  = getPage(PageNumber);
+            const auto  Begin = std::max(PageNumber * page_size_v, m_Base);
+            const auto  End   = std::min((PageNumber + 1) * page_size_v, m_Base + m_TimeStamps.size());
+
+            std::vector<std::shared_ptr<history_entry>> Stored;
+            std::vector<std::shared_ptr<history_entry>> Load;
+            if (std::vector<std::byte> Data; m_pStorage->hasPages() && m_pStorage->GetPage(PageNumber, Data)) Deserialize(Data, Stored, *m_pEntryPool);
+
+            Page.m_Entries.assign(page_size_v, nullptr);
+            std::uint64_t   Bytes  = 0;
+            auto            It     = Stored.begin();
+            for (auto Abs = Begin; Abs < End; ++Abs)
+            {
+                const auto TimeStamp = getTimeStamp(Abs - m_Base);
+
+                // Both lists are in history order so the search always moves forward
+                std::shared_ptr<history_entry> Entry;
+                if (auto Found = std::find_if(It, Stored.end(), [&](const auto& E) { return E->m_TimeStamp == TimeStamp; }); Found != Stored.end())
+                {
+                    Entry = std::move(*Found);
+                    It    = Found + 1;
+                }
+                else
+                {
+                    Entry = m_pEntryPool->New();
+                    Entry->m_TimeStamp     = TimeStamp;
+                    Entry->m_StorageSize   = m_Sizes[Abs - m_Base];
+                    Entry->m_bHasBeenSaved = true;
+                    Entry->m_Hydration     = hydration::pending;
+                    if (pMissing) pMissing->push_back(Abs - m_Base);
+                    else          Load.push_back(Entry);
+                    Page.m_bDirty = true;
+                }
+
+                Entry->m_bUndone = isUndone(Abs - m_Base);
+                if (m_Sizes[Abs - m_Base] == 0)
+                {
+                    m_Sizes[Abs - m_Base] = Entry->m_StorageSize;
+                    Bytes += Entry->m_StorageSize;
+                }
+                Page.m_Entries[Abs % page_size_v] = std::move(Entry);
+            }
+
+            if (m_pStorageBytes) *m_pStorageBytes += Bytes;
+            m_Resident.push_back(PageNumber);
+            if (Load.empty() == false) LoadRecords(std::move(Load));
+        }
+
+        // Queues the read of the key data of the entries (defined after system)
+        void LoadRecords(std::vector<std::shared_ptr<history_entry>>&& Entries) const noexcept;
+
+        system*                                     m_pSystem       = nullptr;
+        storage::base*                              m_pStorage      = nullptr;
+        std::atomic<std::uint64_t>*                 m_pStorageBytes = nullptr;
+        entry_pool*                                 m_pEntryPool    = nullptr;
+        sliding_vector<std::uint64_t>               m_TimeStamps    = {};
+        mutable sliding_vector<std::uint32_t>       m_Sizes         = {};       // Record bytes of the entries of evicted pages (see getStorageSize)
+        sliding_vector<std::uint64_t>               m_Meta          = {};       // User and command of the entries (see getMeta)
+        sliding_vector<std::uint8_t>                m_CacheQueued   = {};       // A job that loads the cache of the entry is queued
+        mutable sliding_vector<page>                m_Pages         = {};
+        mutable std::vector<std::uint64_t>          m_Resident      = {};       // Page numbers of the resident pages
+        std::uint64_t                               m_Base          = 0;        // Entries dropped from the front since the start
+        std::uint64_t                               m_FirstPage     = 0;        // Page number of m_Pages.front()
+        std::vector<std::uint32_t>                  m_Slots         = {};       // Time stamp table, absolute position - m_SlotBase + 1 (zero is empty)
+        std::size_t                                 m_SlotsUsed     = 0;
+        std::uint64_t                               m_SlotBase      = 0;
+        std::vector<std::vector<std::shared_ptr<history_entry>>> m_SparePages = {};   // Slots of pages that went away
+    };
+
+    // A run of steps hanging off the history tree (see system::setUndoTree). Its first step is a child of m_Parent
+    // (the time stamp of a step, or zero for the root before any step) and every other step is a child of the one
+    // before it. The records stay in the storage. The run keeps the entries that were resident when it was
+    // detached, the other steps are only their time stamp until SwitchBranch brings the run back and reads them.
+    struct branch
+    {
+        struct step
+        {
+            std::uint64_t                               m_TimeStamp     = 0;
+            std::uint32_t                               m_StorageSize   = 0;        // Record bytes (see paged_history::getStorageSize)
+            bool                                        m_bUndone       = false;
+            std::shared_ptr<history_entry>              m_Entry         = {};       // Null when the step was not resident
+        };
+
+        std::uint64_t                                   m_Parent    = 0;
+        std::vector<step>                               m_Steps     = {};
+    };
+
+    // The steps of one user, by absolute position in the history (see paged_history::getBase)
+    struct user_stack
+    {
+        std::vector<std::uint64_t>  m_Applied   = {};   // Steps below the cursor still applied, in history order
+        std::vector<std::uint64_t>  m_Undone    = {};   // Steps reverted by Undo(UserID), the last one is the next Redo(UserID)
+    };
+
+    // The state history mode (see system::setStateHistory). The payload of every step is the diff::Encode delta of
+    // the block, m_Shadow is the block as of the cursor (what the next step is diffed against) and a full copy of
+    // the block is kept every m_Interval positions. The keyframes are only in memory, they are taken again as the
+    // cursor or a Seek goes by them (so after a reload the first long Seek rebuilds the ones on its way). At most
+    // m_MaxKeyframes are kept, the farthest from the cursor make room for the new ones.
+    struct state_history
+    {
+        std::byte*                                          m_pState        = nullptr;  // Null when the mode is off
+        std::size_t                                         m_Size          = 0;
+        std::size_t                                         m_Interval      = 32;
+        std::size_t                                         m_MaxKeyframes  = 64;       // Memory is m_Size for each
+        std::vector<std::byte>                              m_Shadow        = {};
+        std::map<std::uint64_t, std::vector<std::byte>>     m_Keyframes     = {};       // By absolute cursor position
+    };
+
+    // Secondary indexes of the history by user and by command. Positions are absolute (see paged_history::getBase)
+    // and in history order; time needs no index since the history is in time order already.
+    struct history_index
+    {
+        void Add(int UserID, std::uint32_t CommandID, std::uint64_t Position) noexcept
+        {
+            m_ByUser[UserID].push_back(Position);
+            if (CommandID >= m_ByCommand.size()) m_ByCommand.resize(CommandID + 1);
+            m_ByCommand[CommandID].push_back(Position);
+        }
+
+        // Forgets the positions outside [Begin, End)
+        void Trim(std::uint64_t Begin, std::uint64_t End) noexcept
+        {
+            auto TrimList = [&](std::vector<std::uint64_t>& List)
+            {
+                List.erase(std::lower_bound(List.begin(), List.end(), End), List.end());
+                List.erase(List.begin(), std::lower_bound(List.begin(), List.end(), Begin));
+            };
+            for (auto& [UserID, List] : m_ByUser) TrimList(List);
+            for (auto& List : m_ByCommand)        TrimList(List);
+        }
+
+        void clear(void) noexcept
+        {
+            m_ByUser.clear();
+            m_ByCommand.clear();
+        }
+
+        std::unordered_map<int, std::vector<std::uint64_t>>     m_ByUser    = {};
+        std::vector<std::vector<std::uint64_t>>                 m_ByCommand = {};   // Indexed by interned command name
+    };
+
+    // Dependencies between the steps of a batched redo (see system::RedoBatch). A step waits for the last step that
+    // wrote what it reads or writes, for the steps that read what it writes since that write, and for the last step
+    // run by the same command when it has no copies (a command parses into its own parser, see
+    // command_base::Clone). A step that does not list its keys waits for everything before it and everything after
+    // it waits for it.
+    struct redo_graph
+    {
+        constexpr static std::uint32_t none_v = ~std::uint32_t(0);
+
+        struct node
+        {
+            std::vector<std::uint32_t>  m_Next      = {};   // Steps waiting for this one
+            std::uint32_t               m_Waiting   = 0;    // Steps this one is still waiting for
+        };
+
+        // pCommand is null when the step runs on a copy of its command
+        std::uint32_t Add(const command_base* pCommand, bool bKnown, std::span<const std::uint64_t> Reads, std::span<const std::uint64_t> Writes) noexcept
+        {
+            const auto Index = static_cast<std::uint32_t>(m_Nodes.size());
+            m_Nodes.emplace_back();
+            m_Deps.clear();
+
+            if (m_Barrier != none_v) m_Deps.push_back(m_Barrier);
+            if (pCommand)
+            {
+                if (auto [It, bNew] = m_LastByCommand.try_emplace(pCommand, Index); !bNew)
+                {
+                    m_Deps.push_back(It->second);
+                    It->second = Index;
+                }
+            }
+
+            if (bKnown == false)
+            {
+                m_Deps.insert(m_Deps.end(), m_SinceBarrier.begin(), m_SinceBarrier.end());
+                m_SinceBarrier.clear();
+                m_Keys.clear();
+                m_Barrier = Index;
+            }
+            else
+            {
+                for (auto Key : Reads)
+                {
+                    if (auto It = m_Keys.find(Key); It != m_Keys.end() && It->second.m_Writer != none_v) m_Deps.push_back(It->second.m_Writer);
+                }
+                for (auto Key : Writes)
+                {
+                    auto& State = m_Keys[Key];
+                    if (State.m_Writer != none_v) m_Deps.push_back(State.m_Writer);
+                    m_Deps.insert(m_Deps.end(), State.m_Readers.begin(), State.m_Readers.end());
+                    State.m_Readers.clear();
+                    State.m_Writer = Index;
+                }
+                for (auto Key : Reads) m_Keys[Key].m_Readers.push_back(Index);
+                m_SinceBarrier.push_back(Index);
+            }
+
+            std::sort(m_Deps.begin(), m_Deps.end());
+            m_Deps.erase(std::unique(m_Deps.begin(), m_Deps.end()), m_Deps.end());
+            std::erase(m_Deps, Index);
+            for (auto Dep : m_Deps) m_Nodes[Dep].m_Next.push_back(Index);
+            m_Nodes[Index].m_Waiting = static_cast<std::uint32_t>(m_Deps.size());
+            return Index;
+        }
+
+        struct key_state
+        {
+            std::uint32_t               m_Writer    = none_v;
+            std::vector<std::uint32_t>  m_Readers   = {};
+        };
+
+        std::vector<node>                                       m_Nodes         = {};
+        std::unordered_map<std::uint64_t, key_state>            m_Keys          = {};
+        std::unordered_map<const command_base*, std::uint32_t>  m_LastByCommand = {};
+        std::vector<std::uint32_t>                              m_SinceBarrier  = {};
+        std::vector<std::uint32_t>                              m_Deps          = {};
+        std::uint32_t                                           m_Barrier       = none_v;
+    };
+
+    // What system::Query looks for, fields left empty match everything. m_To is not included.
+    struct history_query
+    {
+        std::optional<int>                      m_UserID        = {};
+        std::string_view                        m_Command       = {};
+        std::chrono::system_clock::time_point   m_From          = {};
+        std::chrono::system_clock::time_point   m_To            = std::chrono::system_clock::time_point::max();
+        std::size_t                             m_MaxResults    = 0;    // Zero means no limit
+    };
+
+    // What system::Replay did and how fast
+    struct replay_stats
+    {
+        std::size_t                 m_Steps         = 0;    // Steps run
+        std::size_t                 m_Loaded        = 0;    // Records read from the storage
+        std::uint64_t               m_LoadedBytes   = 0;
+        std::chrono::nanoseconds    m_Time          = {};   // The whole replay
+        std::chrono::nanoseconds    m_WaitTime      = {};   // Time the steps waited for the workers (reading, parsing)
+
+        double getStepsPerSecond(void) const noexcept
+        {
+            return m_Time.count() ? m_Steps * 1e9 / static_cast<double>(m_Time.count()) : 0;
+        }
+    };
+
+    // When a step of a command that can restore forward (see command_base::canRestoreForward) keeps its "after"
+    // payload: its Redo must have taken at least m_MinRedoTime and longer than m_NsPerByte for each byte kept
+    struct forward_policy
+    {
+        std::chrono::nanoseconds    m_MinRedoTime   = std::chrono::microseconds(100);
+        double                      m_NsPerByte     = 10;   // Rough cost of storing, loading and restoring a byte
+    };
+
+    // Controls the shadow validation (see system::setShadowValidation)
+    struct validation_policy
+    {
+        double                  m_SampleRate        = 0.01; // Fraction of the steps that are checked
+        double                  m_CpuBudget         = 0.05; // Fraction of one core the checks may use, samples past it are skipped
+        std::size_t             m_MaxPending        = 16;   // Samples waiting for the thread, samples past it are skipped
+        std::size_t             m_MaxFailures       = 16;   // Failures kept in validation_stats
+    };
+
+    // What the shadow validation found so far
+    struct validation_stats
+    {
+        std::size_t                 m_Sampled       = 0;    // Steps picked and copied
+        std::size_t                 m_Checked       = 0;
+        std::size_t                 m_Skipped       = 0;    // Over budget, too many pending or no shadow command
+        std::size_t                 m_Mismatches    = 0;
+        std::vector<std::string>    m_Failures      = {};   // The latest ones
+    };
+
+    // Checks on a separate thread that undoing a step gives back the database it started from, which catches the
+    // commands whose BackupCurrenState misses something. The checks never touch the live commands nor the live
+    // database: a second instance of each command is registered with getSystem() and runs against getDataBase(),
+    // which is set from a copy of the live database taken before the step. See shadow<T> for the usual case.
+    struct shadow_validator
+    {
+        virtual                ~shadow_validator    (void)                                  noexcept = default;
+        virtual void*           Clone               (const void* pDataBase)                 noexcept = 0;
+        virtual void            Destroy             (void* pDataBase)                       noexcept = 0;
+        virtual void            Assign              (void* pTo, const void* pFrom)          noexcept = 0;
+        virtual bool            Compare             (const void* pA, const void* pB)        noexcept = 0;
+        virtual void*           getDataBase         (void)                                  noexcept = 0;
+        virtual system&         getSystem           (void)                                  noexcept = 0;
+    };
+
+    // A step waiting for the shadow validation
+    struct validation_sample
+    {
+        void*                   m_pBefore           = nullptr;  // Copy of the database before the step
+        std::string             m_Command           = {};
+        std::uint64_t           m_TimeStamp         = 0;
+        std::uint32_t           m_CommandID         = 0;
+    };
+
+    // An operation of the index log waiting to be written (see system::LogIndex)
+    struct pending_index_op
+    {
+        storage::index_op               m_Op        = {};
+        std::uint64_t                   m_Value     = 0;
+        std::shared_ptr<history_entry>  m_Entry     = {};   // The step of a push, written once its record is saved
+        std::vector<std::unique_ptr<job::base>> m_Jobs  = {};   // Queued once the operation is written (see system::PushJobAfterIndex)
+    };
+
+    // Limits how much history the system keeps. Anything outside the policy is dropped from the oldest side of
+    // the history (never past the undo index). A value of zero means no limit.
+    struct retention_policy
+    {
+        std::size_t             m_MaxSteps          = 0;    // Maximum number of entries in the history
+        std::uint64_t           m_MaxBytes          = 0;    // Maximum bytes used by the storage (disk or memory)
+        std::chrono::seconds    m_MaxAge            = {};   // Entries older than this are dropped
+        int                     m_MaxDropsPerCall   = 64;   // Keeps the enforcement incremental
+    };
+
+    // What TryExecute reports
+    enum class exec_error : std::uint8_t
+    {
+        none,
+        parse,      // The command line did not parse
+        redo,       // The command failed, nothing was added to the history
+    };
+
+    // This is the main class that manages the undo system
+    class system
+    {
+    public:
+
+        constexpr static std::size_t redo_batch_min_v = 16;     // Smaller batches are redone one step at a time
+        constexpr static std::size_t replay_window_v  = 1024;   // How far ahead of Replay the workers may read
+        constexpr static std::size_t parse_window_v   = 64;     // How far ahead of Replay the workers may parse
+        constexpr static std::size_t index_snapshot_min_v = 256;   // Index operations logged before a snapshot may replace them
+
+        system() = default;
+        ~system() noexcept
+        {
+            StopValidation();
+
+            // Nothing to save here, with m_bAutoLoadSave the index log is kept up to date by every operation
+
+            //
+            // Signal the IO threads to exit
+            //
+            if (m_Done==false)
+            {
+                // Set done to true...
+                {
+                    std::lock_guard<std::mutex> lock(m_Mutex);
+                    m_Done = true;
+                }
+                m_Cond.notify_all();
+
+                // wait for the threats to exit
+                for (auto& E : m_IOThread)
+                {
+                    E.join();
+                }
+
+                // Every record is saved now, the operations still waiting can go and so can the jobs behind them
+                if (m_bAutoLoadSave) FlushIndexLog();
+                for (; !m_IOQueue.empty(); m_IOQueue.pop()) m_IOQueue.front()->Execute();
+            }
+        }
+
+        [[nodiscard]] std::string Init( std::string_view UndoPath = {}, bool bAutoLoadSave = true ) noexcept
+        {
+            if (UndoPath.empty())
+            {
+                assert( bAutoLoadSave == false );
+                m_bAutoLoadSave = bAutoLoadSave;
+                m_Done          = false;
+                return {};
+            }
+
+            m_UndoPath = UndoPath;
+            return Init(std::make_unique<storage::per_file>(UndoPath), bAutoLoadSave);
+        }
+
+        // Same as above but lets the user pick the storage backend (per file, journal, memory, or their own)
+        [[nodiscard]] std::string Init( std::unique_ptr<storage::base>&& Storage, bool bAutoLoadSave = true ) noexcept
+        {
+            assert(Storage);
+            m_Storage           = std::move(Storage);
+            m_bAutoLoadSave     = bAutoLoadSave;
+            m_Done              = false;
+
+            m_Storage->setMaxBytes(m_Retention.m_MaxBytes);
+            if (auto Err = m_Storage->Open(); !Err.empty()) return Err;
+            m_History.setStorage(*this, m_Storage.get(), &m_StorageBytes, m_EntryPool);
+
+            for (int i = 0; i < 4; ++i) m_IOThread.emplace_back(std::thread(&system::IOWorker, std::ref(*this)));
+
+            if (m_bAutoLoadSave && m_Storage->hasIndex())
+            {
+                return LoadTimestamps();
+            }
+
+            return {};
+        }
+
+        [[nodiscard]] std::string Execute(std::string_view cmd_str, int UserID = -1)
+        {
+            assert(m_Done==false);
+
+            auto name = getCommandName(cmd_str);
+            auto ID   = string_pool::getInstance().Find(name);
+
+            if (ID < m_Commands.size() && m_Commands[ID])
+            {
+                return Execute( *m_Commands[ID], cmd_str, UserID);
+            }
+
+            return std::format("Unable find the command: {}", name);
+        }
+
+        [[nodiscard]] std::string Execute(command_base& Cmd, std::string_view cmd_str, int UserID = -1) noexcept
+        {
+            return ExecuteAs(Cmd, cmd_str, UserID);
+        }
+
+        // Same as Execute, the calls to the command go through T_COMMAND so they are direct when it is final
+        template<typename T_COMMAND>
+        [[nodiscard]] std::string ExecuteAs(T_COMMAND& Cmd, std::string_view cmd_str, int UserID = -1) noexcept
+        {
+            std::string Err;
+            (void)ExecuteStep(Cmd, cmd_str, UserID, &Err);
+            return Err;
+        }
+
+        // Same as Execute but failures are an error code, the messages of the parser and the command are dropped.
+        // Without a storage (which has IO jobs of its own), with a command that parses in place and once the history
+        // stopped growing (retention, or undo and execute over the same steps) it does not allocate.
+        template<typename T_COMMAND>
+        [[nodiscard]] exec_error TryExecute(T_COMMAND& Cmd, std::string_view cmd_str, int UserID = -1) noexcept
+        {
+            return ExecuteStep(Cmd, cmd_str, UserID, nullptr);
+        }
+
+        system& Undo(void) noexcept
+        {
+            return UndoAs(virtual_dispatch{ *this });
+        }
+
+        system& Redo(void) noexcept
+        {
+            return RedoAs(virtual_dispatch{ *this });
+        }
+
+        // Same as Undo/Redo, the command of the step is reached through Dispatch(Entry, Function), which calls
+        // Function with it (see static_system, which passes it as its own final type so the calls are direct)
+        template<typename T_DISPATCH>
+        system& UndoAs(const T_DISPATCH& Dispatch) noexcept
+        {
+            assert(m_Done == false);
+
+            if (UndoStep(Dispatch))
+            {
+                EnforceRetention();
+                TrimHistory();
+            }
+            return *this;
+        }
+
+        template<typename T_DISPATCH>
+        system& RedoAs(const T_DISPATCH& Dispatch) noexcept
+        {
+            assert(m_Done == false);
+
+            if (RedoStep(Dispatch))
+            {
+                EnforceRetention();
+                TrimHistory();
+            }
+            return *this;
+        }
+
+        // Reverts the latest step of the user that is still applied, even when other users did things after it.
+        // The step stays in the history flagged as undone (Undo/Redo step over it). Fails when a later step
+        // writes the same data (see command_base::getWriteKeys).
+        [[nodiscard]] std::string Undo(int UserID) noexcept
+        {
+            assert(m_Done == false);
+            if (m_State.m_pState) return "Error: selective undo does not work with the state history";
+
+            auto& Stack = getUserStack(UserID);
+            if (Stack.m_Applied.empty()) return {};
+
+            const auto Position = static_cast<std::size_t>(Stack.m_Applied.back() - m_History.getBase());
+            if (auto Err = CheckConflicts(Position); !Err.empty()) return Err;
+
+            if (Revert(Position) == false) return "Error: failed to undo the step";
+            m_History.setUndone(Position, true);
+            LogIndex(storage::index_op::undone, Position);
+            Stack.m_Undone.push_back(Stack.m_Applied.back());
+            Stack.m_Applied.pop_back();
+
+            EnforceRetention();
+            TrimHistory();
+            return {};
+        }
+
+        // Applies again the last step reverted by Undo(UserID), with the same conflict check
+        [[nodiscard]] std::string Redo(int UserID) noexcept
+        {
+            assert(m_Done == false);
+            if (m_State.m_pState) return "Error: selective redo does not work with the state history";
+
+            auto& Stack = getUserStack(UserID);
+            if (Stack.m_Undone.empty()) return {};
+
+            const auto Position = static_cast<std::size_t>(Stack.m_Undone.back() - m_History.getBase());
+            if (Position >= static_cast<std::size_t>(m_UndoIndex)) return "Error: the step to redo is after the cursor, use Redo() first";
+            if (auto Err = CheckConflicts(Position); !Err.empty()) return Err;
+            if (Reapply(Position) == false) return "Error: failed to redo the step";
+
+            m_History.setUndone(Position, false);
+            LogIndex(storage::index_op::redone, Position);
+            Stack.m_Applied.insert(std::upper_bound(Stack.m_Applied.begin(), Stack.m_Applied.end(), Stack.m_Undone.back()), Stack.m_Undone.back());
+            Stack.m_Undone.pop_back();
+
+            EnforceRetention();
+            TrimHistory();
+            return {};
+        }
+
+        // Redoes up to Count steps, the same as calling Redo() Count times. Steps that list the keys they read and
+        // write (see command_base::getReadKeys) and do not touch the keys of each other run in parallel on up to
+        // m_RedoThreads threads, on copies of their command when it has them (see command_base::Clone). If a step
+        // fails the cursor stops before it (steps after it that ran are undone).
+        [[nodiscard]] std::string RedoBatch(std::size_t Count) noexcept
+        {
+            assert(m_Done == false);
+
+            std::vector<std::size_t> Steps;
+            for (auto i = static_cast<std::size_t>(m_UndoIndex); i < m_History.size() && Steps.size() < Count; ++i)
+            {
+                if (m_History.isUndone(i) == false) Steps.push_back(i);
+            }
+            if (Steps.empty()) return {};
+
+            // Not worth the threads (applying state deltas is cheaper than scheduling them)
+            if (m_RedoThreads <= 1 || Steps.size() < redo_batch_min_v || m_State.m_pState)
+            {
+                for (auto i : Steps)
+                {
+                    if (RedoStep() == false) return std::format("Error: failed to redo step {}", m_History.getTimeStamp(i));
+                }
+                EnforceRetention();
+                TrimHistory();
+                return {};
+            }
+
+            // A step whose record could not be read stops the batch like a step that fails
+            std::size_t Readable = 0;
+            while (Readable < Steps.size() && m_History[Steps[Readable]]->WaitHydrated()) ++Readable;
+            const auto Unreadable = Readable < Steps.size() ? m_History.getTimeStamp(Steps[Readable]) : 0;
+            Steps.resize(Readable);
+
+            // The workers only touch the entries and the commands, never the history. Copies of the commands are
+            // made as the workers need them and shared through Copies.
+            redo_graph                                  Graph;
+            std::vector<std::shared_ptr<history_entry>> Entries;
+            std::vector<command_base*>                  Commands;
+            std::vector<std::uint64_t>                  Reads;
+            std::vector<std::uint64_t>                  Writes;
+            std::unordered_map<command_base*, std::vector<std::unique_ptr<command_base>>> Copies;  // Only commands that have them
+            std::uint64_t                               NoCommand = 0;   // Step without a command, the batch stops before it
+            Graph.m_Nodes.reserve(Steps.size());
+            Entries.reserve(Steps.size());
+            Commands.reserve(Steps.size());
+            for (std::size_t n = 0; n < Steps.size(); ++n)
+            {
+                auto& Entry = m_History[Steps[n]];
+                auto  pCmd  = getCommand(*Entry);
+                if (pCmd == nullptr)
+                {
+                    NoCommand = Entry->m_TimeStamp;
+                    Steps.resize(n);
+                    break;
+                }
+
+                auto& Cmd = *pCmd;
+                if (Copies.contains(&Cmd) == false)
+                {
+                    if (auto pCopy = Cmd.Clone()) Copies[&Cmd].push_back(std::move(pCopy));
+                }
+                Reads.clear();
+                Writes.clear();
+                const bool bKnown = Cmd.Parse(Entry->m_CommandString).empty() && Cmd.getReadKeys(Reads) && Cmd.getWriteKeys(Writes);
+                Graph.Add(Copies.contains(&Cmd) ? nullptr : &Cmd, bKnown, Reads, Writes);
+                Entries.push_back(Entry);
+                Commands.push_back(&Cmd);
+            }
+
+            std::vector<std::uint32_t>  Ready;
+            std::vector<char>           Ran(Steps.size(), 0);
+            std::mutex                  Mutex;
+            std::condition_variable     Cond;
+            std::size_t                 Running = 0;
+            std::uint32_t               Failed  = redo_graph::none_v;  // Lowest step that failed, the steps after it are not started
+            for (std::uint32_t i = 0; i < Graph.m_Nodes.size(); ++i)
+            {
+                if (Graph.m_Nodes[i].m_Waiting == 0) Ready.push_back(i);
+            }
+            std::reverse(Ready.begin(), Ready.end());
+
+            auto Worker = [&]
+            {
+                std::unique_lock<std::mutex> Lock(Mutex);
+                while (true)
+                {
+                    Cond.wait(Lock, [&] { return !Ready.empty() || Running == 0; });
+                    if (Ready.empty()) return;
+
+                    const auto Index = Ready.back();
+                    Ready.pop_back();
+                    if (Index > Failed) continue;
+                    ++Running;
+
+                    std::unique_ptr<command_base> pCopy = {};
+                    auto                          It    = Copies.find(Commands[Index]);
+                    if (It != Copies.end() && It->second.empty() == false)
+                    {
+                        pCopy = std::move(It->second.back());
+                        It->second.pop_back();
+                    }
+                    Lock.unlock();
+
+                    if (It != Copies.end() && pCopy == nullptr) pCopy = Commands[Index]->Clone();
+                    auto& Cmd = pCopy ? *pCopy : *Commands[Index];
+
+                    if (hasForwardPayload(Cmd))
+                    {
+                        job::warmup_cache Job(*this, Entries[Index]);
+                        Job.Execute();
+                    }
+
+                    bool bOk;
+                    {
+                        std::unique_lock<std::mutex> EntryLock(Entries[Index]->m_Mutex);
+                        bOk = RunRedo(Cmd, *Entries[Index]);
+                    }
+
+                    Lock.lock();
+                    if (pCopy) It->second.push_back(std::move(pCopy));
+                    --Running;
+                    if (bOk)
+                    {
+                        Ran[Index] = 1;
+                        for (auto Next : Graph.m_Nodes[Index].m_Next)
+                        {
+                            if (--Graph.m_Nodes[Next].m_Waiting == 0) Ready.push_back(Next);
+                        }
+                    }
+                    else Failed = std::min(Failed, Index);
+                    Cond.notify_all();
+                }
+            };
+
+            std::vector<std::thread> Threads;
+            for (std::size_t i = 1; i < m_RedoThreads; ++i) Threads.emplace_back(Worker);
+            Worker();
+            for (auto& T : Threads) T.join();
+
+            // Take back the steps that ran after the first one that did not, so the cursor still splits done from not done
+            const auto Done = static_cast<std::size_t>(std::find(Ran.begin(), Ran.end(), 0) - Ran.begin());
+            for (auto n = Steps.size(); n-- > Done; )
+            {
+                if (Ran[n]) Revert(Steps[n]);
+            }
+
+            for (std::size_t n = 0; n < Done; ++n)
+            {
+                if (m_Storage) m_LRU.push_back(Entries[n]);
+                if (m_bUserStacks) m_UserStacks[Entries[n]->m_UserID].m_Applied.push_back(m_History.getBase() + Steps[n]);
+            }
+
+            if (Done)
+            {
+                m_UndoIndex = static_cast<int>(Steps[Done - 1] + 1);
+                LogIndex(storage::index_op::cursor, m_UndoIndex);
+                if (m_Storage) UpdateLRU();
+                EnforceRetention();
+                TrimHistory();
+            }
+
+            if (Done < Steps.size()) return std::format("Error: failed to redo step {}", Entries[Done]->m_TimeStamp);
+            if (NoCommand) return std::format("Error: the command of step {} could not be found", NoCommand);
+            if (Unreadable) return std::format("Error: the record of step {} could not be read", Unreadable);
+            return {};
+        }
+
+        // Threads used by RedoBatch, including the calling one
+        void setRedoThreads(std::size_t Count) noexcept
+        {
+            m_RedoThreads = std::max<std::size_t>(Count, 1);
+        }
+
+        void setForwardPolicy(const forward_policy& Policy) noexcept
+        {
+            m_Forward = Policy;
+        }
+
+        // State history mode, for commands that all work on one block of memory. Instead of BackupCurrenState and
+        // Undo every step keeps the delta of the block (see diff) and undo/redo apply it. With a keyframe every
+        // KeyframeInterval positions Seek gets anywhere applying at most KeyframeInterval / 2 deltas once the
+        // keyframes around are there; MaxKeyframes copies of the block at most are kept, those closest to the cursor.
+        // Like the storage it belongs to the history, so it is set before Init and the block must hold the state of
+        // the cursor of the history that gets loaded.
+        void setStateHistory(void* pState, std::size_t Size, std::size_t KeyframeInterval = 32, std::size_t MaxKeyframes = 64) noexcept
+        {
+            assert(m_Done);
+            assert(pState && Size && Size <= diff::max_size_v);
+            m_State.m_pState        = static_cast<std::byte*>(pState);
+            m_State.m_Size          = Size;
+            m_State.m_Interval      = std::max<std::size_t>(KeyframeInterval, 1);
+            m_State.m_MaxKeyframes  = MaxKeyframes;
+            m_State.m_Shadow.assign(m_State.m_pState, m_State.m_pState + Size);
+            m_State.m_Keyframes.clear();
+        }
+
+        // Moves the cursor to Position (0 is before the first step). With the state history the block is rebuilt
+        // from the closest keyframe or from where it is, whichever is fewer deltas away, and the keyframe positions
+        // it goes by are kept; otherwise it undoes or redoes one step at a time. A step that cannot be applied stops
+        // the cursor before it and is named in the error.
+        [[nodiscard]] std::string Seek(std::size_t Position) noexcept
+        {
+            assert(m_Done == false);
+            if (Position > m_History.size()) return std::format("Error: position {} is past the end of the history ({})", Position, m_History.size());
+
+            const int Target = static_cast<int>(Position);
+            if (m_State.m_pState == nullptr)
+            {
+                while (m_UndoIndex > Target && UndoStep());
+                while (m_UndoIndex < Target && RedoStep());
+                TrimHistory();
+                if (m_UndoIndex > Target) return std::format("Error: step {} could not be undone, Seek stopped there", m_History.getTimeStamp(m_UndoIndex - 1));
+                if (m_UndoIndex < Target) return std::format("Error: step {} could not be redone, Seek stopped there", m_History.getTimeStamp(m_UndoIndex));
+                return {};
+            }
+
+            const auto Base     = m_History.getBase();
+            const auto To       = Base + Position;
+            auto       From     = Base + m_UndoIndex;
+            auto       Distance = [&](std::uint64_t P) { return P > To ? P - To : To - P; };
+
+            auto It = m_State.m_Keyframes.lower_bound(To);
+            if (It != m_State.m_Keyframes.begin() && (It == m_State.m_Keyframes.end() || Distance(std::prev(It)->first) < Distance(It->first))) --It;
+            if (It != m_State.m_Keyframes.end() && Distance(It->first) < Distance(From))
+            {
+                From = It->first;
+                m_State.m_Shadow = It->second;
+                std::memcpy(m_State.m_pState, m_State.m_Shadow.data(), m_State.m_Size);
+            }
+
+            // A step whose delta could not be applied stops the cursor before it, where the block still is
+            std::string Err;
+            for (; From < To; ++From)
+            {
+                if (ApplyState(static_cast<std::size_t>(From - Base), true) == false)
+                {
+                    Err = std::format("Error: step {} could not be redone, Seek stopped there", m_History.getTimeStamp(static_cast<std::size_t>(From - Base)));
+                    break;
+                }
+                if ((From + 1) % m_State.m_Interval == 0) AddKeyframe(From + 1, To);
+            }
+            for (; From > To; --From)
+            {
+                if (ApplyState(static_cast<std::size_t>(From - Base - 1), false) == false)
+                {
+                    Err = std::format("Error: step {} could not be undone, Seek stopped there", m_History.getTimeStamp(static_cast<std::size_t>(From - Base - 1)));
+                    break;
+                }
+                if ((From - 1) % m_State.m_Interval == 0) AddKeyframe(From - 1, To);
+            }
+
+            m_UndoIndex   = static_cast<int>(From - Base);
+            m_bUserStacks = false;
+            LogIndex(storage::index_op::cursor, m_UndoIndex);
+            TakeKeyframe();
+            if (m_Storage) UpdateLRU();
+            TrimHistory();
+            return Err;
+        }
+
+        // Checks a sample of the executed steps on a separate thread (see shadow_validator), null turns it off.
+        // The validator must outlive the system or be turned off first.
+        void setShadowValidation(shadow_validator* pValidator, const validation_policy& Policy = {}) noexcept
+        {
+            StopValidation();
+            m_pValidator = pValidator;
+            m_Validation = Policy;
+            if (pValidator == nullptr) return;
+
+            m_bValidationDone = false;
+            m_ValidationStart = std::chrono::steady_clock::now();
+            m_ValidationTime  = 0;
+            m_ValidationThread = std::thread(&system::ValidationWorker, std::ref(*this));
+        }
+
+        validation_stats getValidationStats(void) const noexcept
+        {
+            std::lock_guard<std::mutex> Lock(m_ValidationMutex);
+            return m_ValidationStats;
+        }
+
+        // Runs the steps in [Begin, End) of the history again (skipping the undone ones) against another database,
+        // for instance an empty one to rebuild it from the history or to check a migration. The live database, the
+        // cursor and the history are not touched. Worker threads read the records that are not in memory up to
+        // replay_window_v steps ahead of the step being run, and parse the steps up to parse_window_v ahead into
+        // copies of their command (see command_base::Clone), so the calling thread mostly runs Redo. Steps of
+        // commands without copies are parsed on the calling thread. The steps run on the calling thread, in order,
+        // so nothing else may use the commands meanwhile.
+        [[nodiscard]] std::string Replay(std::size_t Begin, std::size_t End, void* pDataBase, replay_stats* pStats = nullptr) noexcept
+        {
+            assert(m_Done == false);
+            assert(pDataBase);
+
+            enum parse_state : char { parse_pending, parse_done, parse_failed, parse_here };
+
+            const auto                                  StartTime = std::chrono::steady_clock::now();
+            replay_stats                                Stats;
+            std::vector<std::shared_ptr<history_entry>> Entries;
+            std::vector<std::uint64_t>                  TimeStamps;
+            std::vector<std::size_t>                    Missing;        // Steps the workers read
+            std::vector<char>                           Loaded;
+            std::vector<char>                           Parsed;         // parse_state of each step
+            std::vector<std::unique_ptr<command_base>>  Copies;         // The command of each step parsed ahead
+            std::vector<std::string>                    ParseErrors;
+            std::unordered_map<command_base*, std::vector<std::unique_ptr<command_base>>> FreeCopies;
+
+            // The entries in memory are used as they are
+            End = std::min(End, m_History.size());
+            for (auto i = Begin; i < End; ++i)
+            {
+                if (m_History.isUndone(i)) continue;
+
+                auto Entry = m_History.peek(i);
+                if (Entry && Entry->m_Hydration != hydration::done) Entry = nullptr;
+                if (Entry == nullptr) Missing.push_back(Entries.size());
+                Loaded.push_back(Entry != nullptr);
+                Entries.push_back(std::move(Entry));
+                TimeStamps.push_back(m_History.getTimeStamp(i));
+            }
+            Parsed.resize(Entries.size(), parse_pending);
+            Copies.resize(Entries.size());
+            ParseErrors.resize(Entries.size());
+
+            // The commands write to the target database while replaying, their copies too
+            std::vector<void*> DataBases;
+            for (auto* pCmd : m_Commands)
+            {
+                DataBases.push_back(pCmd ? pCmd->m_pDataBase : nullptr);
+                if (pCmd) pCmd->m_pDataBase = pDataBase;
+            }
+
+            std::mutex              Mutex;
+            std::condition_variable Cond;
+            std::size_t             NextMissing = 0;
+            std::size_t             NextParse   = 0;
+            std::size_t             Applied     = 0;
+            bool                    bStop       = false;
+
+            // Reads a record that is not in memory
+            auto Load = [&](std::unique_lock<std::mutex>& Lock)
+            {
+                const auto Index = Missing[NextMissing++];
+                Lock.unlock();
+
+                auto Entry = std::make_shared<history_entry>();
+                Entry->m_TimeStamp     = TimeStamps[Index];
+                Entry->m_bHasBeenSaved = true;
+                if (m_Storage->GetRecord(*Entry, true, false) == false) Entry = nullptr;
+
+                Lock.lock();
+                if (Entry)
+                {
+                    ++Stats.m_Loaded;
+                    Stats.m_LoadedBytes += Entry->m_StorageSize;
+                }
+                Entries[Index] = std::move(Entry);
+                Loaded[Index]  = 1;
+            };
+
+            // Parses a step into a copy of its command
+            auto Parse = [&](std::unique_lock<std::mutex>& Lock)
+            {
+                const auto     Index = NextParse++;
+                history_entry* pEntry = Entries[Index].get();
+                command_base*  pCmd   = pEntry && pEntry->m_CommandID < m_Commands.size() ? m_Commands[pEntry->m_CommandID] : nullptr;
+                if (pCmd == nullptr)
+                {
+                    Parsed[Index] = parse_here;
+                    return;
+                }
+
+                std::unique_ptr<command_base> pCopy = {};
+                auto                          It    = FreeCopies.find(pCmd);
+                if (It != FreeCopies.end() && It->second.empty() == false)
+                {
+                    pCopy = std::move(It->second.back());
+                    It->second.pop_back();
+                }
+                Lock.unlock();
+
+                if (pCopy == nullptr) pCopy = pCmd->Clone();
+                std::string Err;
+                if (pCopy)
+                {
+                    std::unique_lock<std::mutex> EntryLock(pEntry->m_Mutex);
+                    Err = pCopy->Parse(pEntry->m_CommandString);
+                }
+
+                Lock.lock();
+                Parsed[Index]      = pCopy == nullptr ? parse_here : Err.empty() ? parse_done : parse_failed;
+                Copies[Index]      = std::move(pCopy);
+                ParseErrors[Index] = std::move(Err);
+            };
+
+            auto Worker = [&]
+            {
+                std::unique_lock<std::mutex> Lock(Mutex);
+                while (true)
+                {
+                    const auto canParse = [&] { return NextParse < Entries.size() && NextParse < Applied + parse_window_v && Loaded[NextParse]; };
+                    const auto canLoad  = [&] { return NextMissing < Missing.size() && Missing[NextMissing] < Applied + replay_window_v; };
+                    Cond.wait(Lock, [&] { return bStop || canParse() || canLoad() || (NextParse == Entries.size() && NextMissing == Missing.size()); });
+                    if (bStop) return;
+
+                    if (canParse())     Parse(Lock);
+                    else if (canLoad()) Load(Lock);
+                    else return;
+                    Cond.notify_all();
+                }
+            };
+
+            std::vector<std::thread> Workers;
+            if (Entries.empty() == false)
+            {
+                for (std::size_t i = 0; i < std::max<std::size_t>(m_RedoThreads - 1, 1); ++i) Workers.emplace_back(Worker);
+            }
+
+            std::string Err;
+            for (std::size_t i = 0; i < Entries.size(); ++i)
+            {
+                std::unique_ptr<command_base> pCopy = {};
+                {
+                    std::unique_lock<std::mutex> Lock(Mutex);
+                    if (Parsed[i] == parse_pending)
+                    {
+                        const auto WaitStart = std::chrono::steady_clock::now();
+                        Cond.wait(Lock, [&] { return Parsed[i] != parse_pending; });
+                        Stats.m_WaitTime += std::chrono::steady_clock::now() - WaitStart;
+                    }
+                    pCopy   = std::move(Copies[i]);
+                    Applied = i;
+                    if (i % (parse_window_v / 4) == 0) Cond.notify_all();
+                }
+
+                if (Entries[i] == nullptr)
+                {
+                    Err = std::format("Error: failed to read step {} from the storage", TimeStamps[i]);
+                    break;
+                }
+
+                auto& Entry = *Entries[i];
+                if (Entry.m_CommandID >= m_Commands.size() || m_Commands[Entry.m_CommandID] == nullptr)
+                {
+                    Err = std::format("Error: step {} uses an unknown command", Entry.m_TimeStamp);
+                    break;
+                }
+                if (Parsed[i] == parse_failed)
+                {
+                    Err = std::format("Error: step {}: {}", Entry.m_TimeStamp, ParseErrors[i]);
+                    break;
+                }
+
+                auto& Cmd = pCopy ? *pCopy : *m_Commands[Entry.m_CommandID];
+                {
+                    std::unique_lock<std::mutex> EntryLock(Entry.m_Mutex);
+                    if (pCopy == nullptr)
+                    {
+                        if (auto E = Cmd.Parse(Entry.m_CommandString); !E.empty()) { Err = std::format("Error: step {}: {}", Entry.m_TimeStamp, E); break; }
+                    }
+                    if (auto E = Cmd.Redo(); !E.empty()) { Err = std::format("Error: step {}: {}", Entry.m_TimeStamp, E); break; }
+                }
+                ++Stats.m_Steps;
+
+                if (pCopy)
+                {
+                    std::lock_guard<std::mutex> Lock(Mutex);
+                    FreeCopies[m_Commands[Entry.m_CommandID]].push_back(std::move(pCopy));
+                }
+            }
+
+            {
+                std::lock_guard<std::mutex> Lock(Mutex);
+                bStop = true;
+                Cond.notify_all();
+            }
+            for (auto& T : Workers) T.join();
+
+            for (std::size_t i = 0; i < m_Commands.size(); ++i)
+            {
+                if (m_Commands[i]) m_Commands[i]->m_pDataBase = DataBases[i];
+            }
+
+            Stats.m_Time = std::chrono::steady_clock::now() - StartTime;
+            if (pStats) *pStats = Stats;
+            return Err;
+        }
+
+        // Finds the steps matching the query using the secondary indexes, returns their positions in the history
+        // newest first. For instance the last Move is Query({ .m_Command = "Move", .m_MaxResults = 1 }).
+        std::vector<std::size_t> Query(const history_query& Filter) noexcept
+        {
+            auto&       Index = getHistoryIndex();
+            const auto  Base  = m_History.getBase();
+
+            const auto Begin = Base + m_History.lower_bound(toTimeStamp(Filter.m_From));
+            const auto End   = Base + (Filter.m_To == std::chrono::system_clock::time_point::max() ? m_History.size() : m_History.lower_bound(toTimeStamp(Filter.m_To)));
+
+            static const std::vector<std::uint64_t> Empty;
+            const std::vector<std::uint64_t>*       pUser    = nullptr;
+            const std::vector<std::uint64_t>*       pCommand = nullptr;
+            if (Filter.m_UserID)
+            {
+                auto It = Index.m_ByUser.find(*Filter.m_UserID);
+                pUser = It == Index.m_ByUser.end() ? &Empty : &It->second;
+            }
+            if (!Filter.m_Command.empty())
+            {
+                const auto ID = string_pool::getInstance().Find(Filter.m_Command);
+                pCommand = ID < Index.m_ByCommand.size() ? &Index.m_ByCommand[ID] : &Empty;
+            }
+
+            std::vector<std::size_t> Result;
+            auto Accept = [&](std::uint64_t Position)
+            {
+                Result.push_back(static_cast<std::size_t>(Position - Base));
+                return Filter.m_MaxResults == 0 || Result.size() < Filter.m_MaxResults;
+            };
+
+            if (pUser == nullptr && pCommand == nullptr)
+            {
+                for (auto Position = End; Position-- > Begin && Accept(Position); );
+                return Result;
+            }
+
+            // Walk the shortest list backwards checking the other one with a binary search
+            if (pUser == nullptr || (pCommand && pCommand->size() < pUser->size())) std::swap(pUser, pCommand);
+            for (auto It = std::lower_bound(pUser->begin(), pUser->end(), End); It != std::lower_bound(pUser->begin(), pUser->end(), Begin); )
+            {
+                --It;
+                if (pCommand && !std::binary_search(pCommand->begin(), pCommand->end(), *It)) continue;
+                if (!Accept(*It)) break;
+            }
+            return Result;
+        }
+
+        // Position in the history of the step with this time stamp, O(1)
+        std::optional<std::size_t> getPosition(std::uint64_t TimeStamp) const noexcept
+        {
+            if (auto Position = m_History.find(TimeStamp); Position != paged_history::npos) return Position;
+            return {};
+        }
+
+        // Entry at a position of the history, for instance one returned by Query
+        const history_entry& getHistoryEntry(std::size_t Position) const noexcept
+        {
+            auto& Entry = *m_History[Position];
+            Entry.WaitHydrated();
+            return Entry;
+        }
+
+        // With the undo tree on, executing a command in the middle of the history keeps the steps after the cursor
+        // as a branch instead of deleting them, SwitchBranch moves between branches. Turning it off deletes the
+        // branches. Branches live for the session, only the current one is in the index.
+        void setUndoTree(bool bUndoTree) noexcept
+        {
+            m_bUndoTree = bUndoTree;
+            if (bUndoTree == false) DeleteBranches([](const branch&) { return true; });
+        }
+
+        const std::vector<branch>& getBranches() const noexcept
+        {
+            return m_Branches;
+        }
+
+        // Moves to the step with the given time stamp wherever it is in the undo tree: undoes back to the common
+        // ancestor with the current branch, makes the branch holding the step the current one (the old one becomes
+        // a branch) and redoes up to the step. Time stamp zero goes back to the root.
+        [[nodiscard]] std::string SwitchBranch(std::uint64_t TimeStamp) noexcept
+        {
+            assert(m_Done == false);
+            if (TimeStamp == 0 && m_History.getBase()) return "Error: the root of the undo tree was dropped by the retention";
+
+            // Runs from the step up to the current branch, each with how many of its entries are on the path
+            std::vector<std::pair<std::uint64_t, std::size_t>> Path;
+            std::uint64_t                                      Parent   = TimeStamp;
+            int                                                Ancestor = -1;
+            while (Parent && (Ancestor = FindPosition(Parent)) < 0)
+            {
+                auto B = FindBranch(Parent);
+                if (B == m_Branches.end()) return std::format("Error: step {} is not in the undo tree", TimeStamp);
+
+                std::size_t Count = 0;
+                while (B->m_Steps[Count].m_TimeStamp != Parent) ++Count;
+                Path.push_back({ B->m_Steps.front().m_TimeStamp, Count + 1 });
+                Parent = B->m_Parent;
+            }
+
+            //
+            // Walk back to the common ancestor (or forward, it may be ahead of the cursor)
+            //
+            const int Common = Ancestor + 1;
+            while (m_UndoIndex > Common && UndoStep());
+            while (m_UndoIndex < Common && RedoStep());
+
+            // Nothing is detached unless the cursor made it to the ancestor, the branches hang off it
+            if (m_UndoIndex > Common) return std::format("Error: step {} could not be undone, the switch to step {} stopped there", m_History.getTimeStamp(m_UndoIndex - 1), TimeStamp);
+            if (m_UndoIndex < Common) return std::format("Error: step {} could not be redone, the switch to step {} stopped there", m_History.getTimeStamp(m_UndoIndex), TimeStamp);
+
+            if (!Path.empty())
+            {
+                // The current branch after the ancestor becomes a branch
+                DetachBranch();
+
+                // Bring in the runs of the path, from the ancestor down; what hangs after the path stays a branch
+                for (auto It = Path.rbegin(); It != Path.rend(); ++It)
+                {
+                    auto B     = FindBranch(It->first);
+                    auto Steps = std::move(B->m_Steps);
+                    m_Branches.erase(B);
+
+                    const auto Count = (It + 1 == Path.rend()) ? Steps.size() : It->second;
+                    if (Count < Steps.size())
+                    {
+                        m_Branches.push_back({ Steps[Count - 1].m_TimeStamp, { Steps.begin() + Count, Steps.end() } });
+                    }
+
+                    Steps.resize(Count);
+                    LoadBranchSteps(Steps);
+                    for (auto& Step : Steps)
+                    {
+                        Step.m_Entry->WaitHydrated();
+                        m_History.push_back(Step.m_Entry);
+                        LogIndex(storage::index_op::push, Step.m_TimeStamp, Step.m_Entry);
+                    }
+                }
+
+                const int Target = FindPosition(TimeStamp);
+                while (m_UndoIndex <= Target && RedoStep());
+                m_bUserStacks   = false;
+                m_bHistoryIndex = false;
+
+                // The branch is in place, only the cursor is short of the step
+                if (m_UndoIndex <= Target)
+                {
+                    const auto Stopped = m_History.getTimeStamp(m_UndoIndex);
+                    EnforceRetention();
+                    TrimHistory();
+                    return std::format("Error: step {} could not be redone, the switch to step {} stopped before it", Stopped, TimeStamp);
+                }
+            }
+
+            EnforceRetention();
+            TrimHistory();
+            return {};
+        }
+
+
+        void displayHistory() const noexcept
+        {
+            std::cout << "History:\n";
+            for (size_t i = 0; i < m_History.size(); ++i)
+            {
+                m_History[i]->WaitHydrated();
+                std::cout << std::format("  [{:04}]-[{}] User:{} Time:{} {} {}\n"
+                    , i
+                    , m_History.isUndone(i) ? "-" : i < m_UndoIndex ? "U" : "R"
+                    , m_History[i]->m_UserID
+                    , m_History[i]->m_TimeStamp
+                    , m_History[i]->m_CommandString
+                    , m_History[i]->m_CacheUndoData.size() ? "[Cached]" : ""
+                    );
+            }
+            std::cout << "Current Index: " << m_UndoIndex << "\n";
+        }
+
+        [[nodiscard]] std::string SuggestNext(int UserID) noexcept
+        {
+            if (m_UndoIndex == 0)return "-Move 0 0";
+            auto& last = *m_History[m_UndoIndex - 1];
+            last.WaitHydrated();
+            if (last.m_UserID != UserID || last.m_CommandString.find("Move") == std::string::npos)return "-Move 0 0";
+
+            size_t pos = last.m_CommandString.find("-T");
+            assert(pos != std::string::npos);
+            pos += 3; // Skip "-T "
+            size_t space = last.m_CommandString.find(' ', pos);
+            assert(space != std::string::npos);
+            int X = std::stoi(std::string(last.m_CommandString.substr(pos, space - pos)));
+            int Y = std::stoi(std::string(last.m_CommandString.substr(space + 1)));
+            return std::format("-Move -T {} {}", X + 10, Y + 10);
+        }
+
+        const std::string_view getUndoPath() const noexcept
+        {
+            return m_UndoPath;
+        }
+
+        // Sets how much history is kept. The policy is enforced incrementally on every Execute/Undo/Redo (and by
+        // EnforceRetention), the records of the dropped entries are deleted by the IO threads.
+        void setRetentionPolicy(const retention_policy& Policy) noexcept
+        {
+            m_Retention = Policy;
+            if (m_Storage) m_Storage->setMaxBytes(Policy.m_MaxBytes);
+            EnforceRetention();
+        }
+
+        // Limits the bytes the storage may use (0 means no limit). With storage::memory this gives a
+        // memory-only mode with a hard cap.
+        void setMaxStorageBytes(std::uint64_t MaxBytes) noexcept
+        {
+            m_Retention.m_MaxBytes = MaxBytes;
+            if (m_Storage) m_Storage->setMaxBytes(MaxBytes);
+            EnforceRetention();
+        }
+
+        // Drops the oldest entries that fall outside the retention policy. It runs on the calling thread but is only
+        // bookkeeping: the sizes and time stamps are resident (no page is faulted in), the index operation is
+        // buffered and the deletes go to the IO threads. At most m_MaxDropsPerCall entries are dropped per call so
+        // that tightening the policy does not stall the caller.
+        // Past the byte cap the history is trimmed to three quarters of it, which leaves the storage room to give
+        // the space back in bulk (see storage::journal) instead of on every step.
+        void EnforceRetention() noexcept
+        {
+            const auto& Policy = m_Retention;
+            const int   Limit  = std::min(m_UndoIndex, Policy.m_MaxDropsPerCall);
+            int         Count  = 0;
+
+            if (Policy.m_MaxSteps && m_History.size() > Policy.m_MaxSteps)
+            {
+                Count = static_cast<int>(std::min<std::size_t>(m_History.size() - Policy.m_MaxSteps, Limit));
+            }
+
+            if (Policy.m_MaxAge.count())
+            {
+                const auto Oldest = toTimeStamp(std::chrono::system_clock::now() - Policy.m_MaxAge);
+                while (Count < Limit && m_History.getTimeStamp(Count) < Oldest) ++Count;
+            }
+
+            if (Policy.m_MaxBytes)
+            {
+                const auto  Total = getStorageBytes();
+                std::uint64_t Freed = 0;
+                for (int i = 0; i < Count; ++i)
+                {
+                    Freed += m_History.getStorageSize(i);
+                }
+
+                if (Total > Policy.m_MaxBytes) m_bTrimmingBytes = true;
+                const auto Target = m_bTrimmingBytes ? Policy.m_MaxBytes / 4 * 3 : Policy.m_MaxBytes;
+                while (Count < Limit && Total - std::min(Total, Freed) > Target)
+                {
+                    Freed += m_History.getStorageSize(Count);
+                    ++Count;
+                }
+                if (Total - std::min(Total, Freed) <= Target) m_bTrimmingBytes = false;
+            }
+
+            DropOldestHistory(Count);
+        }
+
+        // Bytes the storage uses: the records, the pages of the paged history and the index
+        std::uint64_t getStorageBytes() const noexcept
+        {
+            return m_StorageBytes.load(std::memory_order_relaxed) + (m_Storage ? m_Storage->getIndexBytes() : 0);
+        }
+
+        storage::base& getStorage() noexcept
+        {
+            assert(m_Storage);
+            return *m_Storage;
+        }
+
+        // Starts a background scan of the storage that deletes the records and pages the history does not
+        // reference. It runs at low priority; with m_bAutoLoadSave it is started by itself after loading.
+        void CollectGarbage() noexcept
+        {
+            if (!m_Storage) return;
+
+            std::vector<std::uint64_t> Live(m_History.size());
+            for (std::size_t i = 0; i < Live.size(); ++i) Live[i] = m_History.getTimeStamp(i);
+            for (auto& B : m_Branches) for (auto& Step : B.m_Steps) Live.push_back(Step.m_TimeStamp);
+            std::sort(Live.begin(), Live.end());
+
+            // Nothing executed from now on can have a smaller time stamp (see NewTimeStamp)
+            const std::uint64_t Newer = std::max(toTimeStamp(std::chrono::system_clock::now()), m_LastTimeStamp + 1);
+
+            PushIdleJob(std::make_unique<job::collect_garbage>(*this, std::move(Live), Newer, m_History.getFirstPage()));
+        }
+
+        // Writes a snapshot of the history timestamps and the cursor to the storage. With m_bAutoLoadSave this
+        // happens by itself from time to time to compact the index log, the snapshot is then the index as the log
+        // has it (see WritePendingIndexOps); without it, this is how the index is saved once every record is.
+        [[nodiscard]] std::string SaveTimestamps(void) noexcept
+        {
+            assert(m_Done == false);
+            assert(m_Storage);
+
+            if (m_bAutoLoadSave == false)
+            {
+                SynJobQueue();
+
+                std::lock_guard<std::mutex> Lock(m_IndexMutex);
+                m_IndexState.m_TimeStamps.resize(m_History.size());
+                m_IndexState.m_Sizes.resize(m_History.size());
+                m_IndexState.m_Meta.resize(m_History.size());
+                for (std::size_t i = 0; i < m_History.size(); ++i)
+                {
+                    m_IndexState.m_TimeStamps[i] = m_History.getIndexTimeStamp(i);
+                    m_IndexState.m_Sizes[i]      = m_History.getStorageSize(i);
+                    m_IndexState.m_Meta[i]       = m_History.getMeta(i);
+                }
+                m_IndexState.m_Cursor = m_UndoIndex;
+                m_IndexState.m_Base   = m_History.getBase();
+                return WriteIndexSnapshot();
+            }
+
+            std::lock_guard<std::mutex> Lock(m_IndexMutex);
+            WritePendingIndexOps();
+            return WriteIndexSnapshot();
+        }
+
+        // Loads history timestamps from the storage
+        [[nodiscard]] std::string LoadTimestamps(void) noexcept
+        {
+            assert(m_Done == false);
+            assert(m_Storage);
+
+            //
+            // Make sure everything is reset to zero
+            //
+
+            // Wait for any pending job to finish
+            SynJobQueue();
+            if (m_bAutoLoadSave) FlushIndexLog();
+
+            m_History.clear();
+            m_LRU.clear();
+            m_State.m_Keyframes.clear();
+            m_UndoIndex = 0;
+            m_StorageBytes = 0;
+            m_bUserStacks = false;
+            m_bHistoryIndex = false;
+
+            //
+            // Load history from saved timestamps
+            //
+            std::vector<std::byte> Log;
+            if (auto Err = m_Storage->ReadIndex(Log); !Err.empty()) return Err;
+
+            std::unique_lock<std::mutex> IndexLock(m_IndexMutex);
+            m_IndexState = {};
+            storage::ReplayIndexLog(Log, m_IndexState);
+
+            // Only the index is loaded, the entries are faulted in by the paged history when touched.
+            // The whole history comes back, including the steps after the cursor that can still be redone.
+            m_StorageBytes  = m_History.assign(m_IndexState);
+            m_UndoIndex     = static_cast<int>(m_IndexState.m_Cursor);
+            m_LastTimeStamp = m_History.empty() ? 0 : m_History.getTimeStamp(m_History.size() - 1);
+
+            // Start the index log from a compact snapshot
+            if (m_bAutoLoadSave)
+            {
+                if (auto Err = WriteIndexSnapshot(); !Err.empty()) return Err;
+            }
+            IndexLock.unlock();
+
+            //
+            // Bring in the pages around the cursor and cache the latest steps. Every record is read once: the
+            // entries of the hot window get their key data (when the page did not have it) and cache together.
+            // The records are hydrated in the background, newest first, so we return as soon as the index is in;
+            // anything that needs an entry before its job ran waits for that entry only.
+            //
+            const int                HotBegin = std::max(0, static_cast<int>(m_UndoIndex) - static_cast<int>(m_MaxCachedSteps));
+            std::vector<std::size_t> Missing;
+            m_History.Prefetch(HotBegin, m_UndoIndex + 1, Missing);
+
+            for (int i = m_UndoIndex - 1; i >= HotBegin; --i)
+            {
+                const bool bMissingKeyData = std::binary_search(Missing.begin(), Missing.end(), static_cast<std::size_t>(i));
+                m_LRU.push_front(m_History[i]);
+                m_History.setCacheQueued(i, true);
+                PushJob(std::make_unique<job::load_entries>(*this, m_History[i], bMissingKeyData, true));
+            }
+
+            std::vector<std::shared_ptr<history_entry>> Cold;
+            for (auto It = Missing.rbegin(); It != Missing.rend(); ++It)
+            {
+                if (*It < static_cast<std::size_t>(HotBegin) || *It >= static_cast<std::size_t>(m_UndoIndex))
+                    Cold.push_back(m_History[*It]);
+            }
+            if (Cold.empty() == false) PushJob(std::make_unique<job::load_entries>(*this, std::move(Cold), true, false));
+
+            TrimHistory();
+
+            // Whatever a crash left behind is cleaned up once the IO threads are idle
+            CollectGarbage();
+
+            return {};
+        }
+
+    protected:
+
+        // The body of Execute, the error messages go to pErr when there is one
+        template<typename T_COMMAND>
+        exec_error ExecuteStep(T_COMMAND& Cmd, std::string_view cmd_str, int UserID, std::string* pErr) noexcept
+        {
+            assert(m_Done == false);
+
+            // Check to see if the command line has any errors
+            if (auto err = Cmd.Parse(cmd_str); !err.empty())
+            {
+                if (pErr) *pErr = std::move(err);
+                return exec_error::parse;
+            }
+
+            // Check for help flag
+            if (Cmd.isHelp())
+            {
+                Cmd.m_Parser.printHelp();
+                return exec_error::none;
+            }
+
+            // Ready to begin execution...
+            auto Entry = m_EntryPool.New();
+            if (UserID == -1)UserID = m_DefaultUser;
+
+            Entry->m_UserID         = UserID;
+            Entry->m_TimeStamp      = NewTimeStamp();
+            Entry->setCommandString(cmd_str);
+
+            // Automatic backups and the deltas of the state history can not miss a field so they are not validated
+            const auto Arena = m_State.m_pState ? std::span<std::byte>{} : Cmd.getAutoBackupArena();
+            assert(Arena.size() <= diff::max_size_v);
+
+            // Copy for the shadow validation, before the command touches the database
+            void* pBefore = m_pValidator && Arena.empty() && m_State.m_pState == nullptr ? SampleForValidation(Cmd) : nullptr;
+
+            // With the state history the payload is the delta of the block, taken after Redo, same for the arena
+            if (Arena.empty() == false)
+            {
+                m_AutoBackup.assign(Arena.begin(), Arena.end());
+            }
+            else if (m_State.m_pState == nullptr)
+            {
+                Entry->m_CacheUndoData.reserve(Cmd.getPayloadSize());
+                undo_file File(*Entry);
+                Cmd.BackupCurrenState(File);
             }
 
-            if (auto Err = Cmd.Redo(); !Err.empty()) return Err;
+            const auto RedoStart = std::chrono::steady_clock::now();
+            if (auto Err = Cmd.Redo(); !Err.empty())
+            {
+                if (pBefore) m_pValidator->Destroy(pBefore);
+                if (pErr) *pErr = std::move(Err);
+                return exec_error::redo;
+            }
+            if (m_State.m_pState)                CaptureState(*Entry);
+            else if (Arena.empty() == false)    diff::Encode(m_AutoBackup, Arena, Entry->m_CacheUndoData);
+            else if (Cmd.canRestoreForward())   CaptureForward(Cmd, *Entry, std::chrono::steady_clock::now() - RedoStart);
+            if (pBefore) QueueValidation(pBefore, *Entry);
 
             PruneHistory();
             m_History.push_back(Entry);
             m_UndoIndex++;
-            if (!m_UndoPath.empty()) 
+            TakeKeyframe();
+            if (m_bUserStacks)
+            {
+                auto& Stack = m_UserStacks[UserID];
+                Stack.m_Applied.push_back(m_History.getBase() + m_History.size() - 1);
+                Stack.m_Undone.clear();
+            }
+            if (m_bHistoryIndex) m_HistoryIndex.Add(UserID, Entry->m_CommandID, m_History.getBase() + m_History.size() - 1);
+            LogIndex(storage::index_op::push, Entry->m_TimeStamp, Entry);
+            if (m_Storage)
             {
                 PushJob(std::make_unique<job::save_to_disk>(*this, Entry));
                 m_LRU.push_back(Entry);
                 UpdateLRU();
             }
-            return {};
+            EnforceRetention();
+            TrimHistory();
+            return exec_error::none;
         }
 
-        system& Undo(void) noexcept
+        void RegisterCommand(command_base& Cmd, std::string_view Name) noexcept
         {
-            assert(m_Done == false);
+            const auto ID = string_pool::getInstance().Intern(Name);
+            if (ID >= m_Commands.size()) m_Commands.resize(ID + 1, nullptr);
+            m_Commands[ID] = &Cmd;
+            Cmd.m_hHelp = Cmd.m_Parser.addOption("h", "Show this help message\nUse -h or --h to display", false, 0);
+        }
+
+        // Picks the steps to validate at random (a fixed period would line up with repetitive work) at m_SampleRate
+        // and copies the database for them while the budget allows
+        void* SampleForValidation(command_base& Cmd) noexcept
+        {
+            m_SampleSeed ^= m_SampleSeed << 13;
+            m_SampleSeed ^= m_SampleSeed >> 7;
+            m_SampleSeed ^= m_SampleSeed << 17;
+            if (static_cast<double>(m_SampleSeed >> 11) * 0x1p-53 >= m_Validation.m_SampleRate) return nullptr;
+
+            const auto Elapsed = std::chrono::steady_clock::now() - m_ValidationStart;
+            {
+                std::lock_guard<std::mutex> Lock(m_ValidationMutex);
+                if (m_ValidationTime > m_Validation.m_CpuBudget * std::chrono::duration_cast<std::chrono::nanoseconds>(Elapsed).count()
+                    || m_ValidationQueue.size() >= m_Validation.m_MaxPending)
+                {
+                    ++m_ValidationStats.m_Skipped;
+                    return nullptr;
+                }
+                ++m_ValidationStats.m_Sampled;
+            }
 
-            if (m_UndoIndex == 0) return *this;
-            m_UndoIndex--;
+            const auto Start   = std::chrono::steady_clock::now();
+            auto       pBefore = m_pValidator->Clone(Cmd.m_pDataBase);
+            m_ValidationTime += std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - Start).count();
+            return pBefore;
+        }
 
-            auto&   LastCommand = *m_History[m_UndoIndex];
-            auto    CmdName     = getCommandName(LastCommand.m_CommandString);
-            auto&   Cmd         = *m_Commands[std::string(CmdName)];
+        void QueueValidation(void* pBefore, const history_entry& Entry) noexcept
+        {
+            std::lock_guard<std::mutex> Lock(m_ValidationMutex);
+            m_ValidationQueue.push_back({ pBefore, std::string(Entry.m_CommandString), Entry.m_TimeStamp, Entry.m_CommandID });
+            m_ValidationCond.notify_one();
+        }
 
-            // Force a sync if we need to
-            if (LastCommand.m_CacheUndoData.empty())
+        // Samples still waiting are dropped
+        void StopValidation(void) noexcept
+        {
+            if (m_ValidationThread.joinable() == false) return;
             {
-                assert(!m_UndoPath.empty());
-                job::warmup_cache Job(*this, m_History[m_UndoIndex]);
-                Job.Execute();
-                assert( LastCommand.m_CacheUndoData.empty() == false );
+                std::lock_guard<std::mutex> Lock(m_ValidationMutex);
+                m_bValidationDone = true;
             }
+            m_ValidationCond.notify_all();
+            m_ValidationThread.join();
+
+            for (auto& Sample : m_ValidationQueue) m_pValidator->Destroy(Sample.m_pBefore);
+            m_ValidationQueue.clear();
+        }
+
+        // Finds the registered command of an entry by its interned name, null when its record could not be read
+        command_base* getCommand(const history_entry& Entry) noexcept
+        {
+            if (Entry.WaitHydrated() == false) return nullptr;
+            assert(Entry.m_CommandID < m_Commands.size() && m_Commands[Entry.m_CommandID]);
+            return m_Commands[Entry.m_CommandID];
+        }
+
+        // The dispatch of Undo/Redo: the command of the entry through command_base
+        struct virtual_dispatch
+        {
+            system& m_System;
 
+            template<typename T_FUNCTION>
+            bool operator()(const history_entry& Entry, T_FUNCTION&& Function) const noexcept
             {
-                std::unique_lock<std::mutex> lock(LastCommand.m_Mutex);
-                undo_file File(LastCommand);
-                Cmd.Undo(File);
+                auto pCmd = m_System.getCommand(Entry);
+                return pCmd && Function(*pCmd);
             }
+        };
+
+        void UpdateLRU() noexcept
+        {
+            if (m_History.empty())return;
 
-            if (!m_UndoPath.empty())
+            assert(m_MaxCachedSteps > (m_LookAheadSteps*2+1) );
+            const auto SizeEstimation = m_MaxCachedSteps - m_LookAheadSteps * 2 - 1;
+            while (m_LRU.size() > SizeEstimation)
             {
-                m_LRU.push_back(m_History[m_UndoIndex]);
-                UpdateLRU();
+                auto Oldest = m_LRU.front();
+                std::unique_lock<std::mutex> lock(Oldest->m_Mutex);
+                if (Oldest->m_bHasBeenSaved) Oldest->m_CacheUndoData.clear();
+                lock.unlock();
+                m_LRU.pop_front();
+
+                // Out of the LRU so it can be warmed up again
+                if (const auto i = m_History.find(Oldest->m_TimeStamp); i != paged_history::npos) m_History.setCacheQueued(i, false);
+            }
+
+            // Entries with a job already queued are skipped, the prefetch runs on every step so without the
+            // flag the same cache would be queued (and pushed into the LRU) again until the worker gets to it
+            const auto Warmup = [&](std::size_t i)
+            {
+                if (m_History.isCacheQueued(i) || m_History[i]->m_CacheUndoData.empty() == false) return;
+
+                m_History.setCacheQueued(i, true);
+                PushJob(std::make_unique<job::warmup_cache>(*this, m_History[i]));
+                m_LRU.push_back(m_History[i]);
+            };
+
+            for (int i = 1; i <= m_LookAheadSteps && m_LRU.size() < m_MaxCachedSteps; ++i)
+            {
+                if (m_UndoIndex >= i)                           Warmup(m_UndoIndex - i);
+                if (m_UndoIndex + i < m_History.size())         Warmup(m_UndoIndex + i);
             }
-            return *this;
         }
 
-        system& Redo(void) noexcept
+        void PushJob(std::unique_ptr<job::base>&& Job) noexcept
         {
-            assert(m_Done == false);
+            std::lock_guard<std::mutex> lock(m_Mutex);
+            m_IOQueue.push(std::move(Job));
+            m_Cond.notify_one();
+        }
 
-            if (m_UndoIndex >= m_History.size())return *this;
-            auto& LastCommand   = *m_History[m_UndoIndex];
-            auto  CmdName       = getCommandName(LastCommand.m_CommandString);
-            auto& Cmd           = *m_Commands[std::string(CmdName)];
+        // Idle jobs only run when the IO queue is empty and are dropped on shutdown
+        void PushIdleJob(std::unique_ptr<job::base>&& Job) noexcept
+        {
+            std::lock_guard<std::mutex> lock(m_Mutex);
+            if (m_Done) return;
+            m_IdleQueue.push(std::move(Job));
+            m_Cond.notify_one();
+        }
 
+        void SynJobQueue() noexcept
+        {
+            if (!m_Storage) return;
+            std::unique_lock<std::mutex> Lock(m_Mutex);
+            while (!m_Cond.wait_for(Lock, std::chrono::milliseconds(100), [this] {return m_IOQueue.empty() && m_RunningJobs == 0; }))
             {
-                std::unique_lock<std::mutex> lock(LastCommand.m_Mutex);
+            }
+        }
 
-                // We really should not have any errors here since the command was executed one time already
-                if (auto Err = Cmd.Parse(LastCommand.m_CommandString); !Err.empty()) return *this;
-                if (auto Err = Cmd.Redo(); !Err.empty()) return *this;
+        // Marks a range of entries as removed from the history and collects their time stamps so their records can be deleted
+        std::vector<std::uint64_t> ReleaseEntries(int Begin, int End) noexcept
+        {
+            auto TimeStamps = Reuse(m_ReleasedTimeStamps);
+            m_StorageBytes -= m_History.Release(Begin, End, TimeStamps);
+            return TimeStamps;
+        }
+
+        // Without a storage the lists of released time stamps and pages go nowhere, their memory is used again
+        static std::vector<std::uint64_t> Reuse(std::vector<std::uint64_t>& Scratch) noexcept
+        {
+            auto List = std::move(Scratch);
+            List.clear();
+            return List;
+        }
+
+        // Appends an operation to the index log in the storage so the index on disk is always current. A push is
+        // only written once the record of its step is saved (see WritePendingIndexOps), the operations after it
+        // wait in order.
+        void LogIndex(storage::index_op Op, std::uint64_t Value, std::shared_ptr<history_entry> Entry = {}) noexcept
+        {
+            if (!m_Storage || !m_bAutoLoadSave) return;
+            assert(Op != storage::index_op::push || Entry);
+
+            std::lock_guard<std::mutex> Lock(m_IndexMutex);
+            m_PendingIndexOps.push_back({ Op, Value, std::move(Entry) });
+            WritePendingIndexOps();
+        }
+
+        // Queues a job that deletes what the last index operation removed. It must not run before that operation
+        // is in the storage, a crash in between would leave the index pointing at deleted records.
+        void PushJobAfterIndex(std::unique_ptr<job::base>&& Job) noexcept
+        {
+            if (m_bAutoLoadSave)
+            {
+                std::lock_guard<std::mutex> Lock(m_IndexMutex);
+                if (!m_PendingIndexOps.empty())
+                {
+                    m_PendingIndexOps.back().m_Jobs.push_back(std::move(Job));
+                    return;
+                }
             }
+            PushJob(std::move(Job));
+        }
+
+        // Called by the IO threads once a record is saved (or skipped), the index operations waiting for it can go
+        void FlushIndexLog(void) noexcept
+        {
+            std::lock_guard<std::mutex> Lock(m_IndexMutex);
+            WritePendingIndexOps();
+        }
+
+        // Replaces the index log with m_IndexState. m_IndexMutex must be held.
+        [[nodiscard]] std::string WriteIndexSnapshot(void) noexcept
+        {
+            m_IndexOps.clear();
+            storage::EncodeIndexSnapshot(m_IndexState, m_IndexOps);
+            m_IndexOpsSinceSnapshot = 0;
+            return m_Storage->WriteIndex(m_IndexOps);
+        }
+
+        // Writes the longest run of pending operations that stops before the push of a step not saved yet, so a
+        // crash never leaves the index pointing at a record that is still on its way. A step deleted before it was
+        // saved never gets a record, its push only goes in the same write as the operation that removes it again
+        // (tracked by replaying the positions over m_IndexState). A step whose record failed to save does not hold
+        // the log back, its push goes in without a size and the next session finds the record missing (see
+        // hydration). When the storage refuses the write the operations and the jobs waiting for them stay pending
+        // for the next flush. The written operations are replayed on m_IndexState and the log is compacted into a
+        // snapshot of it once it has many more operations than the history has entries. m_IndexMutex must be held.
+        void WritePendingIndexOps(void) noexcept
+        {
+            auto&         Orphans  = m_IndexOrphans;    // Positions of the pushes without a record
+            std::uint64_t Size     = m_IndexState.m_TimeStamps.size();
+            std::size_t   Safe     = 0;
 
-            if (!m_UndoPath.empty())
+            Orphans.clear();
+            for (std::size_t i = 0; i < m_PendingIndexOps.size(); ++i)
             {
-                m_LRU.push_back(m_History[m_UndoIndex]);
-                UpdateLRU();
+                const auto& Op = m_PendingIndexOps[i];
+                if (Op.m_Op == storage::index_op::push)
+                {
+                    std::lock_guard<std::mutex> EntryLock(Op.m_Entry->m_Mutex);
+                    if (Op.m_Entry->m_bHasBeenSaved == false && Op.m_Entry->m_bSaveFailed == false)
+                    {
+                        if (Op.m_Entry->m_bHasBeenDeleted == false) break;
+                        Orphans.push_back(Size);
+                    }
+                    ++Size;
+                }
+                else if (Op.m_Op == storage::index_op::truncate)
+                {
+                    Size = std::min(Size, Op.m_Value);
+                    std::erase_if(Orphans, [&](std::uint64_t P) { return P >= Size; });
+                }
+                else if (Op.m_Op == storage::index_op::drop_front)
+                {
+                    const auto Count = std::min(Size, Op.m_Value);
+                    Size -= Count;
+                    std::erase_if(Orphans, [&](std::uint64_t P) { return P < Count; });
+                    for (auto& P : Orphans) P -= Count;
+                }
+
+                if (Orphans.empty()) Safe = i + 1;
             }
-            m_UndoIndex++;
+            if (Safe == 0) return;
 
-            return *this;
+            m_IndexOps.clear();
+            for (std::size_t i = 0; i < Safe; ++i)
+            {
+                const auto& Op = m_PendingIndexOps[i];
+                storage::EncodeIndexOp(Op.m_Op, Op.m_Value, m_IndexOps);
+                if (Op.m_Op != storage::index_op::push) continue;
+
+                std::lock_guard<std::mutex> EntryLock(Op.m_Entry->m_Mutex);
+                if (Op.m_Entry->m_bHasBeenSaved) storage::EncodeIndexOp(storage::index_op::size, Op.m_Entry->m_StorageSize, m_IndexOps);
+                storage::EncodeIndexOp(storage::index_op::meta, storage::MakeIndexMeta(Op.m_Entry->m_UserID, Op.m_Entry->m_CommandString), m_IndexOps);
+            }
+
+            // The index on disk still has what the jobs would delete
+            if (auto Err = m_Storage->AppendIndex(m_IndexOps); !Err.empty())
+            {
+                std::cerr << Err << "\n";
+                return;
+            }
+
+            for (std::size_t i = 0; i < Safe; ++i)
+                for (auto& Job : m_PendingIndexOps[i].m_Jobs) PushJob(std::move(Job));
+
+            m_PendingIndexOps.erase(m_PendingIndexOps.begin(), m_PendingIndexOps.begin() + Safe);
+            storage::ReplayIndexLog(m_IndexOps, m_IndexState);
+
+            m_IndexOpsSinceSnapshot += Safe;
+            if (m_IndexOpsSinceSnapshot > std::max<std::size_t>(index_snapshot_min_v, m_IndexState.m_TimeStamps.size() * 2))
+            {
+                if (auto Err = WriteIndexSnapshot(); !Err.empty())
+                {
+                    std::cerr << Err << "\n";
+                }
+            }
         }
 
-        void displayHistory() const noexcept
+        // Evicts the pages of the history that are far from the undo index
+        void TrimHistory() noexcept
         {
-            std::cout << "History:\n";
-            for (size_t i = 0; i < m_History.size(); ++i)
+            if (!m_Storage) return;
+
+            std::vector<paged_history::evicted_page> Dirty;
+            if (m_History.Trim(m_UndoIndex, m_ResidentPageRadius, Dirty) == 0) return;
+            for (auto& Page : Dirty)
             {
-                std::cout << std::format("  [{:04}]-[{}] User:{} Time:{} {} {}\n"
-                    , i
-                    , i < m_UndoIndex ? "U" : "R"
-                    , m_History[i]->m_UserID
-                    , m_History[i]->m_TimeStamp
-                    , m_History[i]->m_CommandString
-                    , m_History[i]->m_CacheUndoData.size() ? "[Cached]" : ""
-                    );
+                PushJob(std::make_unique<job::save_page>(*this, Page.m_Key, std::move(Page.m_Data)));
             }
-            std::cout << "Current Index: " << m_UndoIndex << "\n";
+
+            // Evicted entries are built again when their page is faulted in, the cached ones go with the page
+            m_LRU.remove_if([&](const std::shared_ptr<history_entry>& E)
+            {
+                const auto i = m_History.find(E->m_TimeStamp);
+                return i == paged_history::npos || m_History.peek(i) != E;
+            });
         }
 
-        [[nodiscard]] std::string SuggestNext(int UserID) noexcept
+        // Removes the oldest Count entries (never past the undo index) from the history and the storage
+        void DropOldestHistory(int Count) noexcept
         {
-            if (m_UndoIndex == 0)return "-Move 0 0";
-            auto& last = *m_History[m_UndoIndex - 1];
-            if (last.m_UserID != UserID || last.m_CommandString.find("Move") == std::string::npos)return "-Move 0 0";
+            Count = std::min(Count, m_UndoIndex);
+            if (Count <= 0) return;
 
-            size_t pos = last.m_CommandString.find("-T");
-            assert(pos != std::string::npos);
-            pos += 3; // Skip "-T "
-            size_t space = last.m_CommandString.find(' ', pos);
-            assert(space != std::string::npos);
-            int X = std::stoi(last.m_CommandString.substr(pos, space - pos));
-            int Y = std::stoi(last.m_CommandString.substr(space + 1));
-            return std::format("-Move -T {} {}", X + 10, Y + 10);
+            auto TimeStamps = ReleaseEntries(0, Count);
+            auto Pages      = m_History.erase_front(Count, Reuse(m_ReleasedPages));
+            if (!m_Branches.empty())
+            {
+                // The root is gone with the first step, so are the branches hanging off it
+                DeleteBranches([&](const branch& B) { return B.m_Parent == 0 || std::find(TimeStamps.begin(), TimeStamps.end(), B.m_Parent) != TimeStamps.end(); });
+            }
+            m_UndoIndex -= Count;
+            LogIndex(storage::index_op::drop_front, Count);
+            TrimIndexes();
+            m_LRU.remove_if([](const std::shared_ptr<history_entry>& E) { return E->m_bHasBeenDeleted; });
+
+            if (m_Storage)
+            {
+                PushJobAfterIndex(std::make_unique<job::delete_entries>(*this, std::move(TimeStamps), std::move(Pages)));
+            }
+            else
+            {
+                m_ReleasedTimeStamps = std::move(TimeStamps);
+                m_ReleasedPages      = std::move(Pages);
+            }
+        }
+
+        // If we are in the middle of the undo buffer and we execute a new command, we need to prune the history
+        // (or keep it as a branch with the undo tree)
+        void PruneHistory() noexcept
+        {
+            if (m_UndoIndex >= m_History.size())return;
+            if (m_bUndoTree)
+            {
+                DetachBranch();
+            }
+            else
+            {
+                auto TimeStamps = ReleaseEntries(m_UndoIndex, static_cast<int>(m_History.size()));
+                auto Pages      = m_History.truncate(m_UndoIndex, Reuse(m_ReleasedPages));
+                LogIndex(storage::index_op::truncate, m_UndoIndex);
+
+                // Without a storage there is nothing to delete, the entries just go away with m_History
+                if (m_Storage)
+                {
+                    PushJobAfterIndex(std::make_unique<job::delete_entries>(*this, std::move(TimeStamps), std::move(Pages)));
+                }
+                else
+                {
+                    m_ReleasedTimeStamps = std::move(TimeStamps);
+                    m_ReleasedPages      = std::move(Pages);
+                }
+            }
+            TrimIndexes();
+        }
+
+        // Steps back once, returns false when there is nothing to undo
+        bool UndoStep(void) noexcept
+        {
+            return UndoStep(virtual_dispatch{ *this });
+        }
+
+        template<typename T_DISPATCH>
+        bool UndoStep(const T_DISPATCH& Dispatch) noexcept
+        {
+            // Steps reverted by a selective undo are not applied, the cursor just moves over them. Steps whose
+            // record could not be read stop it
+            int Index = m_UndoIndex;
+            while (Index && m_History.isUndone(Index - 1)) --Index;
+            if (Index == 0 || m_History[Index - 1]->WaitHydrated() == false) return false;
+            if (Revert(Index - 1, Dispatch) == false) return false;
+
+            m_UndoIndex = Index - 1;
+            LogIndex(storage::index_op::cursor, m_UndoIndex);
+            TakeKeyframe();
+
+            if (m_bUserStacks)
+            {
+                auto& Applied = m_UserStacks[m_History[m_UndoIndex]->m_UserID].m_Applied;
+                if (!Applied.empty() && Applied.back() == m_History.getBase() + m_UndoIndex) Applied.pop_back();
+            }
+            return true;
+        }
+
+        // Steps forward once, returns false when there is nothing to redo
+        bool RedoStep(void) noexcept
+        {
+            return RedoStep(virtual_dispatch{ *this });
+        }
+
+        template<typename T_DISPATCH>
+        bool RedoStep(const T_DISPATCH& Dispatch) noexcept
+        {
+            std::size_t Index = m_UndoIndex;
+            while (Index < m_History.size() && m_History.isUndone(Index)) ++Index;
+            if (Index >= m_History.size() || m_History[Index]->WaitHydrated() == false) return false;
+            if (Reapply(Index, Dispatch) == false) return false;
+
+            m_UndoIndex = static_cast<int>(Index + 1);
+            LogIndex(storage::index_op::cursor, m_UndoIndex);
+            TakeKeyframe();
+
+            if (m_bUserStacks)
+            {
+                m_UserStacks[m_History[Index]->m_UserID].m_Applied.push_back(m_History.getBase() + Index);
+            }
+            return true;
+        }
+
+        // Runs the undo of the step at Position, returns false when its payload could not be restored
+        bool Revert(std::size_t Position) noexcept
+        {
+            return Revert(Position, virtual_dispatch{ *this });
+        }
+
+        template<typename T_DISPATCH>
+        bool Revert(std::size_t Position, const T_DISPATCH& Dispatch) noexcept
+        {
+            if (m_State.m_pState)
+            {
+                if (ApplyState(Position, false) == false) return false;
+            }
+            else
+            {
+                auto& LastCommand = *m_History[Position];
+
+                // Force a sync if we need to (automatic backups of steps that changed nothing are empty). The
+                // cache is checked under the entry lock since a warmup job may be filling it
+                bool bLoad;
+                {
+                    std::lock_guard<std::mutex> lock(LastCommand.m_Mutex);
+                    bLoad = LastCommand.m_CacheUndoData.empty() && LastCommand.m_bHasBeenSaved;
+                }
+                if (bLoad)
+                {
+                    assert(m_Storage);
+                    job::warmup_cache Job(*this, m_History[Position]);
+                    Job.Execute();
+                }
+
+                const bool bOk = Dispatch(LastCommand, [&](auto& Cmd)
+                {
+                    std::unique_lock<std::mutex> lock(LastCommand.m_Mutex);
+                    if (auto Arena = Cmd.getAutoBackupArena(); Arena.empty() == false)
+                    {
+                        return diff::Apply(Arena, LastCommand.m_CacheUndoData, false);
+                    }
+                    if (LastCommand.m_CacheUndoData.empty()) return false;
+
+                    undo_file File(LastCommand);
+                    Cmd.Undo(File);
+                    return true;
+                });
+                if (bOk == false) return false;
+            }
+
+            if (m_Storage)
+            {
+                m_LRU.push_back(m_History[Position]);
+                UpdateLRU();
+            }
+            return true;
+        }
+
+        // Runs the redo of the step at Position
+        bool Reapply(std::size_t Position) noexcept
+        {
+            return Reapply(Position, virtual_dispatch{ *this });
+        }
+
+        template<typename T_DISPATCH>
+        bool Reapply(std::size_t Position, const T_DISPATCH& Dispatch) noexcept
+        {
+            if (m_State.m_pState)
+            {
+                if (ApplyState(Position, true) == false) return false;
+                if (m_Storage)
+                {
+                    m_LRU.push_back(m_History[Position]);
+                    UpdateLRU();
+                }
+                return true;
+            }
+
+            auto& LastCommand = *m_History[Position];
+            const bool bOk = Dispatch(LastCommand, [&](auto& Cmd)
+            {
+                // The redo payload comes with the cache (the job only reads it if it is not there)
+                if (hasForwardPayload(Cmd))
+                {
+                    job::warmup_cache Job(*this, m_History[Position]);
+                    Job.Execute();
+                }
+
+                std::unique_lock<std::mutex> lock(LastCommand.m_Mutex);
+
+                // We really should not have any errors here since the command was executed one time already
+                return RunRedo(Cmd, LastCommand);
+            });
+            if (bOk == false) return false;
+
+            if (m_Storage)
+            {
+                m_LRU.push_back(m_History[Position]);
+                UpdateLRU();
+            }
+            return true;
         }
 
-        const std::string_view getUndoPath() const noexcept
+        // The payload of a step in the state history is what changed in the block
+        void CaptureState(history_entry& Entry) noexcept
         {
-            return m_UndoPath;
+            diff::Encode(m_State.m_Shadow, { m_State.m_pState, m_State.m_Size }, Entry.m_CacheUndoData);
+            diff::Apply(m_State.m_Shadow, Entry.m_CacheUndoData, true);
         }
 
-        // Saves history timestamps to disk
-        [[nodiscard]] std::string SaveTimestamps(std::string_view FilePath={}) noexcept
+        // Applies the delta of the step at Position to the block and its shadow, forward redoes it. Returns false,
+        // leaving both as they were, when the record could not be read or the delta does not fit the block
+        bool ApplyState(std::size_t Position, bool bForward) noexcept
         {
-            assert(m_Done == false);
-            assert(!m_UndoPath.empty());
+            auto& Entry = *m_History[Position];
+            if (Entry.WaitHydrated() == false) return false;
 
-            std::string Path;
-            if (FilePath.empty())
-            {
-                Path = std::format("{}/UndoTimestamps.bin", m_UndoPath);
-                FilePath = Path;
-            }
+            std::unique_lock<std::mutex> lock(Entry.m_Mutex);
 
-            FILE* File;
-            if (auto Err = fopen_s(&File, FilePath.data(), "wb"); Err)
+            // Steps that changed nothing have no payload, nor a record yet if they were just executed
+            if (Entry.m_CacheUndoData.empty() && Entry.m_bHasBeenSaved && m_Storage)
             {
-                char ErrMsg[100];
-                strerror_s(ErrMsg, sizeof(ErrMsg), Err);
-                return std::format("Error saving timestamps: {}", ErrMsg);
+                if (m_Storage->GetRecord(Entry, false, true) == false) return false;
             }
-            uint32_t Count = static_cast<uint32_t>(m_UndoIndex);
-            std::fwrite(&Count, sizeof(uint32_t), 1, File);
-            for (uint32_t i=0; i< Count; ++i)
+
+            // The shadow goes first, the block still has what it held to take back the runs applied before a bad one
+            if (diff::Apply(m_State.m_Shadow, Entry.m_CacheUndoData, bForward) == false)
             {
-                const auto& Entry = *m_History[i];
-                std::fwrite(&Entry.m_TimeStamp, sizeof(uint64_t), 1, File);
+                std::memcpy(m_State.m_Shadow.data(), m_State.m_pState, m_State.m_Size);
+                return false;
             }
-            fclose(File);
-
-            return {};
+            return diff::Apply({ m_State.m_pState, m_State.m_Size }, Entry.m_CacheUndoData, bForward);
         }
 
-        // Loads history timestamps from disk
-        [[nodiscard]] std::string LoadTimestamps( std::string_view FilePath={} ) noexcept
+        // Keeps a copy of the block when the cursor is on a keyframe position
+        void TakeKeyframe(void) noexcept
         {
-            assert(m_Done == false);
-            assert(!m_UndoPath.empty());
+            if (m_State.m_pState == nullptr) return;
+            const auto Cursor = m_History.getBase() + m_UndoIndex;
+            if (Cursor % m_State.m_Interval == 0) AddKeyframe(Cursor, Cursor);
+        }
 
-            std::string Path;
-            if (FilePath.empty())
+        // Keeps m_Shadow as the keyframe of Position. When there are m_MaxKeyframes already, the one farthest
+        // from Center gives its memory to it, unless Position is the farthest
+        void AddKeyframe(std::uint64_t Position, std::uint64_t Center) noexcept
+        {
+            auto& Keyframes = m_State.m_Keyframes;
+            if (m_State.m_MaxKeyframes == 0 || Keyframes.contains(Position)) return;
+            if (Keyframes.size() < m_State.m_MaxKeyframes)
             {
-                Path = std::format("{}/UndoTimestamps.bin", m_UndoPath);
-                FilePath = Path;
+                Keyframes.emplace(Position, m_State.m_Shadow);
+                return;
             }
 
-            //
-            // Make sure everything is reset to zero
-            //
+            auto Distance = [&](std::uint64_t P) { return P > Center ? P - Center : Center - P; };
+            auto First    = Keyframes.begin();
+            auto Last     = std::prev(Keyframes.end());
+            auto Farthest = Distance(First->first) >= Distance(Last->first) ? First : Last;
+            if (Distance(Farthest->first) <= Distance(Position)) return;
 
-            // Wait for all load_entries jobs to finish
-            SynJobQueue();
+            auto Node = Keyframes.extract(Farthest);
+            Node.key() = Position;
+            Node.mapped().assign(m_State.m_Shadow.begin(), m_State.m_Shadow.end());
+            Keyframes.insert(std::move(Node));
+        }
 
-            m_History.clear();
-            m_LRU.clear();
-            m_UndoIndex = 0;
+        // Steps of the command may be redone from their payload, which must be loaded first
+        template<typename T_COMMAND>
+        static bool hasForwardPayload(T_COMMAND& Cmd) noexcept
+        {
+            return Cmd.canRestoreForward() || Cmd.getAutoBackupArena().empty() == false;
+        }
 
-            //
-            // Load history from saved timestamps
-            //
-            FILE* File;
-            if (auto Err = fopen_s(&File, FilePath.data(), "rb"); !Err)
+        // Restores the state kept after the step when there is one, runs Redo otherwise. The entry must be locked
+        template<typename T_COMMAND>
+        static bool RunRedo(T_COMMAND& Cmd, history_entry& Entry) noexcept
+        {
+            if (auto Arena = Cmd.getAutoBackupArena(); Arena.empty() == false)
             {
-                uint32_t Count;
-                std::fread(&Count, sizeof(uint32_t), 1, File);
-                m_History.resize(Count);
-                for (uint32_t i = 0; i < Count; ++i)
-                {
-                    m_History[i] = std::make_shared<history_entry>();
-                    uint64_t TimeStamp;
-                    std::fread(&TimeStamp, sizeof(uint64_t), 1, File);
-                    m_History[i]->m_TimeStamp = TimeStamp;
-                    m_History[i]->m_bHasBeenSaved = true;
-                    PushJob(std::make_unique<job::load_entries>(*this, m_History[i]));
-                }
-                fclose(File);
-                m_UndoIndex = Count;
+                return diff::Apply(Arena, Entry.m_CacheUndoData, true);
             }
-            else
+            if (Entry.m_ForwardOffset && Entry.m_CacheUndoData.empty() == false)
             {
-                char ErrMsg[100];
-                strerror_s(ErrMsg, sizeof(ErrMsg), Err);
-                return std::format("Error: {}", ErrMsg);
+                undo_file File(Entry, Entry.m_ForwardOffset);
+                Cmd.Undo(File);
+                return true;
             }
+            return Cmd.Parse(Entry.m_CommandString).empty() && Cmd.Redo().empty();
+        }
 
-            // Wait for all load_entries jobs to finish
-            SynJobQueue();
+        // Keeps the state after the step when running Redo again costs more than keeping and restoring it. The size
+        // of the undo payload is the first guess for the size of the "after" one. Steps without undo payload keep nothing.
+        void CaptureForward(command_base& Cmd, history_entry& Entry, std::chrono::nanoseconds RedoTime) noexcept
+        {
+            const auto UndoSize = Entry.m_CacheUndoData.size();
+            auto       isWorth  = [&](std::size_t Bytes) { return RedoTime >= m_Forward.m_MinRedoTime && RedoTime.count() >= Bytes * m_Forward.m_NsPerByte; };
+            if (UndoSize == 0 || isWorth(UndoSize) == false) return;
 
-            //
-            // Cache latest steps
-            //
-            for (int i = std::max(0, static_cast<int>(m_UndoIndex) - static_cast<int>(m_MaxCachedSteps)); i < m_UndoIndex; ++i)
             {
-                m_LRU.push_back(m_History[i]);
-                if (m_History[i]->m_CacheUndoData.empty() && m_History[i]->m_bHasBeenSaved)
-                    PushJob(std::make_unique<job::warmup_cache>(*this, m_History[i]));
+                undo_file File(Entry, static_cast<std::uint32_t>(UndoSize));
+                Cmd.BackupCurrenState(File);
             }
 
-            return {};
+            if (isWorth(Entry.m_CacheUndoData.size() - UndoSize)) Entry.m_ForwardOffset = static_cast<std::uint32_t>(UndoSize);
+            else                                                  Entry.m_CacheUndoData.resize(UndoSize);
         }
 
-    protected:
-
-        void RegisterCommand(command_base& Cmd, std::string_view Name) noexcept
+        // User of the step at Position, from the index when it has it so that the page is not faulted in
+        int getUserID(std::size_t Position) noexcept
         {
-            m_Commands[std::string(Name)] = &Cmd;
-            Cmd.m_hHelp = Cmd.m_Parser.addOption("h", "Show this help message\nUse -h or --h to display", false, 0);
+            if (const auto Meta = m_History.getMeta(Position)) return storage::getIndexMetaUser(Meta);
+
+            auto& Entry = *m_History[Position];
+            Entry.WaitHydrated();
+            return Entry.m_UserID;
         }
 
-        void UpdateLRU() noexcept
+        // The stacks are built from the history the first time they are needed (and after loading or switching
+        // branch). Users and commands stay resident with the time stamps (see paged_history::getMeta), so only
+        // histories loaded from indexes older than that fault their pages in.
+        user_stack& getUserStack(int UserID) noexcept
         {
-            if (m_History.empty())return;
-
-            assert(m_MaxCachedSteps > (m_LookAheadSteps*2+1) );
-            const auto SizeEstimation = m_MaxCachedSteps - m_LookAheadSteps * 2 - 1;
-            while (m_LRU.size() > SizeEstimation)
+            if (m_bUserStacks == false)
             {
-                auto Oldest = m_LRU.front();
-                std::unique_lock<std::mutex> lock(Oldest->m_Mutex);
-                if (Oldest->m_bHasBeenSaved) Oldest->m_CacheUndoData.clear();
-                lock.unlock();
-                m_LRU.pop_front();
+                m_UserStacks.clear();
+                for (int i = 0; i < m_UndoIndex; ++i)
+                {
+                    auto& Stack = m_UserStacks[getUserID(i)];
+                    (m_History.isUndone(i) ? Stack.m_Undone : Stack.m_Applied).push_back(m_History.getBase() + i);
+                }
+                m_bUserStacks = true;
+                TrimHistory();
             }
+            return m_UserStacks[UserID];
+        }
 
-            for (int i = 1; i <= m_LookAheadSteps && m_LRU.size() < m_MaxCachedSteps; ++i)
+        // Unique and always increasing, even with more than a thousand steps in a millisecond (the time stamp runs
+        // ahead of the clock then) or when the clock goes back. Stays close to the clock so time queries work.
+        std::uint64_t NewTimeStamp(void) noexcept
+        {
+            m_LastTimeStamp = std::max(toTimeStamp(std::chrono::system_clock::now()), m_LastTimeStamp + 1);
+            return m_LastTimeStamp;
+        }
+
+        // Like the user stacks, the secondary indexes are built the first time a query needs them
+        history_index& getHistoryIndex(void) noexcept
+        {
+            if (m_bHistoryIndex == false)
             {
-                if (m_UndoIndex >= i && m_History[m_UndoIndex - i]->m_CacheUndoData.empty())
+                // Interned IDs of the registered commands by the hash the index keeps
+                std::unordered_map<std::uint32_t, std::uint32_t> Commands;
+                for (std::uint32_t ID = 0; ID < m_Commands.size(); ++ID)
                 {
-                    PushJob(std::make_unique<job::warmup_cache>(*this, m_History[m_UndoIndex - i]));
-                    m_LRU.push_back(m_History[m_UndoIndex - i]);
+                    if (m_Commands[ID]) Commands.emplace(storage::CommandNameHash(m_Commands[ID]->m_pCommandName), ID);
                 }
-                if (m_UndoIndex + i < m_History.size() && m_History[m_UndoIndex + i]->m_CacheUndoData.empty())
+
+                m_HistoryIndex.clear();
+                for (std::size_t i = 0; i < m_History.size(); ++i)
                 {
-                    PushJob(std::make_unique<job::warmup_cache>(*this, m_History[m_UndoIndex + i]));
-                    m_LRU.push_back(m_History[m_UndoIndex + i]);
+                    const auto Meta = m_History.getMeta(i);
+                    if (auto It = Commands.find(storage::getIndexMetaCommand(Meta)); Meta && It != Commands.end())
+                    {
+                        m_HistoryIndex.Add(storage::getIndexMetaUser(Meta), It->second, m_History.getBase() + i);
+                        continue;
+                    }
+
+                    auto& Entry = *m_History[i];
+                    Entry.WaitHydrated();
+                    m_HistoryIndex.Add(Entry.m_UserID, Entry.m_CommandID, m_History.getBase() + i);
                 }
+                m_bHistoryIndex = true;
+                TrimHistory();
             }
+            return m_HistoryIndex;
         }
 
-        void PushJob(std::unique_ptr<job::base>&& Job) noexcept
+        // Forgets the positions that are not in the history anymore
+        void TrimIndexes() noexcept
         {
-            std::lock_guard<std::mutex> lock(m_Mutex);
-            m_IOQueue.push(std::move(Job));
-            m_Cond.notify_one();
+            const auto Begin = m_History.getBase();
+            const auto End   = Begin + m_History.size();
+            if (m_bHistoryIndex) m_HistoryIndex.Trim(Begin, End);
+
+            // Keyframes are cursor positions, End included
+            auto& Keyframes = m_State.m_Keyframes;
+            Keyframes.erase(Keyframes.begin(), Keyframes.lower_bound(Begin));
+            Keyframes.erase(Keyframes.upper_bound(End), Keyframes.end());
+
+            if (m_bUserStacks == false) return;
+            for (auto& [UserID, Stack] : m_UserStacks)
+            {
+                auto& Applied = Stack.m_Applied;
+                Applied.erase(std::lower_bound(Applied.begin(), Applied.end(), End), Applied.end());
+                Applied.erase(Applied.begin(), std::lower_bound(Applied.begin(), Applied.end(), Begin));
+                std::erase_if(Stack.m_Undone, [&](std::uint64_t P) { return P < Begin || P >= End; });
+            }
         }
 
-        void SynJobQueue() noexcept
+        // A selective undo/redo of the step at Position is only safe when no step applied after it writes the same data
+        [[nodiscard]] std::string CheckConflicts(std::size_t Position) noexcept
         {
-            if (m_UndoPath.empty()) return;
-            std::unique_lock<std::mutex> Lock(m_Mutex);
-            while (!m_Cond.wait_for(Lock, std::chrono::milliseconds(100), [this] {return m_IOQueue.empty(); }))
+            std::vector<std::uint64_t> Keys;
+            std::vector<std::uint64_t> Others;
+            auto&                      Entry  = *m_History[Position];
+            auto                       pCmd   = getCommand(Entry);
+            if (pCmd == nullptr) return std::format("Error: the record of step {} could not be read", Entry.m_TimeStamp);
+
+            auto&                      Cmd    = *pCmd;
+            if (auto Err = Cmd.Parse(Entry.m_CommandString); !Err.empty()) return Err;
+            const bool                 bKnown = Cmd.getWriteKeys(Keys);
+
+            for (auto i = Position + 1; i < static_cast<std::size_t>(m_UndoIndex); ++i)
             {
+                if (m_History.isUndone(i)) continue;
+
+                auto& Other     = *m_History[i];
+                auto  pOtherCmd = getCommand(Other);
+                Others.clear();
+                if (bKnown && pOtherCmd && pOtherCmd->Parse(Other.m_CommandString).empty() && pOtherCmd->getWriteKeys(Others)
+                    && std::find_first_of(Keys.begin(), Keys.end(), Others.begin(), Others.end()) == Keys.end()) continue;
+
+                return std::format("Error: step {} of user {} conflicts with the later step {} of user {}", Entry.m_TimeStamp, Entry.m_UserID, Other.m_TimeStamp, Other.m_UserID);
             }
+            return {};
         }
 
-        // If we are in the middle of the undo buffer and we execute a new command, we need to prune the history
-        void PruneHistory() noexcept
+        // Position of a step in the current branch, -1 if it is not there
+        int FindPosition(std::uint64_t TimeStamp) const noexcept
         {
-            if (m_UndoIndex >= m_History.size())return;
-            std::vector<std::uint64_t> TimeStamps;
-            TimeStamps.reserve(m_History.size() - m_UndoIndex);
+            const auto Position = m_History.find(TimeStamp);
+            return Position == paged_history::npos ? -1 : static_cast<int>(Position);
+        }
+
+        std::vector<branch>::iterator FindBranch(std::uint64_t TimeStamp) noexcept
+        {
+            return std::find_if(m_Branches.begin(), m_Branches.end(), [&](const branch& B)
+            {
+                return std::any_of(B.m_Steps.begin(), B.m_Steps.end(), [&](const branch::step& Step) { return Step.m_TimeStamp == TimeStamp; });
+            });
+        }
+
+        // Moves the steps after the cursor into a branch, their records stay in the storage. Evicted pages are not
+        // faulted in, their steps keep their time stamp only (see LoadBranchSteps)
+        void DetachBranch() noexcept
+        {
+            if (m_UndoIndex >= m_History.size()) return;
 
-            for (auto i = m_UndoIndex; i < m_History.size(); ++i)
+            branch Branch{ m_UndoIndex ? m_History.getTimeStamp(m_UndoIndex - 1) : 0 };
+            Branch.m_Steps.reserve(m_History.size() - m_UndoIndex);
+            for (auto i = static_cast<std::size_t>(m_UndoIndex); i < m_History.size(); ++i)
             {
-                TimeStamps.push_back(m_History[i]->m_TimeStamp);
+                Branch.m_Steps.push_back({ m_History.getTimeStamp(i), m_History.getStorageSize(i), m_History.isUndone(i), m_History.peek(i) });
             }
+            m_Branches.push_back(std::move(Branch));
 
-            if (m_UndoPath.empty())
+            auto Pages = m_History.truncate(m_UndoIndex);
+            LogIndex(storage::index_op::truncate, m_UndoIndex);
+            if (m_Storage && !Pages.empty())
             {
-                for (auto& TimeStamp : TimeStamps)
-                {
-                    std::filesystem::remove(std::format("{}/UndoStep-{}", m_UndoPath, TimeStamp));
-                }
+                PushJobAfterIndex(std::make_unique<job::delete_entries>(*this, std::vector<std::uint64_t>{}, std::move(Pages)));
             }
-            else
+            TrimIndexes();
+        }
+
+        // Makes the entries of the branch steps that were not resident, their records are read by the IO threads in
+        // one job. Whoever uses them waits for them (see history_entry::WaitHydrated)
+        void LoadBranchSteps(std::vector<branch::step>& Steps) noexcept
+        {
+            std::vector<std::shared_ptr<history_entry>> Load;
+            for (auto& Step : Steps)
+            {
+                if (Step.m_Entry) continue;
+                Step.m_Entry = m_EntryPool.New();
+                Step.m_Entry->m_TimeStamp     = Step.m_TimeStamp;
+                Step.m_Entry->m_StorageSize   = Step.m_StorageSize;
+                Step.m_Entry->m_bHasBeenSaved = true;
+                Step.m_Entry->m_bUndone       = Step.m_bUndone;
+                Step.m_Entry->m_Hydration     = hydration::pending;
+                Load.push_back(Step.m_Entry);
+            }
+            if (Load.empty() == false) PushJob(std::make_unique<job::load_entries>(*this, std::move(Load), true, false));
+        }
+
+        // Deletes the branches picked by the filter plus every branch hanging off them
+        template< typename T_FILTER >
+        void DeleteBranches(T_FILTER&& Filter) noexcept
+        {
+            std::vector<std::uint64_t> TimeStamps;
+            auto                       isDead = [&](const branch& B)
+            {
+                return Filter(B) || std::find(TimeStamps.begin(), TimeStamps.end(), B.m_Parent) != TimeStamps.end();
+            };
+
+            for (auto It = std::find_if(m_Branches.begin(), m_Branches.end(), isDead); It != m_Branches.end(); It = std::find_if(m_Branches.begin(), m_Branches.end(), isDead))
             {
-                PushJob(std::make_unique<job::delete_entries>(*this, std::move(TimeStamps)));
+                for (auto& Step : It->m_Steps)
+                {
+                    TimeStamps.push_back(Step.m_TimeStamp);
+                    if (!Step.m_Entry)
+                    {
+                        m_StorageBytes -= Step.m_StorageSize;
+                        continue;
+                    }
+
+                    std::lock_guard<std::mutex> lock(Step.m_Entry->m_Mutex);
+                    Step.m_Entry->m_bHasBeenDeleted = true;
+                    if (Step.m_Entry->m_bHasBeenSaved) m_StorageBytes -= Step.m_Entry->m_StorageSize;
+                }
+                m_Branches.erase(It);
             }
-            m_History.resize(m_UndoIndex);
+
+            if (TimeStamps.empty()) return;
+            m_LRU.remove_if([](const std::shared_ptr<history_entry>& E) { return E->m_bHasBeenDeleted; });
+            if (m_Storage) PushJob(std::make_unique<job::delete_entries>(*this, std::move(TimeStamps)));
         }
 
         // This is the worker thread that handles IO operations
@@ -660,28 +5071,102 @@ namespace xundo
             while (true)
             {
                 std::unique_ptr<job::base> Job;
+                bool                       bIdle = false;
                 {
                     std::unique_lock<std::mutex> lock(System.m_Mutex);
-                    System.m_Cond.wait(lock, [&System] {return !System.m_IOQueue.empty() || System.m_Done; });
+                    System.m_Cond.wait(lock, [&System] {return !System.m_IOQueue.empty() || !System.m_IdleQueue.empty() || System.m_Done; });
                     if (System.m_Done && System.m_IOQueue.empty())return;
                     if (!System.m_IOQueue.empty())
                     {
                         Job = std::move(System.m_IOQueue.front());
                         System.m_IOQueue.pop();
                     }
+                    else if (!System.m_IdleQueue.empty())
+                    {
+                        Job = std::move(System.m_IdleQueue.front());
+                        System.m_IdleQueue.pop();
+                        bIdle = true;
+                    }
                     else continue;
+                    if (!bIdle) ++System.m_RunningJobs;
                 }
                 Job->Execute();
+                if (!bIdle)
+                {
+                    std::lock_guard<std::mutex> lock(System.m_Mutex);
+                    if (--System.m_RunningJobs == 0) System.m_Cond.notify_all();
+                }
+            }
+        }
+
+        // Redo then undo of each sample on the shadow database must leave it as it was before the step
+        static void ValidationWorker(system& System) noexcept
+        {
+            auto& Validator = *System.m_pValidator;
+            auto& Shadow    = Validator.getSystem();
+            while (true)
+            {
+                validation_sample Sample;
+                {
+                    std::unique_lock<std::mutex> Lock(System.m_ValidationMutex);
+                    System.m_ValidationCond.wait(Lock, [&System] { return !System.m_ValidationQueue.empty() || System.m_bValidationDone; });
+                    if (System.m_bValidationDone) return;
+                    Sample = std::move(System.m_ValidationQueue.front());
+                    System.m_ValidationQueue.pop_front();
+                }
+
+                const auto  Start   = std::chrono::steady_clock::now();
+                bool        bSkip   = Sample.m_CommandID >= Shadow.m_Commands.size() || Shadow.m_Commands[Sample.m_CommandID] == nullptr;
+                std::string Failure;
+                if (bSkip == false)
+                {
+                    auto&         Cmd = *Shadow.m_Commands[Sample.m_CommandID];
+                    history_entry Entry;
+                    Cmd.m_pDataBase = Validator.getDataBase();
+                    Validator.Assign(Cmd.m_pDataBase, Sample.m_pBefore);
+
+                    if (auto Err = Cmd.Parse(Sample.m_Command); !Err.empty()) Failure = std::format("Error: step {} '{}' failed to parse, {}", Sample.m_TimeStamp, Sample.m_Command, Err);
+                    else
+                    {
+                        {
+                            undo_file File(Entry);
+                            Cmd.BackupCurrenState(File);
+                        }
+                        if (auto Err = Cmd.Redo(); !Err.empty()) Failure = std::format("Error: step {} '{}' failed to redo, {}", Sample.m_TimeStamp, Sample.m_Command, Err);
+                        else
+                        {
+                            undo_file File(Entry);
+                            Cmd.Undo(File);
+                            if (Validator.Compare(Cmd.m_pDataBase, Sample.m_pBefore) == false)
+                                Failure = std::format("Error: undoing step {} '{}' does not give back the database it started from", Sample.m_TimeStamp, Sample.m_Command);
+                        }
+                    }
+                }
+                Validator.Destroy(Sample.m_pBefore);
+                System.m_ValidationTime += std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - Start).count();
+
+                std::lock_guard<std::mutex> Lock(System.m_ValidationMutex);
+                auto& Stats = System.m_ValidationStats;
+                if (bSkip) ++Stats.m_Skipped;
+                else       ++Stats.m_Checked;
+                if (Failure.empty()) continue;
+
+                ++Stats.m_Mismatches;
+                Stats.m_Failures.push_back(std::move(Failure));
+                if (Stats.m_Failures.size() > System.m_Validation.m_MaxFailures) Stats.m_Failures.erase(Stats.m_Failures.begin());
             }
         }
 
     protected:
 
+        entry_pool                                      m_EntryPool         = {};   // First so it outlives every entry
         int                                             m_UndoIndex         = 0;
-        std::vector<std::shared_ptr<history_entry>>     m_History           = {};
+        paged_history                                   m_History           = {};
+        std::size_t                                     m_ResidentPageRadius= 2;
         std::list<std::shared_ptr<history_entry>>       m_LRU               = {};
-        std::unordered_map<std::string, command_base*>  m_Commands          = {};
+        std::vector<command_base*>                      m_Commands          = {};   // Indexed by interned command name
         std::string                                     m_UndoPath          = {};
+        std::unique_ptr<storage::base>                  m_Storage           = {};
         int                                             m_DefaultUser       = 1;
         size_t                                          m_MaxCachedSteps    = 50;
         size_t                                          m_LookAheadSteps    = 5;
@@ -689,14 +5174,233 @@ namespace xundo
         mutable std::mutex                              m_Mutex             = {};
         std::condition_variable                         m_Cond              = {};
         std::queue<std::unique_ptr<job::base>>          m_IOQueue           = {};
+        std::queue<std::unique_ptr<job::base>>          m_IdleQueue         = {};   // Low priority jobs (garbage collection)
+        std::size_t                                     m_RunningJobs       = 0;    // Jobs of m_IOQueue being executed, guarded by m_Mutex
         bool                                            m_Done              = true;
         bool                                            m_bAutoLoadSave     = false;
-        std::uint64_t                                   m_CommandCounter    = 0;
+        std::uint64_t                                   m_LastTimeStamp     = 0;    // Time stamp of the newest step
+        std::size_t                                     m_RedoThreads       = std::max(std::thread::hardware_concurrency(), 1u);
+        forward_policy                                  m_Forward           = {};
+        state_history                                   m_State             = {};
+        std::vector<std::uint64_t>                      m_ReleasedTimeStamps= {};   // Scratch lists, see Reuse
+        std::vector<std::uint64_t>                      m_ReleasedPages     = {};
+        std::vector<std::byte>                          m_AutoBackup        = {};   // The arena before Redo (see command_base::getAutoBackupArena)
+        std::atomic<std::uint64_t>                      m_StorageBytes      = 0;
+        retention_policy                                m_Retention         = {};
+        bool                                            m_bTrimmingBytes    = false;   // Past the byte cap, trimming down to 3/4 of it
+        std::mutex                                      m_IndexMutex        = {};   // Guards the members of the index log below
+        std::vector<pending_index_op>                   m_PendingIndexOps   = {};
+        storage::index_state                            m_IndexState        = {};   // The index as the log in the storage has it
+        std::size_t                                     m_IndexOpsSinceSnapshot = 0;
+        std::vector<std::byte>                          m_IndexOps          = {};   // Scratch of WritePendingIndexOps
+        std::vector<std::uint64_t>                      m_IndexOrphans      = {};
+        bool                                            m_bUndoTree         = false;
+        std::vector<branch>                             m_Branches          = {};   // The rest of the undo tree
+        std::unordered_map<int, user_stack>             m_UserStacks        = {};
+        bool                                            m_bUserStacks       = false;    // m_UserStacks matches the history
+        history_index                                   m_HistoryIndex      = {};
+        bool                                            m_bHistoryIndex     = false;    // m_HistoryIndex matches the history
+        shadow_validator*                               m_pValidator        = nullptr;
+        validation_policy                               m_Validation        = {};
+        validation_stats                                m_ValidationStats   = {};       // Guarded by m_ValidationMutex
+        std::deque<validation_sample>                   m_ValidationQueue   = {};       // Guarded by m_ValidationMutex
+        bool                                            m_bValidationDone   = false;    // Guarded by m_ValidationMutex
+        std::thread                                     m_ValidationThread  = {};
+        mutable std::mutex                              m_ValidationMutex   = {};
+        std::condition_variable                         m_ValidationCond    = {};
+        std::uint64_t                                   m_SampleSeed        = 0x9E3779B97F4A7C15ull;   // xorshift state
+        std::chrono::steady_clock::time_point           m_ValidationStart   = {};
+        std::atomic<std::int64_t>                       m_ValidationTime    = 0;        // Nanoseconds used by the copies and the checks
 
     protected:
 
         friend int example::StressTest();
+        friend int example::JournalTest();
+        friend int example::PagingTest();
+        friend int example::StateHistoryTest();
+        friend int example::UserUndoTest();
+        friend int example::SaveFailureTest();
+        friend int example::IndexFailureTest();
+        friend int example::PositionIndexTest();
+        friend int example::MemoryOnlyTest();
+        friend int example::BranchPagingTest();
+        friend int example::BadBackupTest();
+        friend int example::StateFailureTest();
         friend struct command_base;
+        friend struct job::save_to_disk;
+        friend struct job::load_entries;
+        friend struct job::collect_garbage;
+        friend class paged_history;
+    };
+
+    // The usual shadow_validator, for a database that can be copied and compared with ==. Register a second
+    // instance of each command with m_System (the database pointer given to them does not matter).
+    template<typename T>
+    struct shadow final : shadow_validator
+    {
+        void*   Clone       (const void* pDataBase)             noexcept override { return new T(*static_cast<const T*>(pDataBase)); }
+        void    Destroy     (void* pDataBase)                   noexcept override { delete static_cast<T*>(pDataBase); }
+        void    Assign      (void* pTo, const void* pFrom)      noexcept override { *static_cast<T*>(pTo) = *static_cast<const T*>(pFrom); }
+        bool    Compare     (const void* pA, const void* pB)    noexcept override { return *static_cast<const T*>(pA) == *static_cast<const T*>(pB); }
+        void*   getDataBase (void)                              noexcept override { return &m_DataBase; }
+        system& getSystem   (void)                              noexcept override { return m_System; }
+
+        system  m_System    = {};
+        T       m_DataBase  = {};
+    };
+
+    // Compile time name table for static_system: a seed for which the hash sends every name to its own slot of a
+    // table twice the number of names, found by trying seeds until one works
+    namespace static_dispatch
+    {
+        constexpr static std::uint8_t empty_slot_v = 0xff;
+
+        constexpr std::uint32_t Hash(std::string_view Name, std::uint32_t Seed) noexcept
+        {
+            std::uint32_t H = 2166136261u ^ Seed;
+            for (const char c : Name) H = (H ^ static_cast<std::uint8_t>(c)) * 16777619u;
+            return H ^ (H >> 15);
+        }
+
+        template<std::size_t N>
+        struct perfect_hash
+        {
+            constexpr static std::size_t size_v = std::bit_ceil(N * 2);
+
+            std::uint32_t                       m_Seed  = 0;
+            std::array<std::uint8_t, size_v>    m_Slots = {};
+
+            constexpr std::size_t getSlot(std::string_view Name) const noexcept
+            {
+                return Hash(Name, m_Seed) & (size_v - 1);
+            }
+        };
+
+        template<std::size_t N>
+        consteval perfect_hash<N> Build(const std::array<std::string_view, N>& Names) noexcept
+        {
+            perfect_hash<N> Table;
+            for (;; ++Table.m_Seed)
+            {
+                Table.m_Slots.fill(empty_slot_v);
+                bool bOk = true;
+                for (std::size_t i = 0; bOk && i < N; ++i)
+                {
+                    auto& Slot = Table.m_Slots[Table.getSlot(Names[i])];
+                    if (Slot != empty_slot_v) bOk = false;
+                    else                      Slot = static_cast<std::uint8_t>(i);
+                }
+                if (bOk) return Table;
+            }
+        }
+    }
+
+    // A front for system when the commands are known at compile time. It owns the commands, finds them by their
+    // name_v with a perfect hash built at compile time and executes them through their own type (they must be final)
+    // so there is no virtual call nor string pool lookup to get there. Undo and Redo find the command of the step
+    // the same way. The storage, the selective undo and the rest are the ones of getSystem().
+    template<typename... T_COMMANDS>
+    class static_system
+    {
+    public:
+
+        static_assert(sizeof...(T_COMMANDS) > 0 && sizeof...(T_COMMANDS) < static_dispatch::empty_slot_v);
+        static_assert((std::is_final_v<T_COMMANDS> && ...), "The commands must be final so the calls to them are direct");
+
+        constexpr static std::size_t                                        count_v = sizeof...(T_COMMANDS);
+        constexpr static std::array<std::string_view, count_v>              names_v = { T_COMMANDS::name_v... };
+        constexpr static static_dispatch::perfect_hash<count_v>             hash_v  = static_dispatch::Build(names_v);
+
+        static_system(void* pDataBase) noexcept : m_Commands(m_System, pDataBase)
+        {
+        }
+
+        // Index of the command in T_COMMANDS, count_v when there is none with that name
+        constexpr static std::size_t Find(std::string_view Name) noexcept
+        {
+            const std::size_t Index = hash_v.m_Slots[hash_v.getSlot(Name)];
+            return Index < count_v && names_v[Index] == Name ? Index : count_v;
+        }
+
+        [[nodiscard]] std::string Execute(std::string_view cmd_str, int UserID = -1) noexcept
+        {
+            const auto Name  = getCommandName(cmd_str);
+            const auto Index = Find(Name);
+            if (Index == count_v) return std::format("Unable find the command: {}", Name);
+            return Dispatch(Index, cmd_str, UserID, std::index_sequence_for<T_COMMANDS...>{});
+        }
+
+        static_system& Undo(void) noexcept
+        {
+            m_System.UndoAs(step_dispatch{ *this });
+            return *this;
+        }
+
+        static_system& Redo(void) noexcept
+        {
+            m_System.RedoAs(step_dispatch{ *this });
+            return *this;
+        }
+
+        template<typename T>
+        T& get(void) noexcept
+        {
+            return static_cast<holder<T>&>(m_Commands).m_Command;
+        }
+
+        system& getSystem(void) noexcept
+        {
+            return m_System;
+        }
+
+    protected:
+
+        // The commands register their address with the system, so they are built in place
+        template<typename T>
+        struct holder
+        {
+            holder(system& System, void* pDataBase) noexcept : m_Command(System, pDataBase) {}
+            T m_Command;
+        };
+
+        struct commands : holder<T_COMMANDS>...
+        {
+            commands(system& System, void* pDataBase) noexcept : holder<T_COMMANDS>(System, pDataBase)... {}
+        };
+
+        template<std::size_t... I>
+        std::string Dispatch(std::size_t Index, std::string_view cmd_str, int UserID, std::index_sequence<I...>) noexcept
+        {
+            std::string Err;
+            (void)((Index == I && (Err = m_System.ExecuteAs(get<std::tuple_element_t<I, std::tuple<T_COMMANDS...>>>(), cmd_str, UserID), true)) || ...);
+            return Err;
+        }
+
+        template<typename T_FUNCTION, std::size_t... I>
+        bool Visit(std::size_t Index, T_FUNCTION& Function, std::index_sequence<I...>) noexcept
+        {
+            bool bOk = false;
+            (void)((Index == I && (bOk = Function(get<std::tuple_element_t<I, std::tuple<T_COMMANDS...>>>()), true)) || ...);
+            return bOk;
+        }
+
+        // The dispatch of Undo/Redo (see system::UndoAs): the command of the step by the name in its command string
+        struct step_dispatch
+        {
+            static_system& m_Static;
+
+            template<typename T_FUNCTION>
+            bool operator()(const history_entry& Entry, T_FUNCTION&& Function) const noexcept
+            {
+                if (Entry.WaitHydrated() == false) return false;
+                const auto Index = Find(getCommandName(Entry.m_CommandString));
+                assert(Index < count_v);
+                return m_Static.Visit(Index, Function, std::index_sequence_for<T_COMMANDS...>{});
+            }
+        };
+
+        system      m_System;
+        commands    m_Commands;
     };
 
     //-----------------------------------------------------------------------------------------------------------
@@ -717,36 +5421,122 @@ namespace xundo
         inline
         void save_to_disk::Execute() noexcept
         {
-            std::unique_lock<std::mutex> lock(m_Entry->m_Mutex);
-            if (!m_Entry->m_bHasBeenSaved && Save(*m_Entry, m_System.getUndoPath()))
-                m_Entry->m_bHasBeenSaved = true;
+            bool bFailed = false;
+            {
+                std::unique_lock<std::mutex> lock(m_Entry->m_Mutex);
+                if (!m_Entry->m_bHasBeenSaved && !m_Entry->m_bHasBeenDeleted && !m_Entry->m_bSaveFailed)
+                {
+                    int Tries = 0;
+                    while (Tries < max_tries_v && m_System.getStorage().PutRecord(*m_Entry) == false) ++Tries;
+
+                    if (Tries < max_tries_v)
+                    {
+                        m_Entry->m_bHasBeenSaved = true;
+                        m_System.m_StorageBytes += m_Entry->m_StorageSize;
+                    }
+                    else m_Entry->m_bSaveFailed = bFailed = true;
+                }
+            }
+            if (bFailed) std::cerr << std::format("Error: failed to save the record of step {}, it is kept in memory for this session only\n", m_Entry->m_TimeStamp);
+
+            // The push of this step in the index log was waiting for the record
+            if (m_System.m_bAutoLoadSave) m_System.FlushIndexLog();
         }
 
         //-----------------------------------------------------------------------------------------------------------
         inline
         void delete_entries::Execute() noexcept
         {
+            auto& Storage = m_System.getStorage();
             for (auto& TimeStamp : m_TimeStamps)
-                std::filesystem::remove(std::format("{}/UndoStep-{}", m_System.getUndoPath(), TimeStamp));
+                Storage.DeleteRecord(TimeStamp);
+            for (auto& Page : m_Pages)
+                Storage.DeletePage(Page);
         }
 
         //-----------------------------------------------------------------------------------------------------------
         inline
-        void warmup_cache::Execute() noexcept
+        void load_entries::Execute() noexcept
         {
-            std::unique_lock<std::mutex> lock(m_Entry->m_Mutex);
-            if (m_Entry->m_CacheUndoData.empty())
-                Load(*m_Entry, m_System.getUndoPath(), false, true );
+            for (auto& Entry : m_Entries)
+            {
+                bool bOk = true;
+                {
+                    std::unique_lock<std::mutex> lock(Entry->m_Mutex);
+                    const bool bLoadCacheData = m_bLoadCacheData && Entry->m_CacheUndoData.empty();
+                    if (Entry->m_bHasBeenDeleted == false && (m_bLoadKeyData || bLoadCacheData))
+                    {
+                        // Sizes from the index are accounted already, older indexes did not have them
+                        const bool bCount = m_bLoadKeyData && Entry->m_StorageSize == 0;
+                        bOk = m_System.getStorage().GetRecord(*Entry, m_bLoadKeyData, bLoadCacheData);
+                        if (bOk && bCount) m_System.m_StorageBytes += Entry->m_StorageSize;
+                    }
+                    if (m_bLoadKeyData == false) continue;
+                    Entry->m_Hydration = bOk ? hydration::done : hydration::failed;
+                }
+                if (bOk == false) std::cerr << std::format("Error: failed to load the record of step {}\n", Entry->m_TimeStamp);
+                Entry->m_Hydration.notify_all();
+            }
+        }
+
+        //-----------------------------------------------------------------------------------------------------------
+        inline
+        void collect_garbage::Execute() noexcept
+        {
+            auto& Storage = m_System.getStorage();
+            if (!m_Scanner) m_Scanner = Storage.ScanKeys();
+            if (!m_Scanner) return;
+
+            std::vector<storage::stored_key> Keys;
+            const bool  bMore   = m_Scanner->Next(batch_size_v, Keys);
+            std::size_t Deleted = 0;
+
+            for (auto& Key : Keys)
+            {
+                if (Key.m_bPage)
+                {
+                    // Losing a page is harmless anyway, it is rebuilt from the records. Pages past the ones in use
+                    // may have been written after the scan started (like the records from m_Newer on), so only
+                    // the dropped ones go
+                    if (Key.m_Key >= m_FirstPage) continue;
+                    Storage.DeletePage(Key.m_Key);
+                }
+                else
+                {
+                    if (Key.m_Key >= m_Newer || std::binary_search(m_Live.begin(), m_Live.end(), Key.m_Key)) continue;
+                    Storage.DeleteRecord(Key.m_Key);
+                }
+                ++Deleted;
+            }
+
+            if (Deleted) std::this_thread::sleep_for(std::chrono::microseconds(Deleted * 1000000 / deletes_per_second_v));
+            if (bMore) m_System.PushIdleJob(std::make_unique<collect_garbage>(std::move(*this)));
         }
 
         //-----------------------------------------------------------------------------------------------------------
+        inline
+        void save_page::Execute() noexcept
+        {
+            m_System.getStorage().PutPage(m_Key, m_Data);
+        }
 
+        //-----------------------------------------------------------------------------------------------------------
         inline
-        void load_entries::Execute() noexcept
+        void warmup_cache::Execute() noexcept
         {
             std::unique_lock<std::mutex> lock(m_Entry->m_Mutex);
-            warmup_cache::Load(*m_Entry, m_System.getUndoPath(), true, false );
+            if (m_Entry->m_CacheUndoData.empty())
+                m_System.getStorage().GetRecord(*m_Entry, false, true );
         }
+
+    }
+
+    //-----------------------------------------------------------------------------------------------------------
+    inline
+    void paged_history::LoadRecords(std::vector<std::shared_ptr<history_entry>>&& Entries) const noexcept
+    {
+        assert(m_pSystem);
+        m_pSystem->PushJob(std::make_unique<job::load_entries>(*m_pSystem, std::move(Entries), true, false));
     }
 }
 #endif // XUNDO_H
\ No newline at end of file